@@ -0,0 +1,130 @@
+// Fan-out throughput of a running cserverd: opens clients connections,
+// lets senders of them send MSG lines as fast as the server takes them, and
+// counts the lines every client receives. Compare, for example,
+//
+//     cserverd -p 4 127.0.0.1:7777      (worker processes)
+//     cserverd -w 4 127.0.0.1:7777      (room worker threads; pass a room)
+//     cserverd 127.0.0.1:7777           (one event loop)
+//
+// Usage: bench_fanout <host:port> [clients] [senders] [seconds] [room]
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+static const size_t SEND_WINDOW = 64 * 1024;  // unsent bytes kept queued per sender
+
+struct Conn {
+    int fd = -1;
+    std::string out;
+    uint64_t lines = 0;
+};
+
+static uint64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Blocking connect and handshake; returns false if the server said ERROR.
+static bool open_client(Conn &c, const sockaddr_in &addr, const std::string &nick, const char *room) {
+    c.fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c.fd < 0 || connect(c.fd, (const sockaddr *)&addr, sizeof(addr)) < 0) return false;
+    int on = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    std::string hello = "NICK " + nick + "\n";
+    if (room) hello += std::string("JOIN ") + room + "\n";
+    if (send(c.fd, hello.data(), hello.size(), 0) != (ssize_t)hello.size()) return false;
+    // HELLO, OK and, in a room, JOINED
+    size_t want = room ? 3 : 2;
+    std::string got;
+    char buf[4096];
+    while (std::count(got.begin(), got.end(), '\n') < (long)want) {
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if (n <= 0) return false;
+        got.append(buf, n);
+        if (got.find("ERROR") != std::string::npos) return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <host:port> [clients] [senders] [seconds] [room]\n", argv[0]);
+        return 1;
+    }
+    std::string hostport = argv[1];
+    size_t colon = hostport.rfind(':');
+    int clients = argc > 2 ? atoi(argv[2]) : 100;
+    int senders = argc > 3 ? atoi(argv[3]) : 10;
+    int seconds = argc > 4 ? atoi(argv[4]) : 5;
+    const char *room = argc > 5 ? argv[5] : nullptr;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(hostport.c_str() + colon + 1));
+    if (colon == std::string::npos || inet_pton(AF_INET, hostport.substr(0, colon).c_str(), &addr.sin_addr) != 1) {
+        fprintf(stderr, "Bad address %s\n", argv[1]);
+        return 1;
+    }
+    if (senders > clients) senders = clients;
+
+    std::vector<Conn> conns(clients);
+    for (int i = 0; i < clients; ++i) {
+        if (!open_client(conns[i], addr, "bench" + std::to_string(i), room)) {
+            fprintf(stderr, "Client %d failed to connect or register\n", i);
+            return 1;
+        }
+    }
+    for (Conn &c : conns) fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL) | O_NONBLOCK);
+
+    const std::string line = "MSG " + std::string(64, 'x') + "\n";
+    uint64_t sent_bytes = 0;
+    std::vector<pollfd> pfds(clients);
+    uint64_t start = now_ms(), end = start + seconds * 1000ULL;
+    char buf[64 * 1024];
+    while (now_ms() < end) {
+        for (int i = 0; i < clients; ++i) {
+            Conn &c = conns[i];
+            while (i < senders && c.out.size() < SEND_WINDOW) c.out += line;
+            pfds[i] = pollfd{c.fd, (short)(POLLIN | (c.out.empty() ? 0 : POLLOUT)), 0};
+        }
+        if (poll(pfds.data(), pfds.size(), 100) < 0) break;
+        for (int i = 0; i < clients; ++i) {
+            Conn &c = conns[i];
+            if (pfds[i].revents & POLLOUT) {
+                ssize_t n = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+                if (n > 0) {
+                    sent_bytes += n;
+                    c.out.erase(0, n);
+                }
+            }
+            if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+                if (n == 0 || (n < 0 && errno != EAGAIN)) {
+                    fprintf(stderr, "Client %d was disconnected\n", i);
+                    return 1;
+                }
+                for (ssize_t k = 0; k < n; ++k) c.lines += buf[k] == '\n';
+            }
+        }
+    }
+    double secs = (now_ms() - start) / 1000.0;
+    uint64_t received = 0;
+    for (Conn &c : conns) {
+        received += c.lines;
+        close(c.fd);
+    }
+    printf("%d clients, %d senders, %.1f s: sent %.0f lines/s, delivered %.0f lines/s\n", clients, senders, secs,
+           sent_bytes / line.size() / secs, received / secs);
+    return 0;
+}
@@ -0,0 +1,103 @@
+// Throughput of NickRegistry under a reconnect storm: writer threads
+// register and release nicks as fast as they can while reader threads look
+// up nicks that stay registered (the MSG/SEND path). The same load is run
+// against a mutex-guarded unordered_map for comparison.
+//
+// Usage: bench_nicks [readers] [writers] [seconds]
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "nick_registry.h"
+
+static const int STABLE_NICKS = 10000;
+
+// The map the server used before NickRegistry, for reference.
+class LockedMap {
+public:
+    bool insert(const std::string &nick, uint16_t, uint64_t client) {
+        std::lock_guard<std::mutex> lk(mu);
+        return map.emplace(nick, client).second;
+    }
+
+    bool lookup(const std::string &nick, NickRegistry::Handle &out) {
+        std::lock_guard<std::mutex> lk(mu);
+        auto it = map.find(nick);
+        if (it == map.end()) return false;
+        out = NickRegistry::Handle{0, it->second};
+        return true;
+    }
+
+    void erase(const std::string &nick, uint64_t) {
+        std::lock_guard<std::mutex> lk(mu);
+        map.erase(nick);
+    }
+
+private:
+    std::mutex mu;
+    std::unordered_map<std::string, uint64_t> map;
+};
+
+template <typename Table>
+void run(const char *name, Table &table, int readers, int writers, int seconds) {
+    std::vector<std::string> stable;
+    for (int i = 0; i < STABLE_NICKS; ++i) {
+        stable.push_back("user" + std::to_string(i));
+        table.insert(stable.back(), 0, i + 1);
+    }
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> lookups{0}, registrations{0}, misses{0};
+    std::vector<std::thread> threads;
+    for (int r = 0; r < readers; ++r) {
+        threads.emplace_back([&, r] {
+            uint64_t n = 0, miss = 0;
+            uint32_t x = 2463534242u + r;
+            while (!stop.load(std::memory_order_relaxed)) {
+                x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+                NickRegistry::Handle h;
+                miss += !table.lookup(stable[x % STABLE_NICKS], h);
+                n++;
+            }
+            lookups += n;
+            misses += miss;
+        });
+    }
+    for (int w = 0; w < writers; ++w) {
+        threads.emplace_back([&, w] {
+            uint64_t n = 0;
+            uint64_t id = 1000000ULL * (w + 1);
+            std::vector<std::string> nicks;
+            for (int i = 0; i < 256; ++i) nicks.push_back("s" + std::to_string(w) + "x" + std::to_string(i));
+            while (!stop.load(std::memory_order_relaxed)) {
+                const std::string &nick = nicks[n % nicks.size()];
+                if (table.insert(nick, 0, ++id)) table.erase(nick, id);
+                n++;
+            }
+            registrations += n;
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    stop = true;
+    for (auto &t : threads) t.join();
+    printf("%-12s lookups %8.2f M/s   register+release %8.2f M/s   misses %llu\n", name,
+           lookups / 1e6 / seconds, registrations / 1e6 / seconds, (unsigned long long)misses.load());
+}
+
+int main(int argc, char *argv[]) {
+    int readers = argc > 1 ? atoi(argv[1]) : 4;
+    int writers = argc > 2 ? atoi(argv[2]) : 2;
+    int seconds = argc > 3 ? atoi(argv[3]) : 3;
+    printf("%d readers, %d writers, %d s\n", readers, writers, seconds);
+    auto *registry = new NickRegistry;
+    run("NickRegistry", *registry, readers, writers, seconds);
+    delete registry;
+    LockedMap locked;
+    run("mutex+map", locked, readers, writers, seconds);
+    return 0;
+}
@@ -0,0 +1,99 @@
+// Cost of an event loop pass with each backend in poller.h, called directly
+// (the loop instantiated per backend, as cserverd does) and through a virtual
+// interface chosen at run time. Each pass declares every connection, waits
+// without blocking, and reads the few that a "peer" wrote to.
+//
+// Usage: bench_poller [connections] [active_per_pass] [seconds]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#include "poller.h"
+
+// The run-time alternative to templating the loop.
+class AnyPoller {
+public:
+    virtual ~AnyPoller() {}
+    virtual void begin() = 0;
+    virtual void want(int fd, bool read, bool write) = 0;
+    virtual int wait(int timeout_ms) = 0;
+    virtual bool readable(int fd) const = 0;
+    virtual bool writable(int fd) const = 0;
+};
+
+template <typename Poller>
+class VirtualPoller : public AnyPoller {
+public:
+    void begin() override { p.begin(); }
+    void want(int fd, bool read, bool write) override { p.want(fd, read, write); }
+    int wait(int timeout_ms) override { return p.wait(timeout_ms); }
+    bool readable(int fd) const override { return p.readable(fd); }
+    bool writable(int fd) const override { return p.writable(fd); }
+
+private:
+    Poller p;
+};
+
+static double now_s() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The same loop for both: only the type of poller differs.
+template <typename Poller>
+double run(Poller &poller, const std::vector<int> &ours, const std::vector<int> &theirs, int active, int seconds) {
+    uint64_t passes = 0, reads = 0;
+    uint32_t x = 2463534242u;
+    char buf[64];
+    double start = now_s(), end = start + seconds;
+    while (now_s() < end) {
+        for (int i = 0; i < 256; ++i, ++passes) {
+            for (int k = 0; k < active; ++k) {
+                x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+                if (write(theirs[x % theirs.size()], "x", 1) < 0) {}
+            }
+            poller.begin();
+            for (int fd : ours) poller.want(fd, true, false);
+            poller.wait(0);
+            for (int fd : ours) {
+                if (poller.readable(fd)) reads += read(fd, buf, sizeof(buf)) > 0;
+            }
+        }
+    }
+    double secs = now_s() - start;
+    if (!reads) fprintf(stderr, "no reads?\n");
+    return passes / secs;
+}
+
+template <typename Poller>
+void compare(const std::vector<int> &ours, const std::vector<int> &theirs, int active, int seconds) {
+    Poller direct;
+    double a = run(direct, ours, theirs, active, seconds);
+    VirtualPoller<Poller> wrapped;
+    AnyPoller &any = wrapped;
+    double b = run(any, ours, theirs, active, seconds);
+    printf("%-7s direct %9.0f passes/s   virtual %9.0f passes/s   (%+.1f%%)\n", Poller::name(), a, b,
+           (b - a) / a * 100);
+}
+
+int main(int argc, char *argv[]) {
+    int conns = argc > 1 ? atoi(argv[1]) : 400;  // select() needs 2 * conns < FD_SETSIZE
+    int active = argc > 2 ? atoi(argv[2]) : 16;
+    int seconds = argc > 3 ? atoi(argv[3]) : 2;
+    std::vector<int> ours, theirs;
+    for (int i = 0; i < conns; ++i) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+            perror("socketpair");
+            return 1;
+        }
+        ours.push_back(sv[0]);
+        theirs.push_back(sv[1]);
+    }
+    printf("%d connections, %d active per pass, %d s each\n", conns, active, seconds);
+    compare<SelectPoller>(ours, theirs, active, seconds);
+    compare<EpollPoller>(ours, theirs, active, seconds);
+    return 0;
+}
@@ -0,0 +1,17 @@
+// Minimal checks for the unit tests (make check): a failed CHECK prints the
+// condition and its location and exits non-zero.
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <cstdio>
+#include <cstdlib>
+
+#define CHECK(cond)                                                                     \
+    do {                                                                                \
+        if (!(cond)) {                                                                  \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);   \
+            exit(1);                                                                    \
+        }                                                                               \
+    } while (0)
+
+#endif
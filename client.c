@@ -11,24 +11,131 @@
 #include <unistd.h>
 #include <iostream>
 #include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
 #include <algorithm>
 #include <stdexcept>
+#include <cstdint>
 
 using namespace std;
 
+// Local scrollback. Lines seen live since connecting are kept in "recent";
+// older lines are fetched from the server's journal one page at a time with
+// HISTORY and prepended to "older", which covers sequence numbers
+// oldestSeq..recentFirstSeq-1 without gaps or duplicates.
+class Scrollback {
+public:
+    static const size_t PAGE = 20;
+
+    size_t size() const { return older.size() + recent.size(); }
+    const string& at(size_t i) const { return i < older.size() ? older[i] : recent[i - older.size()]; }
+
+    void addLive(const string& line) { recent.push_back(line); liveCount++; }
+    void addOwn(const string& line) { recent.push_back(line); ownCount++; }
+
+    bool anchored() const { return recentFirstSeq != 0; }
+    bool exhausted() const { return noMore || (anchored() && oldestSeq <= 1); }
+
+    // Sequence number to ask for the next older page with, 0 for the newest.
+    uint64_t nextBefore() const { return anchored() ? oldestSeq : 0; }
+
+    // Called when the first HISTORY request goes out; own lines sent before
+    // it are already in the journal when the server answers.
+    void markRequest() { if (!anchored()) ownAtRequest = ownCount; }
+
+    // Start of a "HISTORY first count" reply. The first reply pins the
+    // sequence numbers of the lines already shown live.
+    void beginPage(uint64_t first, uint64_t count) {
+        if (!anchored()) {
+            uint64_t end = first + count;
+            uint64_t known = liveCount + ownAtRequest;
+            recentFirstSeq = end > known ? end - known : 1;
+            oldestSeq = recentFirstSeq;
+        }
+        pageSeq = first;
+        pageLines.clear();
+        if (count == 0) noMore = true;
+    }
+
+    // One line of the page being received; lines at or after the oldest one
+    // already held are duplicates and are skipped.
+    void addPageLine(const string& line) {
+        if (pageSeq < oldestSeq) pageLines.push_back(line);
+        pageSeq++;
+    }
+
+    // Merge the received page; returns the number of lines prepended.
+    size_t endPage() {
+        for (auto it = pageLines.rbegin(); it != pageLines.rend(); ++it) older.push_front(*it);
+        oldestSeq -= pageLines.size();
+        size_t added = pageLines.size();
+        pageLines.clear();
+        return added;
+    }
+
+    void markUnavailable() { noMore = true; }
+
+    // Multicast receivers learn the sequence number where the datagram stream
+    // starts; everything shown before it came over TCP and precedes it.
+    void anchorAt(uint64_t nextSeq) {
+        if (anchored()) return;
+        uint64_t known = liveCount + ownCount;
+        recentFirstSeq = nextSeq > known ? nextSeq - known : 1;
+        oldestSeq = recentFirstSeq;
+    }
+
+private:
+    deque<string> older;
+    vector<string> recent;
+    vector<string> pageLines;
+    uint64_t liveCount = 0;
+    uint64_t ownCount = 0;
+    uint64_t ownAtRequest = 0;
+    uint64_t recentFirstSeq = 0;
+    uint64_t oldestSeq = 0;
+    uint64_t pageSeq = 0;
+    bool noMore = false;
+};
+
 class NetworkClient {
 public:
     NetworkClient(const string& address, const string& nickname);
     ~NetworkClient();
+    void setMulticast(const string& group, const string& ifaddr);
+    void setTls(const string& caFile);
     void startCommunication();
 
 private:
     bool isNicknameValid(const string& nickname);
     bool splitHostPort(const string& address, string& host, string& port);
     int createSocketConnection();
+    bool startTls();
+    ssize_t sendToServer(const string& data);
+    ssize_t recvFromServer(char* buffer, size_t size);
     void sendNicknameToServer();
     void receiveServerMessages();
     void sendMessage(const string& message);
+    void handleServerLine(const string& line);
+    void handleCommand(const string& command);
+    void requestHistoryPage();
+    int joinMulticastGroup();
+    void receiveDatagram();
+    void deliverSequenced();
+    void requestRepair();
+    void finishRepair();
+    void offerFile(const string& nick, const string& path);
+    void answerOffer(const string& args, bool accept);
+    void runTransfer(uint64_t id, const string& token, const string& path, uint64_t size, bool sending);
+    void showScrollback();
     void handleError(const string& errorMsg);
     void gracefulShutdown();
 
@@ -37,6 +144,59 @@ private:
     string userNickname;
     int socketDescriptor;
     bool nicknameSent;
+
+    bool useTls = false;
+    string tlsCaFile;            // empty: the system's trusted CAs
+    SSL_CTX* tlsContext = nullptr;
+    SSL* tlsSession = nullptr;
+
+    Scrollback scrollback;
+    size_t viewTop = 0;          // first scrollback line shown by /up and /down
+    bool viewActive = false;     // user is scrolled back
+    bool historyInFlight = false;
+    bool showWhenLoaded = false; // /up hit the top before the page arrived
+    uint64_t historyLinesLeft = 0;
+    deque<char> historyKinds;    // 'P' scrollback page, 'R' gap repair, in request order
+
+    // Multicast receive mode (-m). Lines arrive as "<seq> MSG ..." datagrams;
+    // out-of-order ones wait in mcastPending and gaps are fetched with HISTORY.
+    string mcastGroup;
+    string mcastIf;
+    int mcastFd = -1;
+    bool mcastOn = false;        // server switched live lines to the group
+    uint64_t mcastNext = 0;      // next sequence number to show
+    uint64_t repairEnd = 0;      // gaps below this are already requested
+    uint64_t repairSeq = 0;      // sequence number of the next repair line
+    uint64_t repairLinesLeft = 0;
+    map<uint64_t, string> mcastPending;
+    set<uint64_t> ownSeqs;       // our lines, from the server's SENT replies
+    uint64_t sentUnconfirmed = 0;  // MSGs sent in multicast mode still without SENT
+
+    // File transfers (/send, /accept). Bytes go over a separate data
+    // connection per transfer, run on its own thread so chat is not blocked.
+    struct FileTransfer {
+        string path;             // local file; for an offer, the proposed name until accepted
+        uint64_t size;
+        bool sending;
+    };
+    deque<FileTransfer> pendingSends;   // SEND requests awaiting OFFERED or ERROR
+    map<uint64_t, FileTransfer> transfers;
+    vector<thread> transferThreads;     // joined on shutdown
+    mutex transferMutex;
+    set<int> transferFds;               // open data connections, cut on shutdown
+    bool stopping = false;              // under transferMutex
+
+    // Live lines shown since the last READ report; reported at most once a second.
+    bool readPending = false;
+    // Lobby lines are numbered with IDS, or by multicast; READ reports the last
+    // one shown, or the newest while numbers are unknown (0).
+    bool idsRequested = false;   // IDS sent, its reply not seen yet
+    bool nickAnswered = false;
+    uint64_t lastShownSeq = 0;
+    int reactionQueries = 0;     // /reactions replies still expected
+    string room;                 // joined with /join; lobby commands are off meanwhile
+    chrono::steady_clock::time_point lastReadReport;
+    void reportRead();
 };
 
 NetworkClient::NetworkClient(const string& address, const string& nickname)
@@ -47,9 +207,194 @@ NetworkClient::NetworkClient(const string& address, const string& nickname)
 }
 
 NetworkClient::~NetworkClient() {
+    // unfinished transfers are cut off rather than waited for
+    {
+        lock_guard<mutex> lock(transferMutex);
+        stopping = true;
+        for (int fd : transferFds) shutdown(fd, SHUT_RDWR);
+    }
+    for (thread &t : transferThreads) t.join();
+    if (tlsSession) {
+        SSL_shutdown(tlsSession);  // close_notify, so the server sees a clean EOF
+        SSL_free(tlsSession);
+    }
+    if (tlsContext) {
+        SSL_CTX_free(tlsContext);
+    }
     if (socketDescriptor != -1) {
         close(socketDescriptor);
     }
+    if (mcastFd != -1) {
+        close(mcastFd);
+    }
+}
+
+void NetworkClient::setTls(const string& caFile) {
+    useTls = true;
+    tlsCaFile = caFile;
+}
+
+// Blocking TLS handshake on the connected socket, verifying the server's
+// certificate against serverHost. OpenSSL moves the record layer into the
+// kernel (kTLS) when it can; SSL_read/SSL_write work the same either way.
+bool NetworkClient::startTls() {
+    tlsContext = SSL_CTX_new(TLS_client_method());
+    if (!tlsContext) return false;
+    SSL_CTX_set_min_proto_version(tlsContext, TLS1_2_VERSION);
+    SSL_CTX_set_options(tlsContext, SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_verify(tlsContext, SSL_VERIFY_PEER, nullptr);
+    int loaded = tlsCaFile.empty() ? SSL_CTX_set_default_verify_paths(tlsContext)
+                                   : SSL_CTX_load_verify_locations(tlsContext, tlsCaFile.c_str(), nullptr);
+    if (loaded != 1) {
+        cerr << "ERROR: Could not load trusted certificates.\n";
+        return false;
+    }
+
+    tlsSession = SSL_new(tlsContext);
+    if (!tlsSession) return false;
+    SSL_set_fd(tlsSession, socketDescriptor);
+    struct in6_addr ip;
+    if (inet_pton(AF_INET, serverHost.c_str(), &ip) == 1 || inet_pton(AF_INET6, serverHost.c_str(), &ip) == 1) {
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(tlsSession), serverHost.c_str());
+    } else {
+        SSL_set_tlsext_host_name(tlsSession, serverHost.c_str());
+        SSL_set1_host(tlsSession, serverHost.c_str());
+    }
+    if (SSL_connect(tlsSession) != 1) {
+        ERR_print_errors_fp(stderr);
+        long verify = SSL_get_verify_result(tlsSession);
+        if (verify != X509_V_OK) cerr << "ERROR: " << X509_verify_cert_error_string(verify) << "\n";
+        return false;
+    }
+    bool kernelTls = BIO_get_ktls_send(SSL_get_wbio(tlsSession)) && BIO_get_ktls_recv(SSL_get_rbio(tlsSession));
+    cout << "TLS established (" << SSL_get_version(tlsSession) << ", "
+         << (kernelTls ? "kernel TLS" : "user-space TLS") << ")" << endl;
+    return true;
+}
+
+ssize_t NetworkClient::sendToServer(const string& data) {
+    if (!tlsSession) return send(socketDescriptor, data.c_str(), data.size(), MSG_NOSIGNAL);
+    int n = SSL_write(tlsSession, data.c_str(), (int)data.size());
+    return n > 0 ? n : -1;
+}
+
+ssize_t NetworkClient::recvFromServer(char* buffer, size_t size) {
+    if (!tlsSession) return recv(socketDescriptor, buffer, size, 0);
+    int n = SSL_read(tlsSession, buffer, (int)size);
+    if (n > 0) return n;
+    return SSL_get_error(tlsSession, n) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+}
+
+void NetworkClient::setMulticast(const string& group, const string& ifaddr) {
+    size_t colonPos = group.find(':');
+    if (colonPos == string::npos) {
+        throw runtime_error("Invalid multicast group:port format.");
+    }
+    mcastGroup = group;
+    mcastIf = ifaddr;
+}
+
+// UDP socket bound to the group's port and joined to the group on mcastIf
+// (any interface when empty).
+int NetworkClient::joinMulticastGroup() {
+    size_t colonPos = mcastGroup.find(':');
+    string group = mcastGroup.substr(0, colonPos);
+    int port = atoi(mcastGroup.c_str() + colonPos + 1);
+
+    struct ip_mreq mreq {};
+    if (inet_pton(AF_INET, group.c_str(), &mreq.imr_multiaddr) != 1) return -1;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (!mcastIf.empty() && inet_pton(AF_INET, mcastIf.c_str(), &mreq.imr_interface) != 1) return -1;
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) return -1;
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    int rcvbuf = 1 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr = mreq.imr_multiaddr;
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void NetworkClient::receiveDatagram() {
+    char buffer[2048];
+    ssize_t bytesReceived = recv(mcastFd, buffer, sizeof(buffer), 0);
+    if (bytesReceived <= 0) return;
+
+    string datagram(buffer, bytesReceived);
+    size_t space = datagram.find(' ');
+    if (space == string::npos) return;
+    uint64_t seq = strtoull(datagram.c_str(), nullptr, 10);
+    if (seq == 0) return;
+    if (mcastOn && seq < mcastNext) return;  // duplicate or already repaired
+    // Before "MCAST ON" the starting point is unknown; keep a bounded backlog.
+    if (!mcastOn && mcastPending.size() >= 4096) mcastPending.erase(mcastPending.begin());
+    mcastPending.emplace(seq, datagram.substr(space + 1));
+    if (mcastOn) deliverSequenced();
+}
+
+// Show pending lines in sequence order, stopping at the first gap.
+void NetworkClient::deliverSequenced() {
+    while (!mcastPending.empty() && mcastPending.begin()->first == mcastNext) {
+        string line = mcastPending.begin()->second;
+        string text = line;
+        if (!text.empty() && text.back() == '\n') text.pop_back();
+        bool own = ownSeqs.count(mcastNext) > 0;
+        // It may be one of ours whose SENT is still on its way: wait for that.
+        if (!own && sentUnconfirmed > 0 && text.compare(0, userNickname.size() + 5, "MSG " + userNickname + " ") == 0) break;
+        mcastPending.erase(mcastPending.begin());
+        ownSeqs.erase(mcastNext);
+        mcastNext++;
+
+        if (text.find("MSG ") != 0) continue;
+        lastShownSeq = mcastNext - 1;
+        text = text.substr(4);
+        scrollback.addLive(text);
+        readPending = true;
+        // Our own lines come back through the group too; they were echoed locally.
+        if (own) continue;
+        cout << line.substr(4);
+    }
+    ownSeqs.erase(ownSeqs.begin(), ownSeqs.lower_bound(mcastNext));
+    cout.flush();
+    if (!mcastPending.empty()) requestRepair();
+}
+
+// Ask the journal for the lines missing between mcastNext and the oldest
+// line waiting in mcastPending. HISTORY returns at most 1000 lines per call.
+void NetworkClient::requestRepair() {
+    uint64_t gapEnd = mcastPending.begin()->first;
+    uint64_t from = max(mcastNext, repairEnd);
+    if (from >= gapEnd) return;
+    uint64_t count = min<uint64_t>(gapEnd - from, 1000);
+    string request = "HISTORY " + to_string(from + count) + " " + to_string(count) + "\n";
+    if (sendToServer(request) < 0) {
+        handleError("Failed to send history request.");
+    }
+    historyKinds.push_back('R');
+    repairEnd = from + count;
+}
+
+// A repair reply is complete. Whatever is still missing below the repaired
+// range is gone from the journal too; report it and move on.
+void NetworkClient::finishRepair() {
+    deliverSequenced();
+    if (!historyKinds.empty() && historyKinds.front() == 'R') return;  // more of the gap on the way
+    uint64_t stop = mcastPending.empty() ? repairEnd : min(repairEnd, mcastPending.begin()->first);
+    if (mcastNext < stop) {
+        cout << "--- " << stop - mcastNext << " messages lost ---" << endl;
+        mcastNext = stop;
+        deliverSequenced();
+    }
 }
 
 bool NetworkClient::isNicknameValid(const string& nickname) {
@@ -103,7 +448,7 @@ int NetworkClient::createSocketConnection() {
 
 void NetworkClient::sendNicknameToServer() {
     string nicknameCommand = "NICK " + userNickname + "\n";
-    ssize_t bytesSent = send(socketDescriptor, nicknameCommand.c_str(), nicknameCommand.size(), 0);
+    ssize_t bytesSent = sendToServer(nicknameCommand);
     if (bytesSent < 0) {
         handleError("Failed to send nickname to server.");
     }
@@ -121,14 +466,22 @@ void NetworkClient::receiveServerMessages() {
         FD_SET(STDIN_FILENO, &readFds);
 
         int maxFd = max(socketDescriptor, STDIN_FILENO);
-        int selectResult = select(maxFd + 1, &readFds, nullptr, nullptr, nullptr);
+        if (mcastFd != -1) {
+            FD_SET(mcastFd, &readFds);
+            maxFd = max(maxFd, mcastFd);
+        }
+        struct timeval tick{1, 0};
+        int selectResult = select(maxFd + 1, &readFds, nullptr, nullptr, &tick);
         if (selectResult < 0) {
             if (errno == EINTR) continue;
             handleError("select failed during receiving server messages.");
         }
+        reportRead();
 
-        if (FD_ISSET(socketDescriptor, &readFds)) {
-            ssize_t bytesReceived = recv(socketDescriptor, buffer, sizeof(buffer) - 1, 0);
+        // OpenSSL may hold decrypted bytes that select() cannot see
+        bool socketReadable = FD_ISSET(socketDescriptor, &readFds);
+        while (socketReadable) {
+            ssize_t bytesReceived = recvFromServer(buffer, sizeof(buffer) - 1);
             if (bytesReceived < 0) {
                 handleError("Failed to receive data from server.");
             } else if (bytesReceived == 0) {
@@ -144,21 +497,24 @@ void NetworkClient::receiveServerMessages() {
             while ((newlinePos = messageBuffer.find('\n')) != string::npos) {
                 string line = messageBuffer.substr(0, newlinePos + 1);
                 messageBuffer.erase(0, newlinePos + 1);
-
-                // If the line contains the message identifier "MSG ", process it
-                if (line.find("MSG ") == 0) {
-                    cout << line.substr(4);  // Print the message part after "MSG "
-                } else {
-                    cout << line;  // Print the full line
-                }
-                cout.flush();
+                handleServerLine(line);
             }
+            socketReadable = tlsSession && SSL_pending(tlsSession) > 0;
+        }
+
+        if (mcastFd != -1 && FD_ISSET(mcastFd, &readFds)) {
+            receiveDatagram();
         }
 
         if (FD_ISSET(STDIN_FILENO, &readFds)) {
             string userMessage;
             if (!getline(cin, userMessage)) break;
 
+            if (!userMessage.empty() && userMessage[0] == '/') {
+                handleCommand(userMessage);
+                continue;
+            }
+
             if (userMessage.size() > 255) {
                 cerr << "ERROR: Message too long. Max 255 characters.\n";
                 continue;
@@ -169,12 +525,414 @@ void NetworkClient::receiveServerMessages() {
     }
 }
 
+void NetworkClient::handleServerLine(const string& line) {
+    string text = line;
+    if (!text.empty() && text.back() == '\n') text.pop_back();
+
+    if (repairLinesLeft > 0) {
+        if (repairSeq >= mcastNext) mcastPending.emplace(repairSeq, line);
+        repairSeq++;
+        if (--repairLinesLeft == 0) finishRepair();
+        return;
+    }
+
+    if (historyLinesLeft > 0) {
+        scrollback.addPageLine(text.find("MSG ") == 0 ? text.substr(4) : text);
+        if (--historyLinesLeft == 0) {
+            size_t added = scrollback.endPage();
+            viewTop += added;
+            historyInFlight = false;
+            if (showWhenLoaded) {
+                showWhenLoaded = false;
+                viewTop = viewTop >= Scrollback::PAGE ? viewTop - Scrollback::PAGE : 0;
+                showScrollback();
+            }
+        }
+        return;
+    }
+
+    // NICK is answered first, then IDS; without IDS, READ falls back to the newest line
+    if (idsRequested && (text == "OK" || text.find("ERROR") == 0)) {
+        if (nickAnswered) {
+            idsRequested = false;
+            return;
+        }
+        nickAnswered = true;
+    }
+
+    unsigned long long first, count;
+    if (!historyKinds.empty() && historyKinds.front() == 'R' &&
+        sscanf(text.c_str(), "HISTORY %llu %llu", &first, &count) == 2) {
+        historyKinds.pop_front();
+        repairSeq = first;
+        repairLinesLeft = count;
+        if (count == 0) finishRepair();
+        return;
+    }
+    if (!historyKinds.empty() && historyKinds.front() == 'R' && text.find("ERROR") == 0) {
+        historyKinds.pop_front();
+        finishRepair();
+        return;
+    }
+    if (mcastFd != -1 && !mcastOn && sscanf(text.c_str(), "MCAST ON %llu", &first) == 1) {
+        mcastOn = true;
+        mcastNext = first;
+        repairEnd = first;
+        scrollback.anchorAt(first);
+        mcastPending.erase(mcastPending.begin(), mcastPending.lower_bound(mcastNext));
+        deliverSequenced();
+        return;
+    }
+    if (mcastFd != -1 && sscanf(text.c_str(), "SENT %llu", &first) == 1) {
+        ownSeqs.insert(first);
+        if (sentUnconfirmed > 0) sentUnconfirmed--;
+        if (mcastOn) deliverSequenced();
+        return;
+    }
+    if (sentUnconfirmed > 0 && (text == "ERROR: Message too long" || text == "ERROR: Server busy, slow down")) {
+        sentUnconfirmed--;  // that MSG was refused and gets no SENT
+    }
+    if (mcastFd != -1 && !mcastOn && text.find("ERROR") == 0 && text.find("Multicast") != string::npos) {
+        close(mcastFd);
+        mcastFd = -1;
+        mcastPending.clear();
+        sentUnconfirmed = 0;
+        cout << "--- multicast not enabled on this server, staying on TCP ---" << endl;
+        return;
+    }
+    if (historyInFlight && sscanf(text.c_str(), "HISTORY %llu %llu", &first, &count) == 2) {
+        historyKinds.pop_front();
+        scrollback.beginPage(first, count);
+        historyLinesLeft = count;
+        if (count == 0) {
+            historyInFlight = false;
+            if (showWhenLoaded) {
+                showWhenLoaded = false;
+                cout << "--- no older messages ---" << endl;
+            }
+        }
+        return;
+    }
+    if (historyInFlight && text.find("ERROR") == 0 && text.find("History") != string::npos) {
+        historyKinds.pop_front();
+        scrollback.markUnavailable();
+        historyInFlight = false;
+        showWhenLoaded = false;
+        cout << "--- history not available on this server ---" << endl;
+        return;
+    }
+
+    // cchat reads whole lines, so it has no keystrokes to report or show
+    if (text.rfind("TYPING ", 0) == 0) return;
+    // periodic reaction totals are only shown when asked for with /reactions
+    if (text.rfind("REACTIONS ", 0) == 0) {
+        if (reactionQueries > 0) {
+            reactionQueries--;
+            cout << line;
+        }
+        return;
+    }
+
+    char name[128], from[64];
+    unsigned long long id, size;
+    if (sscanf(text.c_str(), "OFFERED %llu %63s", &id, from) == 2 && !pendingSends.empty()) {
+        transfers[id] = pendingSends.front();
+        pendingSends.pop_front();
+        cout << "--- offered " << transfers[id].path << " to " << from << " as transfer " << id << " ---" << endl;
+        return;
+    }
+    if (text.find("ERROR: Send") == 0 && !pendingSends.empty()) {
+        pendingSends.pop_front();
+    }
+    if (sscanf(text.c_str(), "OFFER %llu %63s %llu %127s", &id, from, &size, name) == 4) {
+        transfers[id] = FileTransfer{name, size, false};
+        cout << "--- " << from << " offers " << name << " (" << size << " bytes): /accept " << id
+             << " [path] or /reject " << id << " ---" << endl;
+        return;
+    }
+    char token[64];
+    if (sscanf(text.c_str(), "XFER %llu %63s", &id, token) == 2) {
+        auto it = transfers.find(id);
+        if (it != transfers.end()) {
+            FileTransfer ft = it->second;
+            transferThreads.emplace_back(&NetworkClient::runTransfer, this, id, string(token), ft.path, ft.size,
+                                         ft.sending);
+        }
+        return;
+    }
+    char how[32];
+    if (sscanf(text.c_str(), "ENDED %llu %31s", &id, how) == 2) {
+        auto it = transfers.find(id);
+        string what = it != transfers.end() ? it->second.path : "transfer " + to_string(id);
+        cout << "--- " << what << ": " << how << " ---" << endl;
+        if (it != transfers.end()) transfers.erase(it);
+        return;
+    }
+
+    char joined[64];
+    if (sscanf(text.c_str(), "JOINED %63s %llu", joined, &count) == 2) {
+        room = joined;
+        cout << "--- joined " << room << " (" << count << " members), /part to leave ---" << endl;
+        return;
+    }
+    if (sscanf(text.c_str(), "PARTED %63s", joined) == 1) {
+        cout << "--- left " << joined << " ---" << endl;
+        room.clear();
+        return;
+    }
+
+    // "MSGID <id> <time_ms> <nick> <text>"; our own lines come back too, but
+    // were shown when sent
+    if (text.compare(0, 6, "MSGID ") == 0) {
+        size_t timeEnd = text.find(' ', text.find(' ', 6) + 1);
+        if (sscanf(text.c_str(), "MSGID %llu", &id) != 1 || timeEnd == string::npos) return;
+        string message = text.substr(timeEnd + 1);
+        bool own = message.compare(0, userNickname.size() + 1, userNickname + " ") == 0;
+        if (!room.empty()) {
+            if (!own) cout << "[" << room << "] " << message << endl;
+            return;
+        }
+        lastShownSeq = id;
+        readPending = true;
+        if (own) return;
+        scrollback.addLive(message);
+        cout << message << endl;
+        return;
+    }
+
+    // room lines are not part of the lobby's scrollback or read position
+    if (text.find("MSG ") == 0 && !room.empty()) {
+        cout << "[" << room << "] " << line.substr(4);
+    } else if (text.find("MSG ") == 0) {
+        scrollback.addLive(text.substr(4));
+        readPending = true;
+        cout << line.substr(4);  // Print the message part after "MSG "
+    } else {
+        cout << line;  // Print the full line
+    }
+    cout.flush();
+}
+
+// /up and /down page through the scrollback. History is only fetched once the
+// user scrolls near the top of what is held locally, and the page after the
+// one being viewed is prefetched so scrolling does not wait on the server.
+void NetworkClient::handleCommand(const string& command) {
+    if (command.rfind("/join ", 0) == 0) {
+        if (sendToServer("JOIN " + command.substr(6) + "\n") < 0) handleError("Failed to send command.");
+        return;
+    }
+    if (command == "/part") {
+        if (sendToServer("PART\n") < 0) handleError("Failed to send command.");
+        return;
+    }
+    if (!room.empty()) {
+        cerr << "Only messages and /part are available in a room.\n";
+        return;
+    }
+    if (command == "/up") {
+        if (!viewActive) {
+            viewActive = true;
+            viewTop = scrollback.size();
+        }
+        if (viewTop == 0) {
+            if (scrollback.exhausted()) {
+                cout << "--- no older messages ---" << endl;
+                return;
+            }
+            showWhenLoaded = true;
+            requestHistoryPage();
+            return;
+        }
+        viewTop = viewTop >= Scrollback::PAGE ? viewTop - Scrollback::PAGE : 0;
+        showScrollback();
+    } else if (command == "/down") {
+        if (!viewActive) return;
+        viewTop += Scrollback::PAGE;
+        if (viewTop >= scrollback.size()) {
+            viewActive = false;
+            cout << "--- end of scrollback ---" << endl;
+            return;
+        }
+        showScrollback();
+    } else if (command == "/unread") {
+        if (sendToServer("UNREAD\n") < 0) handleError("Failed to send command.");
+    } else if (command.rfind("/readers ", 0) == 0) {
+        if (sendToServer("READERS " + command.substr(9) + "\n") < 0) handleError("Failed to send command.");
+    } else if (command.rfind("/react ", 0) == 0) {
+        if (sendToServer("REACT " + command.substr(7) + "\n") < 0) handleError("Failed to send command.");
+    } else if (command.rfind("/reactions ", 0) == 0) {
+        if (sendToServer("REACTIONS " + command.substr(11) + "\n") < 0) handleError("Failed to send command.");
+        reactionQueries++;
+    } else if (command.rfind("/send ", 0) == 0) {
+        size_t space = command.find(' ', 6);
+        if (space == string::npos) {
+            cerr << "Usage: /send <nick> <file>\n";
+            return;
+        }
+        offerFile(command.substr(6, space - 6), command.substr(space + 1));
+    } else if (command.rfind("/accept ", 0) == 0) {
+        answerOffer(command.substr(8), true);
+    } else if (command.rfind("/reject ", 0) == 0) {
+        answerOffer(command.substr(8), false);
+    } else {
+        cerr << "Unknown command. Use /up, /down, /unread, /readers, /react, /reactions, /send, /accept, /reject,"
+                " /join or /part.\n";
+    }
+}
+
+// Everything printed live has been read; tell the server so it can keep
+// unread counts and read receipts. The sequence number keeps a line that
+// arrived after the last one shown from counting as read.
+void NetworkClient::reportRead() {
+    auto now = chrono::steady_clock::now();
+    if (!readPending || now - lastReadReport < chrono::seconds(1)) return;
+    readPending = false;
+    lastReadReport = now;
+    string request = lastShownSeq ? "READ " + to_string(lastShownSeq) + "\n" : "READ\n";
+    if (sendToServer(request) < 0) handleError("Failed to send read report.");
+}
+
+void NetworkClient::offerFile(const string& nick, const string& path) {
+    if (tlsSession) {
+        cerr << "ERROR: File transfers need a plain (non-TLS) connection.\n";
+        return;
+    }
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+        cerr << "ERROR: Cannot read " << path << "\n";
+        return;
+    }
+    // The server accepts [A-Za-z0-9._-] names of up to 64 characters.
+    string name = path.substr(path.find_last_of('/') + 1).substr(0, 64);
+    for (char& c : name) {
+        if (!isalnum((unsigned char)c) && c != '.' && c != '_' && c != '-') c = '_';
+    }
+    if (name.empty() || name[0] == '.') name = "_" + name.substr(0, 63);
+
+    string request = "SEND " + nick + " " + to_string(st.st_size) + " " + name + "\n";
+    if (sendToServer(request) < 0) {
+        handleError("Failed to send file offer.");
+    }
+    pendingSends.push_back(FileTransfer{path, (uint64_t)st.st_size, true});
+}
+
+void NetworkClient::answerOffer(const string& args, bool accept) {
+    uint64_t id = strtoull(args.c_str(), nullptr, 10);
+    auto it = transfers.find(id);
+    if (it == transfers.end() || it->second.sending) {
+        cerr << "ERROR: No offer " << args << "\n";
+        return;
+    }
+    if (accept) {
+        if (tlsSession) {
+            cerr << "ERROR: File transfers need a plain (non-TLS) connection.\n";
+            return;
+        }
+        size_t space = args.find(' ');
+        string path = space == string::npos ? it->second.path : args.substr(space + 1);
+        if (space == string::npos && access(path.c_str(), F_OK) == 0) {
+            cerr << "ERROR: " << path << " exists; use /accept " << id << " <path>\n";
+            return;
+        }
+        it->second.path = path;
+    }
+    string request = string(accept ? "ACCEPT " : "REJECT ") + to_string(id) + "\n";
+    if (sendToServer(request) < 0) {
+        handleError("Failed to answer file offer.");
+    }
+    if (!accept) transfers.erase(it);
+}
+
+// Data connection of one transfer: "XFER <token>", wait for "XFER OK", then
+// the file bytes. The server reports the outcome on the chat connection.
+void NetworkClient::runTransfer(uint64_t id, const string& token, const string& path, uint64_t size, bool sending) {
+    int fd = createSocketConnection();
+    if (fd < 0) {
+        cerr << "ERROR: Transfer " << id << ": cannot connect\n";
+        return;
+    }
+    {
+        lock_guard<mutex> lock(transferMutex);
+        if (stopping) {
+            close(fd);
+            return;
+        }
+        transferFds.insert(fd);
+    }
+    // from here on every return goes through closeData
+    auto closeData = [this, fd]() {
+        lock_guard<mutex> lock(transferMutex);
+        transferFds.erase(fd);
+        close(fd);
+    };
+    // read the greeting and the answer a byte at a time, so no file data is consumed
+    auto readLine = [fd]() {
+        string line;
+        char c;
+        while (recv(fd, &c, 1, 0) == 1 && c != '\n') line += c;
+        return line;
+    };
+    string request = "XFER " + token + "\n";
+    readLine();
+    if (send(fd, request.c_str(), request.size(), MSG_NOSIGNAL) < 0 || readLine() != "XFER OK") {
+        cerr << "ERROR: Transfer " << id << " refused by server\n";
+        closeData();
+        return;
+    }
+
+    int file = sending ? open(path.c_str(), O_RDONLY) : open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0) {
+        cerr << "ERROR: Transfer " << id << ": cannot open " << path << "\n";
+        closeData();
+        return;
+    }
+    uint64_t done = 0;
+    char buffer[65536];
+    while (done < size) {
+        ssize_t n;
+        if (sending) {
+            n = sendfile(fd, file, nullptr, min<uint64_t>(size - done, 1 << 20));
+        } else {
+            n = recv(fd, buffer, min<uint64_t>(size - done, sizeof(buffer)), 0);
+            if (n > 0 && write(file, buffer, n) != n) n = -1;
+        }
+        if (n <= 0) break;
+        done += n;
+    }
+    close(file);
+    closeData();
+    if (done < size) cerr << "ERROR: Transfer " << id << " stopped after " << done << " of " << size << " bytes\n";
+}
+
+void NetworkClient::requestHistoryPage() {
+    if (historyInFlight || scrollback.exhausted()) return;
+    scrollback.markRequest();
+    string request = "HISTORY " + to_string(scrollback.nextBefore()) + " " + to_string(Scrollback::PAGE) + "\n";
+    if (sendToServer(request) < 0) {
+        handleError("Failed to request history.");
+    }
+    historyInFlight = true;
+    historyKinds.push_back('P');
+}
+
+void NetworkClient::showScrollback() {
+    size_t end = min(viewTop + Scrollback::PAGE, scrollback.size());
+    cout << "--- scrollback " << viewTop + 1 << "-" << end << " of " << scrollback.size() << " ---" << endl;
+    for (size_t i = viewTop; i < end; ++i) cout << scrollback.at(i) << "\n";
+    cout.flush();
+    if (viewTop < Scrollback::PAGE) requestHistoryPage();
+}
+
 void NetworkClient::sendMessage(const string& message) {
     string messageToSend = "MSG " + message + "\n";
-    ssize_t bytesSent = send(socketDescriptor, messageToSend.c_str(), messageToSend.size(), 0);
+    ssize_t bytesSent = sendToServer(messageToSend);
     if (bytesSent < 0) {
         handleError("Failed to send message.");
     }
+    // On multicast the line comes back through the group with its sequence
+    // number, and the server's SENT tells us which one it is.
+    if (mcastFd != -1) sentUnconfirmed++;
+    else scrollback.addOwn(userNickname + " " + message);
 }
 
 void NetworkClient::handleError(const string& errorMsg) {
@@ -198,6 +956,10 @@ void NetworkClient::startCommunication() {
 
     cout << "Connected to server at " << serverHost << ":" << serverPort << endl;
 
+    if (useTls && !startTls()) {
+        handleError("TLS handshake with server failed.");
+    }
+
     string greetingBuffer;
     char tempBuffer[2048];
     bool greetingReceived = false;
@@ -210,7 +972,7 @@ void NetworkClient::startCommunication() {
         struct timeval timeout{3, 0};
         int selectResult = select(socketDescriptor + 1, &rfds, nullptr, nullptr, &timeout);
         if (selectResult > 0 && FD_ISSET(socketDescriptor, &rfds)) {
-            ssize_t bytesReceived = recv(socketDescriptor, tempBuffer, sizeof(tempBuffer) - 1, 0);
+            ssize_t bytesReceived = recvFromServer(tempBuffer, sizeof(tempBuffer) - 1);
             if (bytesReceived <= 0) break;
             tempBuffer[bytesReceived] = '\0';
             greetingBuffer.append(tempBuffer, bytesReceived);
@@ -232,20 +994,51 @@ void NetworkClient::startCommunication() {
     sendNicknameToServer();
     cout << "Nickname sent successfully. Handshake complete." << endl;
 
+    if (!mcastGroup.empty()) {
+        mcastFd = joinMulticastGroup();
+        if (mcastFd < 0) {
+            handleError("Failed to join multicast group " + mcastGroup + ".");
+        }
+        string request = "MCAST\n";
+        if (sendToServer(request) < 0) {
+            handleError("Failed to request multicast delivery.");
+        }
+        cout << "Receiving live messages from multicast group " << mcastGroup << endl;
+    } else {
+        if (sendToServer("IDS\n") < 0) handleError("Failed to request message IDs.");
+        idsRequested = true;
+    }
+
     receiveServerMessages();
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        cerr << "Usage: " << argv[0] << " <host:port> <nickname>\n";
+    string mcastGroup, mcastIf, caFile;
+    bool useTls = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:i:tc:")) != -1) {
+        switch (opt) {
+        case 'm': mcastGroup = optarg; break;
+        case 'i': mcastIf = optarg; break;
+        case 't': useTls = true; break;
+        case 'c': useTls = true; caFile = optarg; break;
+        default:
+            cerr << "Usage: " << argv[0] << " [-t [-c ca.pem]] [-m group:port [-i ifaddr]] <host:port> <nickname>\n";
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        cerr << "Usage: " << argv[0] << " [-t [-c ca.pem]] [-m group:port [-i ifaddr]] <host:port> <nickname>\n";
         return 1;
     }
 
-    string serverAddress = argv[1];
-    string nickname = argv[2];
+    string serverAddress = argv[optind];
+    string nickname = argv[optind + 1];
 
     try {
         NetworkClient client(serverAddress, nickname);
+        if (!mcastGroup.empty()) client.setMulticast(mcastGroup, mcastIf);
+        if (useTls) client.setTls(caFile);
         client.startCommunication();
     } catch (const runtime_error& e) {
         cerr << e.what() << endl;
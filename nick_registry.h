@@ -0,0 +1,284 @@
+// Concurrent nick registry: nick -> (shard, client id).
+//
+// The table is split into NICK_STRIPES independent open-addressing stripes,
+// each with its own writer mutex and sequence counter. Writers (insert and
+// erase) take the stripe mutex and bump the counter to odd while they change
+// slots. Readers never lock: they probe the stripe and retry if the counter
+// was odd or moved meanwhile (a seqlock). Slot words are atomics, so a read
+// racing a write is torn at worst, never undefined.
+//
+// Keys are the nick packed into 16 bytes, so a probe compares two words.
+// Erased entries stay as tombstones (value 0) and are reused by inserts.
+// Used slots, tombstones included, are kept to three quarters of a stripe,
+// so a probe for an absent nick ends at a free slot after a few steps.
+// A stripe is rehashed once tombstones pass a quarter of it, or doubled once
+// it fills up with live entries. Either way the live entries go into a table
+// that no reader uses, outside the write section, and the write section
+// only swaps the table pointer, so a lookup never waits on a rehash.
+// Readers may still be probing the old table; the swap moved the counter,
+// so they retry. The old table is therefore never freed: one of the same
+// size is reused for the next rehash, smaller ones are kept until the
+// registry goes away and add up to less than the current ones.
+#ifndef NICK_REGISTRY_H
+#define NICK_REGISTRY_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+static const size_t NICK_KEY_BYTES = 16;
+static const size_t NICK_STRIPES = 64;
+static const size_t NICK_STRIPE_SLOTS = 1024;  // initially; power of two
+
+class NickRegistry {
+public:
+    struct Handle {
+        uint16_t shard;
+        uint64_t client;
+    };
+
+    NickRegistry() {
+        for (Stripe &st : stripes) {
+            st.tables.emplace_back(new Table(NICK_STRIPE_SLOTS));
+            st.table.store(st.tables.back().get(), std::memory_order_relaxed);
+        }
+    }
+
+    // False if the nick is held already or too long.
+    bool insert(const std::string &nick, uint16_t shard, uint64_t client) {
+        Key k;
+        if (!pack(nick, k)) return false;
+        Stripe &st = stripes[k.hash % NICK_STRIPES];
+        std::lock_guard<std::mutex> lk(st.mu);
+        Table *t = st.table.load(std::memory_order_relaxed);
+        size_t at;
+        if (!find_free(*t, k, at)) return false;
+        bool fresh = t->slots[at].k0.load(std::memory_order_relaxed) == 0;
+        if (fresh && (st.used + 1) * 4 > t->size * 3) {
+            size_t live = st.used - st.tombstones;
+            rebuild(st, (live + 1) * 2 > t->size ? t->size * 2 : t->size);
+            t = st.table.load(std::memory_order_relaxed);
+            find_free(*t, k, at);
+        }
+        Slot &s = t->slots[at];
+        if (s.k0.load(std::memory_order_relaxed) != 0) {
+            st.tombstones--;
+        } else {
+            st.used++;
+        }
+        begin_write(st);
+        s.k0.store(k.w0, std::memory_order_relaxed);
+        s.k1.store(k.w1, std::memory_order_relaxed);
+        s.value.store(encode(shard, client), std::memory_order_relaxed);
+        end_write(st);
+        count.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Never blocks; safe from any thread.
+    bool lookup(const std::string &nick, Handle &out) const {
+        Key k;
+        if (!pack(nick, k)) return false;
+        const Stripe &st = stripes[k.hash % NICK_STRIPES];
+        for (;;) {
+            uint64_t seq = st.seq.load(std::memory_order_acquire);
+            if (seq & 1) continue;
+            const Table *t = st.table.load(std::memory_order_acquire);
+            uint64_t value = 0;
+            for (size_t i = 0; i < t->size; ++i) {
+                const Slot &s = t->slots[(k.hash / NICK_STRIPES + i) & (t->size - 1)];
+                uint64_t k0 = s.k0.load(std::memory_order_relaxed);
+                if (k0 == 0) break;
+                if (k0 == k.w0 && s.k1.load(std::memory_order_relaxed) == k.w1) {
+                    value = s.value.load(std::memory_order_relaxed);
+                    break;
+                }
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (st.seq.load(std::memory_order_relaxed) != seq) continue;
+            if (!value) return false;
+            out = decode(value);
+            return true;
+        }
+    }
+
+    // Releases the nick if client still holds it.
+    void erase(const std::string &nick, uint64_t client) {
+        Key k;
+        if (!pack(nick, k)) return;
+        Stripe &st = stripes[k.hash % NICK_STRIPES];
+        std::lock_guard<std::mutex> lk(st.mu);
+        Table *t = st.table.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < t->size; ++i) {
+            Slot &s = t->slots[(k.hash / NICK_STRIPES + i) & (t->size - 1)];
+            uint64_t k0 = s.k0.load(std::memory_order_relaxed);
+            if (k0 == 0) return;
+            if (k0 != k.w0 || s.k1.load(std::memory_order_relaxed) != k.w1) continue;
+            uint64_t value = s.value.load(std::memory_order_relaxed);
+            if (!value || decode(value).client != client) return;
+            begin_write(st);
+            s.value.store(0, std::memory_order_relaxed);
+            end_write(st);
+            count.fetch_sub(1, std::memory_order_relaxed);
+            if (++st.tombstones > t->size / 4) rebuild(st, t->size);
+            return;
+        }
+    }
+
+    size_t size() const { return count.load(std::memory_order_relaxed); }
+
+    // Slots in the current tables of all stripes.
+    size_t capacity() const {
+        size_t n = 0;
+        for (const Stripe &st : stripes) n += st.table.load(std::memory_order_acquire)->size;
+        return n;
+    }
+
+    // Slots in every table of all stripes, retired ones included.
+    size_t allocated() const {
+        size_t n = 0;
+        for (const Stripe &st : stripes) {
+            std::lock_guard<std::mutex> lk(st.mu);
+            for (const auto &t : st.tables) n += t->size;
+        }
+        return n;
+    }
+
+private:
+    struct Key {
+        uint64_t w0, w1, hash;
+    };
+
+    struct Slot {
+        std::atomic<uint64_t> k0{0};  // 0: never used (nicks are not empty)
+        std::atomic<uint64_t> k1{0};
+        std::atomic<uint64_t> value{0};  // 0: free (client ids start at 1)
+    };
+
+    struct Table {
+        explicit Table(size_t n) : size(n), slots(new Slot[n]) {}
+        size_t size;  // power of two
+        std::unique_ptr<Slot[]> slots;
+    };
+
+    struct alignas(64) Stripe {
+        mutable std::mutex mu;
+        std::atomic<uint64_t> seq{0};
+        std::atomic<Table *> table{nullptr};
+        size_t used = 0;        // slots with a key, tombstones included; writers only
+        size_t tombstones = 0;  // writers only
+        std::vector<std::unique_ptr<Table>> tables;  // every table the stripe had
+        Table *spare = nullptr;                      // the last one retired at the current size
+    };
+
+    static bool pack(const std::string &nick, Key &k) {
+        if (nick.empty() || nick.size() > NICK_KEY_BYTES) return false;
+        char buf[NICK_KEY_BYTES] = {};
+        memcpy(buf, nick.data(), nick.size());
+        memcpy(&k.w0, buf, 8);
+        memcpy(&k.w1, buf + 8, 8);
+        k.hash = mix(k.w0, k.w1);
+        return true;
+    }
+
+    static uint64_t mix(uint64_t w0, uint64_t w1) {
+        uint64_t h = w0 ^ (w1 * 0x9e3779b97f4a7c15ULL);  // then the murmur3 finalizer
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        return h ^ (h >> 33);
+    }
+
+    static uint64_t encode(uint16_t shard, uint64_t client) { return (uint64_t)shard << 48 | client; }
+    static Handle decode(uint64_t v) { return Handle{(uint16_t)(v >> 48), v & ((1ULL << 48) - 1)}; }
+
+    static void begin_write(Stripe &st) {
+        st.seq.store(st.seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    static void end_write(Stripe &st) {
+        st.seq.store(st.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Where k would go: its own tombstone, else the first tombstone or
+    // free slot on its path. False if k is held. The load limit guarantees
+    // a free slot.
+    static bool find_free(const Table &t, const Key &k, size_t &at) {
+        at = t.size;
+        for (size_t i = 0; i < t.size; ++i) {
+            size_t j = (k.hash / NICK_STRIPES + i) & (t.size - 1);
+            const Slot &s = t.slots[j];
+            uint64_t k0 = s.k0.load(std::memory_order_relaxed);
+            if (k0 == 0) {
+                if (at == t.size) at = j;
+                break;
+            }
+            bool live = s.value.load(std::memory_order_relaxed) != 0;
+            if (k0 == k.w0 && s.k1.load(std::memory_order_relaxed) == k.w1) {
+                if (live) return false;
+                at = j;  // revive its own tombstone
+                break;
+            }
+            if (!live && at == t.size) at = j;
+        }
+        return true;
+    }
+
+    static void place(Table &t, uint64_t w0, uint64_t w1, uint64_t value) {
+        uint64_t hash = mix(w0, w1);
+        for (size_t i = 0;; ++i) {
+            Slot &s = t.slots[(hash / NICK_STRIPES + i) & (t.size - 1)];
+            if (s.k0.load(std::memory_order_relaxed) != 0) continue;
+            s.k0.store(w0, std::memory_order_relaxed);
+            s.k1.store(w1, std::memory_order_relaxed);
+            s.value.store(value, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    // Drops the tombstones by reinserting the live entries into a table of
+    // size slots, then makes it current in a single write. Any reader of the
+    // spare saw the counter move when it was retired, so it can be cleared
+    // and filled outside the write section.
+    void rebuild(Stripe &st, size_t size) {
+        Table *t = st.table.load(std::memory_order_relaxed);
+        Table *fresh = st.spare;
+        if (fresh && fresh->size == size) {
+            std::atomic_thread_fence(std::memory_order_release);  // a reader that sees these sees the retiring counter
+            for (size_t i = 0; i < size; ++i) {
+                Slot &s = fresh->slots[i];
+                s.k0.store(0, std::memory_order_relaxed);
+                s.k1.store(0, std::memory_order_relaxed);
+                s.value.store(0, std::memory_order_relaxed);
+            }
+        } else {
+            st.tables.emplace_back(new Table(size));
+            fresh = st.tables.back().get();
+        }
+        size_t live = 0;
+        for (size_t i = 0; i < t->size; ++i) {
+            const Slot &s = t->slots[i];
+            uint64_t v = s.value.load(std::memory_order_relaxed);
+            if (!v) continue;
+            place(*fresh, s.k0.load(std::memory_order_relaxed), s.k1.load(std::memory_order_relaxed), v);
+            live++;
+        }
+        begin_write(st);
+        st.table.store(fresh, std::memory_order_release);
+        end_write(st);
+        st.spare = t->size == size ? t : nullptr;
+        st.used = live;
+        st.tombstones = 0;
+    }
+
+    Stripe stripes[NICK_STRIPES];
+    std::atomic<size_t> count{0};
+};
+
+#endif
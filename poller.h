@@ -0,0 +1,168 @@
+// Event backends for the server's main loop.
+//
+// The loop is written once, generic over the backend, and instantiated for
+// each one compiled in; main() picks one at startup (-e) and never looks at
+// the choice again, so the calls below are inlined into the loop instead of
+// going through a virtual interface on every pass.
+//
+// Both backends have the same pass-oriented interface: begin() a pass,
+// declare what each fd waits for with want(), wait(), then ask readable()
+// and writable(). can_watch() tells whether an fd can be waited for at all:
+// the loop refuses a connection whose fd cannot. SelectPoller rebuilds its
+// fd_sets every pass, as the loop always did, and cannot hold an fd of
+// FD_SETSIZE or more; want() ignores one rather than write past the set.
+// EpollPoller keeps the interest set in the kernel and only calls
+// epoll_ctl() for fds whose interest changed since the previous pass, so a
+// pass costs no syscalls for idle connections and fds are not limited to
+// FD_SETSIZE. The kernel drops a closed fd from the set by itself, but its
+// number can come back as a new socket, so the loop reports the fds it
+// closed with forget().
+#ifndef POLLER_H
+#define POLLER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <unistd.h>
+#include <vector>
+
+class SelectPoller {
+public:
+    static const char *name() { return "select"; }
+    bool ok() const { return true; }
+    bool can_watch(int fd) const { return fd < FD_SETSIZE; }
+
+    void begin() {
+        FD_ZERO(&rd);
+        FD_ZERO(&wr);
+        maxfd = -1;
+    }
+
+    void want(int fd, bool read, bool write) {
+        if (fd < 0 || !can_watch(fd)) return;
+        if (read) FD_SET(fd, &rd);
+        if (write) FD_SET(fd, &wr);
+        maxfd = std::max(maxfd, fd);
+    }
+
+    int wait(int timeout_ms) {
+        struct timeval tv{timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+        return select(maxfd + 1, &rd, &wr, nullptr, &tv);
+    }
+
+    void forget(int) {}
+
+    bool readable(int fd) const { return fd >= 0 && can_watch(fd) && FD_ISSET(fd, &rd); }
+    bool writable(int fd) const { return fd >= 0 && can_watch(fd) && FD_ISSET(fd, &wr); }
+
+private:
+    fd_set rd, wr;
+    int maxfd = -1;
+};
+
+class EpollPoller {
+public:
+    EpollPoller() : epfd(epoll_create1(EPOLL_CLOEXEC)) {}
+    ~EpollPoller() {
+        if (epfd >= 0) close(epfd);
+    }
+    EpollPoller(const EpollPoller &) = delete;
+    EpollPoller &operator=(const EpollPoller &) = delete;
+
+    static const char *name() { return "epoll"; }
+    bool ok() const { return epfd >= 0; }
+    bool can_watch(int) const { return true; }
+
+    void begin() {
+        ++pass;
+        wanted.clear();
+    }
+
+    void want(int fd, bool read, bool write) {
+        if (fd < 0) return;
+        if ((size_t)fd >= slots.size()) slots.resize(fd + 1);
+        Slot &s = slots[fd];
+        uint32_t ev = (read ? (uint32_t)EPOLLIN : 0) | (write ? (uint32_t)EPOLLOUT : 0);
+        if (s.want_pass != pass) {
+            s.want_pass = pass;
+            s.want = ev;
+            wanted.push_back(fd);
+        } else {
+            s.want |= ev;
+        }
+    }
+
+    int wait(int timeout_ms) {
+        // bring the kernel's interest set in line with this pass; an fd that
+        // waits for nothing leaves it, or a hangup on it would report forever
+        for (int fd : registered) {
+            Slot &s = slots[fd];
+            if (s.want_pass == pass && s.want) continue;
+            if (s.in_kernel) epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+            s.in_kernel = false;
+        }
+        registered.clear();
+        for (int fd : wanted) {
+            Slot &s = slots[fd];
+            if (!s.want) continue;
+            if (!s.in_kernel || s.registered != s.want) update(fd, s);
+            if (s.in_kernel) registered.push_back(fd);
+        }
+        events.resize(std::max<size_t>(wanted.size(), 1));
+        int n = epoll_wait(epfd, events.data(), (int)events.size(), timeout_ms);
+        for (int i = 0; i < n; ++i) {
+            Slot &s = slots[events[i].data.fd];
+            s.ready_pass = pass;
+            s.ready = events[i].events;
+        }
+        return n;
+    }
+
+    void forget(int fd) {
+        if (fd >= 0 && (size_t)fd < slots.size()) slots[fd].in_kernel = false;
+    }
+
+    // as select() reports them: only for what the fd waited for, and a
+    // hangup or error wakes either side
+    bool readable(int fd) const { return ready(fd, EPOLLIN) & (EPOLLIN | EPOLLHUP | EPOLLERR); }
+    bool writable(int fd) const { return ready(fd, EPOLLOUT) & (EPOLLOUT | EPOLLHUP | EPOLLERR); }
+
+private:
+    struct Slot {
+        uint64_t want_pass = 0;
+        uint64_t ready_pass = 0;
+        uint32_t want = 0;
+        uint32_t registered = 0;  // events the kernel has, if in_kernel
+        uint32_t ready = 0;
+        bool in_kernel = false;
+    };
+
+    // MOD, or ADD for an fd the kernel does not know (yet, or any more).
+    void update(int fd, Slot &s) {
+        struct epoll_event ev{};
+        ev.events = s.want;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            s.in_kernel = false;
+            return;
+        }
+        s.registered = s.want;
+        s.in_kernel = true;
+    }
+
+    uint32_t ready(int fd, uint32_t waited) const {
+        if (fd < 0 || (size_t)fd >= slots.size()) return 0;
+        const Slot &s = slots[fd];
+        return s.ready_pass == pass && (s.want & waited) ? s.ready : 0;
+    }
+
+    int epfd;
+    uint64_t pass = 0;
+    std::vector<Slot> slots;                  // by fd
+    std::vector<int> wanted;                  // fds declared this pass
+    std::vector<int> registered;              // fds in the kernel's set
+    std::vector<struct epoll_event> events;
+};
+
+#endif
@@ -0,0 +1,235 @@
+// Reaction totals per message. A popular message can get thousands of
+// REACT events a second, so events only bump a counter. Changed totals are
+// published as one "REACTIONS <seq> <kind>=<n> ..." line per message every
+// REACTION_FLUSH_MS. Counters live in an open-addressing hash keyed by
+// sequence number (linear probing, power-of-two capacity). Each slot heads a
+// chain of (kind, count) tallies in a shared pool. Kinds are interned.
+//
+// A member counts once per message and kind: the (seq, member, kind) triples
+// that are set are kept in an ordered set, so a repeated REACT and an UNREACT
+// without a REACT change nothing. Only the newest REACTION_WINDOW messages
+// keep totals; expire() drops older ones, leaving tombstones in the hash that
+// later inserts reuse, and returns their tallies to the pool.
+#ifndef REACTIONS_H
+#define REACTIONS_H
+
+#include <cstdint>
+#include <set>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+static const int REACTION_FLUSH_MS = 250;
+static const size_t REACTION_MAX_KINDS = 16;     // per message
+static const uint64_t REACTION_WINDOW = 100000;  // messages that keep totals
+
+class ReactionCounters {
+public:
+    ReactionCounters() : slots(1024) {}
+
+    bool has_dirty() const { return !dirty.empty(); }
+
+    // Messages below this have no totals and take no reactions.
+    uint64_t oldest() const { return min_seq; }
+
+    size_t size() const { return live; }
+    size_t capacity() const { return slots.size(); }
+    size_t tombstones() const { return used - live; }
+
+    // A REACT (undo: UNREACT) by member. Returns false if the message already
+    // has REACTION_MAX_KINDS kinds (or the room has run out of kind ids).
+    bool add(uint64_t seq, uint32_t member, const std::string &kind, bool undo) {
+        if (seq < min_seq) return true;
+        if (!kind_ids.count(kind) && kinds.size() > UINT16_MAX) return false;
+        uint16_t k = intern(kind);
+        auto key = std::make_tuple(seq, member, k);
+        bool had = reacted.count(key);
+        if (had != undo) return true;  // REACT again, or UNREACT without a REACT
+        Slot &slot = find_or_insert(seq);
+        uint32_t prev = 0, link = slot.head;
+        size_t kinds = 0;
+        for (; link; prev = link, link = pool[link].next, ++kinds) {
+            if (pool[link].kind == k) break;
+        }
+        if (!link) {
+            if (undo) return true;  // taken over from upstream meanwhile
+            if (kinds >= REACTION_MAX_KINDS) return false;
+            link = new_tally(k, 0, 0);  // may move the pool
+            (prev ? pool[prev].next : slot.head) = link;
+        }
+        Tally &t = pool[link];
+        if (undo) {
+            if (t.count) t.count--;
+            reacted.erase(key);
+        } else {
+            t.count++;
+            reacted.insert(key);
+        }
+        mark(slot);
+        return true;
+    }
+
+    // Take over the totals of a snapshot line from an upstream server.
+    void apply_snapshot(const std::string &line) {
+        std::istringstream in(line);
+        std::string word, tally;
+        uint64_t seq;
+        if (!(in >> word >> seq) || seq == 0 || seq < min_seq) return;
+        while (in >> tally) {
+            size_t eq = tally.find('=');
+            if (eq == std::string::npos) continue;
+            uint32_t want = strtoul(tally.c_str() + eq + 1, nullptr, 10);
+            Slot &slot = find_or_insert(seq);
+            uint16_t k = intern(tally.substr(0, eq));
+            uint32_t link = slot.head;
+            while (link && pool[link].kind != k) link = pool[link].next;
+            if (link) {
+                pool[link].count = want;
+            } else {
+                slot.head = new_tally(k, want, slot.head);
+            }
+        }
+    }
+
+    std::string snapshot(uint64_t seq) const {
+        std::string line = "REACTIONS " + std::to_string(seq);
+        const Slot *slot = find(seq);
+        for (uint32_t link = slot ? slot->head : 0; link; link = pool[link].next) {
+            if (pool[link].count) line += " " + kinds[pool[link].kind] + "=" + std::to_string(pool[link].count);
+        }
+        return line + "\n";
+    }
+
+    // Snapshot lines of every message changed since the last call.
+    std::vector<std::string> take_dirty() {
+        std::vector<std::string> lines;
+        for (uint64_t seq : dirty) {
+            Slot *slot = find(seq);
+            if (!slot) continue;  // expired meanwhile
+            slot->dirty = false;
+            lines.push_back(snapshot(seq));
+        }
+        dirty.clear();
+        return lines;
+    }
+
+    // Forget the messages below oldest. This walks the whole table, so it is
+    // only done once oldest is REACTION_WINDOW / 16 messages past the last time.
+    void expire(uint64_t oldest) {
+        if (oldest < min_seq + REACTION_WINDOW / 16) return;
+        min_seq = oldest;
+        for (Slot &s : slots) {
+            if (s.seq == EMPTY || s.seq == DELETED || s.seq >= min_seq) continue;
+            for (uint32_t link = s.head, next; link; link = next) {
+                next = pool[link].next;
+                pool[link].next = free_tallies;
+                free_tallies = link;
+            }
+            s = Slot{};
+            s.seq = DELETED;
+            live--;
+        }
+        reacted.erase(reacted.begin(), reacted.lower_bound(std::make_tuple(min_seq, 0u, (uint16_t)0)));
+    }
+
+private:
+    static const uint64_t EMPTY = 0;
+    static const uint64_t DELETED = UINT64_MAX;
+
+    struct Slot {
+        uint64_t seq = EMPTY;
+        uint32_t head = 0;   // first tally in pool, 0 = none
+        bool dirty = false;
+    };
+    struct Tally {
+        uint16_t kind;
+        uint32_t count;
+        uint32_t next;
+    };
+
+    const Slot *find(uint64_t seq) const {
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash(seq) & mask;; i = (i + 1) & mask) {
+            if (slots[i].seq == seq) return &slots[i];
+            if (slots[i].seq == EMPTY) return nullptr;
+        }
+    }
+    Slot *find(uint64_t seq) { return const_cast<Slot *>(static_cast<const ReactionCounters *>(this)->find(seq)); }
+
+    // Inserts over the first tombstone on the probe path, if any.
+    Slot &find_or_insert(uint64_t seq) {
+        if ((used + 1) * 4 > slots.size() * 3) rehash();
+        size_t mask = slots.size() - 1;
+        size_t i = hash(seq) & mask, reuse = SIZE_MAX;
+        for (; slots[i].seq != EMPTY; i = (i + 1) & mask) {
+            if (slots[i].seq == seq) return slots[i];
+            if (slots[i].seq == DELETED && reuse == SIZE_MAX) reuse = i;
+        }
+        if (reuse != SIZE_MAX) {
+            i = reuse;
+        } else {
+            used++;
+        }
+        slots[i].seq = seq;
+        live++;
+        return slots[i];
+    }
+
+    // Doubles the table, or only clears out tombstones if less than half of
+    // it is live.
+    void rehash() {
+        std::vector<Slot> old(live * 2 < slots.size() ? slots.size() : slots.size() * 2);
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (const Slot &s : old) {
+            if (s.seq == EMPTY || s.seq == DELETED) continue;
+            size_t i = hash(s.seq) & mask;
+            while (slots[i].seq != EMPTY) i = (i + 1) & mask;
+            slots[i] = s;
+        }
+        used = live;
+    }
+
+    static size_t hash(uint64_t seq) { return (size_t)(seq * 0x9E3779B97F4A7C15ULL >> 17); }
+
+    uint32_t new_tally(uint16_t kind, uint32_t count, uint32_t next) {
+        if (!free_tallies) {
+            pool.push_back(Tally{kind, count, next});
+            return (uint32_t)pool.size() - 1;
+        }
+        uint32_t link = free_tallies;
+        free_tallies = pool[link].next;
+        pool[link] = Tally{kind, count, next};
+        return link;
+    }
+
+    void mark(Slot &slot) {
+        if (slot.dirty) return;
+        slot.dirty = true;
+        dirty.push_back(slot.seq);
+    }
+
+    uint16_t intern(const std::string &kind) {
+        auto it = kind_ids.find(kind);
+        if (it != kind_ids.end()) return it->second;
+        uint16_t id = (uint16_t)kinds.size();
+        kind_ids.emplace(kind, id);
+        kinds.push_back(kind);
+        return id;
+    }
+
+    std::vector<Slot> slots;
+    size_t used = 0;       // slots not EMPTY, tombstones included
+    size_t live = 0;
+    uint64_t min_seq = 0;
+    std::vector<Tally> pool = std::vector<Tally>(1);  // index 0 ends a chain
+    uint32_t free_tallies = 0;                        // chain of unused pool entries
+    std::set<std::tuple<uint64_t, uint32_t, uint16_t>> reacted;  // (seq, member, kind)
+    std::vector<uint64_t> dirty;
+    std::vector<std::string> kinds;
+    std::unordered_map<std::string, uint16_t> kind_ids;
+};
+
+#endif
@@ -0,0 +1,179 @@
+// Read receipts of a room: who has read up to which message.
+#ifndef READ_RECEIPTS_H
+#define READ_RECEIPTS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Set of 32-bit member indexes, compressed in the style of Roaring bitmaps.
+// The high 16 bits select a container. A container holds the low 16 bits
+// as a sorted array while it has at most ROARING_ARRAY_MAX values, and as a
+// 65536-bit bitset once it grows past that.
+static const size_t ROARING_ARRAY_MAX = 4096;
+
+class RoaringBitmap {
+public:
+    uint64_t cardinality() const { return card; }
+    bool empty() const { return card == 0; }
+
+    // Containers currently held as bitsets.
+    size_t bitsets() const {
+        size_t n = 0;
+        for (auto &entry : containers) n += !entry.second.bits.empty();
+        return n;
+    }
+
+    bool add(uint32_t v) {
+        Container &c = containers[v >> 16];
+        uint16_t lo = v & 0xffff;
+        if (!c.bits.empty()) {
+            uint64_t &w = c.bits[lo >> 6];
+            if (w & (1ULL << (lo & 63))) return false;
+            w |= 1ULL << (lo & 63);
+        } else {
+            auto it = std::lower_bound(c.array.begin(), c.array.end(), lo);
+            if (it != c.array.end() && *it == lo) return false;
+            c.array.insert(it, lo);
+            if (c.array.size() > ROARING_ARRAY_MAX) {
+                c.bits.assign(1024, 0);
+                for (uint16_t x : c.array) c.bits[x >> 6] |= 1ULL << (x & 63);
+                c.array.clear();
+                c.array.shrink_to_fit();
+            }
+        }
+        c.card++;
+        card++;
+        return true;
+    }
+
+    bool remove(uint32_t v) {
+        auto ci = containers.find(v >> 16);
+        if (ci == containers.end()) return false;
+        Container &c = ci->second;
+        uint16_t lo = v & 0xffff;
+        if (!c.bits.empty()) {
+            uint64_t &w = c.bits[lo >> 6];
+            if (!(w & (1ULL << (lo & 63)))) return false;
+            w &= ~(1ULL << (lo & 63));
+            if (c.card - 1 <= ROARING_ARRAY_MAX / 2) {  // back to an array, with hysteresis
+                for (size_t i = 0; i < c.bits.size(); ++i) {
+                    for (uint64_t b = c.bits[i]; b; b &= b - 1) c.array.push_back(i * 64 + __builtin_ctzll(b));
+                }
+                c.bits.clear();
+                c.bits.shrink_to_fit();
+            }
+        } else {
+            auto it = std::lower_bound(c.array.begin(), c.array.end(), lo);
+            if (it == c.array.end() || *it != lo) return false;
+            c.array.erase(it);
+        }
+        card--;
+        if (--c.card == 0) containers.erase(ci);
+        return true;
+    }
+
+    template <class F> void for_each(F f) const {
+        for (auto &entry : containers) {
+            uint32_t hi = (uint32_t)entry.first << 16;
+            const Container &c = entry.second;
+            if (c.bits.empty()) {
+                for (uint16_t x : c.array) f(hi | x);
+            } else {
+                for (size_t i = 0; i < c.bits.size(); ++i) {
+                    for (uint64_t b = c.bits[i]; b; b &= b - 1) f(hi | (uint32_t)(i * 64 + __builtin_ctzll(b)));
+                }
+            }
+        }
+    }
+
+private:
+    struct Container {
+        std::vector<uint16_t> array;
+        std::vector<uint64_t> bits;
+        uint32_t card = 0;
+    };
+    std::map<uint16_t, Container> containers;
+    uint64_t card = 0;
+};
+
+// Read positions per member of a room, by nick, so they survive reconnects.
+// A member has read every message up to its position (sequence number).
+// Members are grouped into bitmaps by the window of RECEIPT_WINDOW messages
+// their position falls in, and each window also counts its members by
+// position in a Fenwick tree. "How many have read N" is then the
+// cardinality of every later window plus a suffix sum of N's own window,
+// with no walk over members. Unread counts follow from the position and
+// the room's newest sequence number.
+static const uint64_t RECEIPT_WINDOW = 4096;
+
+class ReadReceipts {
+public:
+    uint32_t member(const std::string &nick) {
+        auto it = ids.find(nick);
+        if (it != ids.end()) return it->second;
+        ids.emplace(nick, (uint32_t)positions.size());
+        positions.push_back(0);
+        return (uint32_t)positions.size() - 1;
+    }
+
+    uint64_t position(uint32_t m) const { return positions[m]; }
+
+    // Positions only move forward.
+    void advance(uint32_t m, uint64_t seq) {
+        uint64_t old = positions[m];
+        if (seq <= old) return;
+        if (old) {
+            auto it = windows.find(old / RECEIPT_WINDOW);
+            it->second.members.remove(m);
+            if (it->second.members.empty()) {
+                windows.erase(it);
+            } else {
+                it->second.count(old % RECEIPT_WINDOW, -1);
+            }
+        }
+        Window &w = windows[seq / RECEIPT_WINDOW];
+        if (w.counts.empty()) w.counts.assign(RECEIPT_WINDOW + 1, 0);
+        w.members.add(m);
+        w.count(seq % RECEIPT_WINDOW, 1);
+        positions[m] = seq;
+    }
+
+    uint64_t readers(uint64_t seq) const {
+        uint64_t w = seq / RECEIPT_WINDOW;
+        uint64_t count = 0;
+        auto it = windows.lower_bound(w);
+        if (it != windows.end() && it->first == w) {
+            count += it->second.members.cardinality() - it->second.below(seq % RECEIPT_WINDOW);
+            ++it;
+        }
+        for (; it != windows.end(); ++it) count += it->second.members.cardinality();
+        return count;
+    }
+
+private:
+    struct Window {
+        RoaringBitmap members;
+        std::vector<uint32_t> counts;  // Fenwick tree of members by position % RECEIPT_WINDOW
+
+        void count(uint64_t offset, int32_t delta) {
+            for (uint64_t i = offset + 1; i <= RECEIPT_WINDOW; i += i & -i) counts[i] += delta;
+        }
+
+        // Members positioned before offset in this window.
+        uint64_t below(uint64_t offset) const {
+            uint64_t n = 0;
+            for (uint64_t i = offset; i > 0; i -= i & -i) n += counts[i];
+            return n;
+        }
+    };
+
+    std::unordered_map<std::string, uint32_t> ids;
+    std::vector<uint64_t> positions;     // by member index, 0 = nothing read
+    std::map<uint64_t, Window> windows;  // window -> members positioned in it
+};
+
+#endif
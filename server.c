@@ -5,242 +5,5152 @@
 #include <netdb.h>
 #include <regex>
 #include <string>
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <zlib.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/hmac.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <iostream>
 #include <vector>
+#include <deque>
 #include <algorithm>
 #include <map>
+#include <list>
+#include <unordered_map>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <iterator>
+#include <sstream>
+#include <cctype>
+#include <cmath>
+#include <memory>
 #include <stdexcept>
+#include <cstdint>
+#include <climits>
+
+#include "nick_registry.h"
+#include "poller.h"
+#include "reactions.h"
+#include "sketches.h"
+#include "read_receipts.h"
 
 using namespace std;
 
-class Client {
+static uint64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Sockets the main loop watched and has closed since its last pass. The
+// epoll backend keeps registrations across passes, so it must hear that a
+// number it knows may come back as a different socket.
+static std::vector<int> closed_fds;
+
+void close_watched(int fd) {
+    close(fd);
+    closed_fds.push_back(fd);
+}
+
+// Append-only log of framed broadcast lines shared by every member of a room.
+// A message is framed once into a large chunk; members only keep a byte
+// cursor into the log, so fan-out costs O(1) memory regardless of room size.
+static const size_t LOG_CHUNK_SIZE = 64 * 1024;
+static const uint64_t LOG_MAX_LAG = 4 * 1024 * 1024;  // cut off readers further behind
+static const int LOG_MAX_IOV = 64;
+
+struct LogRecord {
+    uint64_t offset;   // absolute offset of the framed line in the log
+    uint32_t len;
+    uint64_t origin;   // client id of the sender, who does not get its own line
+};
+
+struct LogChunk {
+    uint64_t base;     // absolute offset of data[0]
+    std::vector<char> data;
+    std::vector<LogRecord> records;
+
+    explicit LogChunk(uint64_t b) : base(b) { data.reserve(LOG_CHUNK_SIZE); }
+    uint64_t end() const { return base + data.size(); }
+};
+
+class RoomLog {
 public:
+    RoomLog() { chunks.emplace_back(0); }
+
+    uint64_t head() const { return chunks.back().end(); }
+    uint64_t tail() const { return chunks.front().base; }
+
+    void append(const std::string &line, uint64_t origin) {
+        if (chunks.back().data.size() + line.size() > LOG_CHUNK_SIZE && !chunks.back().data.empty()) {
+            chunks.emplace_back(head());
+        }
+        LogChunk &c = chunks.back();
+        c.records.push_back(LogRecord{c.end(), (uint32_t)line.size(), origin});
+        c.data.insert(c.data.end(), line.begin(), line.end());
+    }
+
+    // Fill iov with the bytes between cursor and head that reader should
+    // receive. Returns the number of iovecs; scan_end is where the cursor may
+    // move to once all of them have been written.
+    int gather(uint64_t cursor, uint64_t reader, struct iovec *iov, uint64_t *iov_end,
+               int max_iov, uint64_t &scan_end) const {
+        int n = 0;
+        scan_end = cursor;
+        for (auto ci = find_chunk(cursor); ci != chunks.end() && n < max_iov; ++ci) {
+            auto ri = std::lower_bound(ci->records.begin(), ci->records.end(), cursor,
+                [](const LogRecord &r, uint64_t off) { return r.offset + r.len <= off; });
+            for (; ri != ci->records.end(); ++ri) {
+                uint64_t rend = ri->offset + ri->len;
+                uint64_t start = std::max(cursor, ri->offset);
+                if (ri->origin == reader && start == ri->offset) {
+                    scan_end = rend;
+                    continue;
+                }
+                char *p = const_cast<char *>(ci->data.data()) + (start - ci->base);
+                if (n > 0 && iov_end[n - 1] == start
+                    && (char *)iov[n - 1].iov_base + iov[n - 1].iov_len == p) {
+                    iov[n - 1].iov_len += rend - start;
+                } else {
+                    if (n == max_iov) return n;
+                    iov[n].iov_base = p;
+                    iov[n].iov_len = rend - start;
+                    n++;
+                }
+                iov_end[n - 1] = rend;
+                scan_end = rend;
+            }
+        }
+        return n;
+    }
+
+    // Release chunks that every cursor has moved past.
+    void trim(uint64_t min_cursor) {
+        while (chunks.size() > 1 && chunks.front().end() <= min_cursor) chunks.pop_front();
+    }
+
+private:
+    std::deque<LogChunk>::const_iterator find_chunk(uint64_t off) const {
+        auto it = std::upper_bound(chunks.begin(), chunks.end(), off,
+            [](uint64_t o, const LogChunk &c) { return o < c.base; });
+        return it == chunks.begin() ? it : it - 1;
+    }
+
+    std::deque<LogChunk> chunks;
+};
+
+// On-disk journal of every broadcast line, split into segment files. Each
+// segment has an index file with the start offset and arrival time of every
+// message, so a sequence range maps straight to a byte range that can be sent
+// with sendfile() without parsing or re-serializing anything.
+//
+// History is tiered: the newest lines are also kept in a RAM ring, the most
+// recent segments stay as plain files (warm) and older ones are compressed
+// by the Compactor thread into independently compressed blocks (cold), so a
+// page of old history only inflates the blocks it touches. Retention limits
+// delete whole cold segments.
+static const uint64_t JOURNAL_SEGMENT_SIZE = 64 * 1024 * 1024;
+static const uint32_t HISTORY_MAX_LIMIT = 1000;
+static const size_t HISTORY_SEND_QUANTUM = 64 * 1024;  // per client per loop pass
+static const size_t HISTORY_RING_SIZE = 4096;          // newest lines held in RAM
+
+std::string segment_path(const std::string &dir, uint64_t first, const char *ext) {
+    char name[64];
+    snprintf(name, sizeof(name), "/seg-%020llu.%s", (unsigned long long)first, ext);
+    return dir + name;
+}
+
+// First sequence numbers of all journal segments in dir, ascending. Every
+// segment, warm or cold, has an index file.
+std::vector<uint64_t> list_segments(const std::string &dir) {
+    std::vector<uint64_t> firsts;
+    if (DIR *dp = opendir(dir.c_str())) {
+        while (struct dirent *e = readdir(dp)) {
+            unsigned long long first;
+            char tail;
+            if (sscanf(e->d_name, "seg-%llu.id%c", &first, &tail) == 2 && tail == 'x') {
+                firsts.push_back(first);
+            }
+        }
+        closedir(dp);
+    }
+    std::sort(firsts.begin(), firsts.end());
+    return firsts;
+}
+
+struct SegmentFile {
     int fd;
-    string nick;
-    string inbuf;
-    bool registered;
+    std::string path;
+    SegmentFile(int f, const std::string &p) : fd(f), path(p) {}
+    ~SegmentFile() { if (fd >= 0) close(fd); }
+};
 
-    Client(int f = -1) : fd(f), registered(false) {}
-    void clear() { fd = -1; nick = ""; registered = false; inbuf.clear(); }
+struct JournalEntry {
+    uint64_t offset;   // start of the message in the segment file
+    uint64_t time_ms;  // server arrival time, ms since the epoch
 };
 
-void flush_stdout() { std::fflush(stdout); }
-void flush_stderr() { std::fflush(stderr); }
+// Layout of a seg-N.idx file: an IndexHeader, then one JournalEntry per
+// message. The header is as long as an entry, so entry i is at (i + 1) * 16.
+// Index files from before the header (bare 8-byte offsets, or bare entries)
+// are converted when the journal is opened.
+static const uint64_t JOURNAL_INDEX_VERSION = 2;
 
-static bool running = true;
-static int listenfd = -1;
+struct IndexHeader {
+    char magic[8];     // "CIDX"
+    uint64_t version;
+};
+static_assert(sizeof(IndexHeader) == sizeof(JournalEntry), "index entries must stay aligned");
 
-void handle_sigint(int) {
-    running = false;
-    if (listenfd >= 0) close(listenfd);
+uint64_t index_entries(uint64_t file_size) {
+    return file_size > sizeof(IndexHeader) ? (file_size - sizeof(IndexHeader)) / sizeof(JournalEntry) : 0;
 }
 
-// Function to remove trailing newlines from a string
-void chomp(std::string &s) {
-    while (!s.empty() && (s.back() == '\n' || s.back() == '\r')) s.pop_back();
+off_t index_pos(uint64_t entry) { return sizeof(IndexHeader) + entry * sizeof(JournalEntry); }
+
+IndexHeader index_header() {
+    IndexHeader h{};
+    memcpy(h.magic, "CIDX", 4);
+    h.version = JOURNAL_INDEX_VERSION;
+    return h;
 }
 
-bool is_valid_nick(const std::string &s) {
-    static const std::regex re("^[A-Za-z0-9_]{1,12}$");
-    return std::regex_match(s, re);
+// Make sure the index of segment first is in the current format, rewriting
+// an older one in place. Anything that cannot be recognized is refused
+// rather than guessed at.
+bool upgrade_index(const std::string &dir, uint64_t first) {
+    std::string path = segment_path(dir, first, "idx");
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("open journal index");
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    IndexHeader h;
+    if (pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) && memcmp(h.magic, "CIDX", 4) == 0) {
+        close(fd);
+        if (h.version == JOURNAL_INDEX_VERSION) return true;
+        std::cerr << "Journal index " << path << " has unknown version " << h.version << "\n";
+        return false;
+    }
+    std::vector<uint64_t> words(st.st_size / sizeof(uint64_t));
+    bool ok = pread(fd, words.data(), words.size() * sizeof(uint64_t), 0) == (ssize_t)(words.size() * sizeof(uint64_t));
+    close(fd);
+
+    // Bare entries (version 1) start {0, arrival time}; bare offsets
+    // (version 0) start {0, next offset} and have no times, so those
+    // messages get the log file's modification time.
+    std::vector<JournalEntry> entries;
+    int version = -1;
+    if (!ok || st.st_size % sizeof(uint64_t) != 0) {
+    } else if (words.empty()) {
+        version = 1;
+    } else if (st.st_size % sizeof(JournalEntry) == 0 && words[0] == 0 && words.size() >= 2
+               && words[1] > 1000000000000ULL) {
+        version = 1;
+        entries.resize(words.size() / 2);
+        memcpy(entries.data(), words.data(), entries.size() * sizeof(JournalEntry));
+    } else if (words[0] == 0 && std::is_sorted(words.begin(), words.end())) {
+        version = 0;
+        struct stat lst;
+        uint64_t mtime_ms = stat(segment_path(dir, first, "log").c_str(), &lst) == 0 ? lst.st_mtime * 1000ULL : 0;
+        for (uint64_t off : words) entries.push_back(JournalEntry{off, mtime_ms});
+    }
+    if (version < 0) {
+        std::cerr << "Journal index " << path << " is in no known format\n";
+        return false;
+    }
+    std::string tmp = path + ".tmp";
+    fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    h = index_header();
+    ok = fd >= 0 && write(fd, &h, sizeof(h)) == (ssize_t)sizeof(h);
+    size_t len = entries.size() * sizeof(JournalEntry);
+    ok = ok && write(fd, entries.data(), len) == (ssize_t)len && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        perror("rewrite journal index");
+        unlink(tmp.c_str());
+        return false;
+    }
+    std::cout << "Converted journal index " << path << " from version " << version << std::endl;
+    return true;
 }
 
-bool split_hostport(const std::string &src, std::string &host, std::string &port) {
-    auto pos = src.rfind(':');
-    if (pos == std::string::npos) return false;
-    host = src.substr(0, pos);
-    port = src.substr(pos + 1);
-    return !host.empty() && !port.empty();
+// Layout of a seg-N.cold file: "CCLD1", uint32 block count, the block table,
+// then the zlib-compressed blocks. Blocks start at message boundaries.
+static const size_t COLD_BLOCK_SIZE = 64 * 1024;
+
+struct ColdBlock {
+    uint64_t raw_off;
+    uint64_t raw_len;
+    uint64_t comp_off;
+    uint64_t comp_len;
+};
+
+struct ColdSegment {
+    int fd = -1;
+    uint64_t file_size = 0;
+    std::vector<ColdBlock> blocks;
+    ~ColdSegment() { if (fd >= 0) close(fd); }
+
+    bool open_file(const std::string &path) {
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        fstat(fd, &st);
+        file_size = st.st_size;
+        char magic[5];
+        uint32_t n;
+        if (pread(fd, magic, 5, 0) != 5 || memcmp(magic, "CCLD1", 5) != 0
+            || pread(fd, &n, sizeof(n), 5) != sizeof(n)) return false;
+        blocks.resize(n);
+        ssize_t want = n * sizeof(ColdBlock);
+        return pread(fd, blocks.data(), want, 5 + sizeof(n)) == want;
+    }
+
+    uint64_t raw_size() const { return blocks.empty() ? 0 : blocks.back().raw_off + blocks.back().raw_len; }
+
+    // The block holding raw offset off.
+    size_t block_at(uint64_t off) const {
+        auto it = std::upper_bound(blocks.begin(), blocks.end(), off,
+            [](uint64_t o, const ColdBlock &b) { return o < b.raw_off; });
+        return it == blocks.begin() ? 0 : it - blocks.begin() - 1;
+    }
+
+    bool inflate(size_t i, std::string &raw) const {
+        if (i >= blocks.size()) return false;
+        const ColdBlock &b = blocks[i];
+        std::string comp(b.comp_len, '\0');
+        raw.resize(b.raw_len);
+        uLongf rl = b.raw_len;
+        return pread(fd, &comp[0], comp.size(), b.comp_off) == (ssize_t)comp.size()
+            && uncompress((Bytef *)&raw[0], &rl, (const Bytef *)comp.data(), comp.size()) == Z_OK
+            && rl == b.raw_len;
+    }
+};
+
+// The most recently inflated cold blocks, so clients paging through the same
+// old history, or SEARCH hits close together, inflate a block only once.
+// Used by the event loop only.
+static const size_t COLD_CACHE_BLOCKS = 32;
+
+class ColdBlockCache {
+public:
+    std::shared_ptr<const std::string> get(const std::shared_ptr<ColdSegment> &seg, size_t block) {
+        for (auto it = lru.begin(); it != lru.end(); ++it) {
+            if (it->seg == seg && it->block == block) {
+                lru.splice(lru.begin(), lru, it);
+                return it->raw;
+            }
+        }
+        auto raw = std::make_shared<std::string>();
+        if (!seg->inflate(block, *raw)) return nullptr;
+        lru.push_front(Entry{seg, block, raw});
+        if (lru.size() > COLD_CACHE_BLOCKS) lru.pop_back();
+        return raw;
+    }
+
+private:
+    struct Entry {
+        std::shared_ptr<ColdSegment> seg;
+        size_t block;
+        std::shared_ptr<const std::string> raw;
+    };
+    std::list<Entry> lru;
+};
+
+ColdBlockCache cold_cache;
+
+// Layout of state.snap: the header, then one SnapshotSegment per journal
+// segment, then state_bytes of server state outside the journal (see
+// save_state). A sealed segment whose files still match its summary is
+// opened without reading its index, which is loaded the first time a reader
+// needs it, so a restart only reads the index of the segment being written.
+struct SnapshotHeader {
+    char magic[8];
+    uint64_t next_seq;
+    uint64_t segments;
+    uint64_t state_bytes;
+};
+
+struct SnapshotSegment {
+    uint64_t first_seq;
+    uint64_t count;         // messages
+    uint64_t size;          // bytes of messages
+    uint64_t last_time_ms;  // arrival time of the last message
+};
+
+class Snapshot {
+public:
+    bool load(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        SnapshotHeader h;
+        bool ok = pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) && memcmp(h.magic, "CSNP3", 5) == 0
+            && h.segments < (1u << 24) && h.state_bytes < (1u << 30);
+        if (ok) {
+            segs.resize(h.segments);
+            ssize_t want = segs.size() * sizeof(SnapshotSegment);
+            ok = pread(fd, segs.data(), want, sizeof(h)) == want;
+        }
+        if (ok) {
+            saved.resize(h.state_bytes);
+            ok = pread(fd, &saved[0], saved.size(), sizeof(h) + segs.size() * sizeof(SnapshotSegment))
+                == (ssize_t)saved.size();
+        }
+        close(fd);
+        if (!ok) {
+            std::cerr << "Ignoring unusable snapshot " << path << std::endl;
+            segs.clear();
+            saved.clear();
+            return false;
+        }
+        next = h.next_seq;
+        return true;
+    }
+
+    uint64_t next_seq() const { return next; }
+    const std::string &state() const { return saved; }
+
+    const SnapshotSegment *find(uint64_t first) const {
+        auto it = std::lower_bound(segs.begin(), segs.end(), first,
+            [](const SnapshotSegment &s, uint64_t f) { return s.first_seq < f; });
+        return it != segs.end() && it->first_seq == first ? &*it : nullptr;
+    }
+
+private:
+    std::vector<SnapshotSegment> segs;
+    std::string saved;
+    uint64_t next = 0;
+};
+
+struct Segment {
+    uint64_t first_seq;
+    uint64_t size;                     // bytes of messages in the segment
+    mutable std::vector<JournalEntry> index;  // one entry per message, once loaded
+    std::shared_ptr<SegmentFile> file; // warm segments
+    std::shared_ptr<ColdSegment> cold; // cold segments
+    int idxfd;
+    uint64_t count = 0;                // messages
+    uint64_t last_time_ms = 0;         // arrival time of the last one
+
+    bool indexed() const { return index.size() == count; }
+    uint64_t end_of(size_t i) const { return i + 1 < index.size() ? index[i + 1].offset : size; }
+};
+
+// A byte range that still has to reach a client: part of a segment file,
+// sent with sendfile(), of an in-memory buffer, or of a cold segment's
+// uncompressed contents, inflated a block at a time as it is sent.
+struct FileSpan {
+    std::shared_ptr<SegmentFile> file;
+    uint64_t off;
+    uint64_t len;
+    std::shared_ptr<const std::string> data;
+    std::shared_ptr<ColdSegment> cold;
+};
+
+// Split the part that its first block covers off the front of the cold span
+// spans[at], as an in-memory span. Returns false if the block cannot be read.
+bool inflate_front(std::deque<FileSpan> &spans, size_t at = 0) {
+    FileSpan &sp = spans[at];
+    size_t i = sp.cold->block_at(sp.off);
+    auto raw = cold_cache.get(sp.cold, i);
+    const ColdBlock &b = sp.cold->blocks[i];
+    if (!raw || sp.off < b.raw_off || sp.off >= b.raw_off + b.raw_len) return false;
+    uint64_t n = std::min(sp.len, b.raw_off + b.raw_len - sp.off);
+    FileSpan part{nullptr, sp.off - b.raw_off, n, raw, nullptr};
+    sp.off += n;
+    sp.len -= n;
+    if (sp.len == 0) sp = part;
+    else spans.insert(spans.begin() + at, part);
+    return true;
+}
+
+class Journal {
+public:
+    ~Journal() {
+        flush();
+        for (auto &s : segments) if (s.idxfd >= 0) close(s.idxfd);
+    }
+
+    bool enabled() const { return !dir.empty(); }
+    uint64_t next_seq() const { return next; }
+    uint64_t oldest_seq() const { return segments.empty() ? next : segments.front().first_seq; }
+
+    // The run of consecutive messages at or after from: sets first and
+    // returns where the run ends (both next if there is none).
+    uint64_t run(uint64_t from, uint64_t &first) const {
+        first = next;
+        uint64_t end = next;
+        for (const Segment &s : segments) {
+            uint64_t s_end = s.first_seq + s.count;
+            if (s_end <= from) continue;
+            if (first == next) {
+                first = std::max(from, s.first_seq);
+            } else if (s.first_seq != end) {
+                break;
+            }
+            end = s_end;
+        }
+        return end;
+    }
+
+    // A relay without a journal numbers lines the way its upstream does.
+    void follow_seq(uint64_t seq) {
+        if (!enabled()) next = seq;
+    }
+
+    // Continue numbering at seq, past messages this server never got (a
+    // relay whose upstream no longer had them). Numbers are not reused; the
+    // next append starts a new segment.
+    void skip_to(uint64_t seq) {
+        if (seq <= next) return;
+        flush();
+        ring.clear();
+        next = seq;
+    }
+
+    bool open_dir(const std::string &d) {
+        if (mkdir(d.c_str(), 0755) < 0 && errno != EEXIST) {
+            perror("mkdir journal");
+            return false;
+        }
+        dir = d;
+        Snapshot snap;
+        snap.load(snapshot_path());
+        std::vector<uint64_t> firsts = list_segments(d);
+        for (uint64_t f : firsts) {
+            if (!upgrade_index(d, f)) return false;
+            const SnapshotSegment *known = f != firsts.back() ? snap.find(f) : nullptr;
+            if (known && open_summarized(*known)) continue;
+            if (!load_segment(f)) return false;
+        }
+        if (!segments.empty()) {
+            next = segments.back().first_seq + segments.back().count;
+        }
+        // numbers skipped (skip_to) after the last message are not reused
+        next = std::max(next, snap.next_seq());
+        restored = snap.state();
+        return true;
+    }
+
+    // The server state of the snapshot open_dir() found, empty if none.
+    const std::string &restored_state() const { return restored; }
+
+    std::string snapshot_path() const { return dir + "/state.snap"; }
+
+    // Write a snapshot of the segment table and state. It is built here, one
+    // summary per segment; a forked child only writes, syncs and renames it
+    // into place, so the loop does not wait for the disk. Returns false if
+    // the previous one is still running.
+    bool start_snapshot(const std::string &state) {
+        if (snapshot_pid > 0) return false;
+        flush();
+        std::string buf(sizeof(SnapshotHeader) + segments.size() * sizeof(SnapshotSegment), '\0');
+        SnapshotHeader h{};
+        memcpy(h.magic, "CSNP3", 5);
+        h.next_seq = next;
+        h.segments = segments.size();
+        h.state_bytes = state.size();
+        memcpy(&buf[0], &h, sizeof(h));
+        SnapshotSegment *out = (SnapshotSegment *)&buf[sizeof(h)];
+        for (auto &sg : segments) *out++ = SnapshotSegment{sg.first_seq, sg.count, sg.size, sg.last_time_ms};
+        buf += state;
+        std::string path = snapshot_path();
+        std::string tmp = path + ".tmp";
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork snapshot");
+            return false;
+        }
+        if (pid == 0) _exit(write_snapshot(tmp.c_str(), path.c_str(), buf.data(), buf.size()) ? 0 : 1);
+        snapshot_pid = pid;
+        return true;
+    }
+
+    void reap_snapshot() {
+        int status;
+        if (snapshot_pid > 0 && waitpid(snapshot_pid, &status, WNOHANG) == snapshot_pid) {
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) std::cerr << "State snapshot failed\n";
+            snapshot_pid = -1;
+        }
+    }
+
+    // Queue a line for the next flush(); returns its sequence number, which
+    // is also the message ID clients see.
+    uint64_t append(const std::string &line, uint64_t time_ms) {
+        if (!enabled()) return next++;
+        ring.push_back(line);
+        if (ring.size() > HISTORY_RING_SIZE) ring.pop_front();
+        if (segments.empty() || segments.back().cold || segments.back().first_seq + segments.back().count != next
+            || segments.back().size + pending.size() >= JOURNAL_SEGMENT_SIZE) {
+            flush();
+            if (!start_segment(next)) return next++;
+        }
+        Segment &s = segments.back();
+        s.index.push_back(JournalEntry{s.size + pending.size(), time_ms});
+        s.count++;
+        s.last_time_ms = time_ms;
+        pending_idx.push_back(s.index.back());
+        pending += line;
+        return next++;
+    }
+
+    // Write everything appended since the last call, one write per file.
+    void flush() {
+        if (segments.empty() || (pending.empty() && pending_idx.empty())) return;
+        Segment &s = segments.back();
+        if (write_all(s.file->fd, pending.data(), pending.size())) s.size += pending.size();
+        write_all(s.idxfd, pending_idx.data(), pending_idx.size() * sizeof(JournalEntry));
+        pending.clear();
+        pending_idx.clear();
+    }
+
+    // Resolve up to limit messages with sequence < before (0 means newest)
+    // into spans. Returns the sequence number of the first message; the
+    // ones resolved are consecutive, stopping short of a gap in numbering.
+    uint64_t range(uint64_t before, uint32_t limit, std::vector<FileSpan> &spans, uint32_t &count) const {
+        count = 0;
+        if (before == 0 || before > next) before = next;
+        uint64_t oldest = segments.empty() ? next : segments.front().first_seq;
+        uint64_t first = before > oldest + limit ? before - limit : oldest;
+        if (first >= before) return before;
+
+        // served from the RAM ring when it covers the whole page
+        uint64_t ring_first = next - ring.size();
+        if (first >= ring_first) {
+            auto page = std::make_shared<std::string>();
+            for (uint64_t q = first; q < before; ++q) *page += ring[q - ring_first];
+            spans.push_back(FileSpan{nullptr, 0, page->size(), page, nullptr});
+            count = before - first;
+            return first;
+        }
+
+        auto it = std::upper_bound(segments.begin(), segments.end(), first,
+            [](uint64_t q, const Segment &s) { return q < s.first_seq; });
+        if (it != segments.begin()) --it;
+        uint64_t got = 0;
+        for (; it != segments.end() && it->first_seq < before; ++it) {
+            const Segment &s = *it;
+            uint64_t lo = std::max(first, s.first_seq);
+            uint64_t hi = std::min(before, s.first_seq + s.count);
+            if (lo >= hi) continue;
+            if (count && lo != got + count) break;
+            if (!load_index(s)) break;
+            if (!count) got = lo;
+            uint64_t off = s.index[lo - s.first_seq].offset;
+            uint64_t end = s.end_of(hi - 1 - s.first_seq);
+            if (!segment_span(s, off, end - off, spans)) break;
+            count += hi - lo;
+        }
+        return count ? got : before;
+    }
+
+    // The single journaled line with sequence number seq.
+    bool locate(uint64_t seq, std::vector<FileSpan> &spans) const {
+        auto it = std::upper_bound(segments.begin(), segments.end(), seq,
+            [](uint64_t q, const Segment &s) { return q < s.first_seq; });
+        if (it == segments.begin()) return false;
+        --it;
+        if (seq >= it->first_seq + it->count || !load_index(*it)) return false;
+        size_t i = seq - it->first_seq;
+        return segment_span(*it, it->index[i].offset, it->end_of(i) - it->index[i].offset, spans);
+    }
+
+    // Switch a segment the Compactor has compressed over to its cold file.
+    void adopt_cold(uint64_t first) {
+        if (std::none_of(segments.begin(), segments.end(), [&](const Segment &s) { return s.first_seq == first; })) {
+            unlink(segment_path(dir, first, "cold").c_str());  // retention removed it meanwhile
+            return;
+        }
+        for (auto &s : segments) {
+            if (s.first_seq != first || s.cold || &s == &segments.back()) continue;
+            auto cold = std::make_shared<ColdSegment>();
+            if (!cold->open_file(segment_path(dir, first, "cold")) || cold->raw_size() != s.size) {
+                std::cerr << "Ignoring unusable cold file for segment " << first << std::endl;
+                unlink(segment_path(dir, first, "cold").c_str());
+                return;
+            }
+            s.cold = cold;
+            s.file.reset();  // spans still being sent keep the old file open
+            unlink(segment_path(dir, first, "log").c_str());
+            if (s.idxfd >= 0) close(s.idxfd);
+            s.idxfd = -1;
+        }
+    }
+
+    // Delete the oldest segments while the journal is above max_bytes on
+    // disk or they only hold messages older than max_age_ms (0 = no limit).
+    // Segments still warm go as well, so the size limit holds even when the
+    // Compactor is behind; the segment being appended to never does.
+    // Segments holding sequence numbers from keep_from on are kept past
+    // max_age_ms, but not past max_bytes: the size limit always holds.
+    void enforce_retention(uint64_t max_age_ms, uint64_t max_bytes, uint64_t keep_from) {
+        uint64_t total = 0;
+        for (auto &s : segments) total += disk_size(s);
+        uint64_t now = now_ms();
+        while (segments.size() > 1) {
+            Segment &s = segments.front();
+            bool pinned = s.first_seq + s.count > keep_from;
+            bool too_old = max_age_ms && s.count && s.last_time_ms + max_age_ms < now && !pinned;
+            bool too_big = max_bytes && total > max_bytes;
+            if (!too_old && !too_big) break;
+            std::cout << "Retention: removing journal segment " << s.first_seq
+                      << (pinned ? " with messages reliable clients have not acked" : "") << std::endl;
+            total -= disk_size(s);
+            for (const char *ext : {"log", "cold", "six", "idx"}) unlink(segment_path(dir, s.first_seq, ext).c_str());
+            if (s.idxfd >= 0) close(s.idxfd);
+            segments.erase(segments.begin());
+        }
+    }
+
+private:
+    // Runs in the snapshot child, so only async-signal-safe calls: the
+    // parent's other threads may have held the allocator's locks at fork().
+    static bool write_snapshot(const char *tmp, const char *path, const char *buf, size_t len) {
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        while (len > 0) {
+            ssize_t w = write(fd, buf, len);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) break;
+            buf += w;
+            len -= w;
+        }
+        bool ok = len == 0 && fsync(fd) == 0;
+        close(fd);
+        return ok && rename(tmp, path) == 0;
+    }
+
+    // Read the index of a segment opened from its snapshot summary.
+    bool load_index(const Segment &s) const {
+        if (s.indexed()) return true;
+        int fd = open(segment_path(dir, s.first_seq, "idx").c_str(), O_RDONLY);
+        s.index.resize(s.count);
+        ssize_t want = s.count * sizeof(JournalEntry);
+        bool ok = fd >= 0 && pread(fd, s.index.data(), want, index_pos(0)) == want;
+        if (fd >= 0) close(fd);
+        if (!ok) {
+            std::cerr << "Failed to read index of journal segment " << s.first_seq << std::endl;
+            s.index.clear();
+        }
+        return ok;
+    }
+
+    bool segment_span(const Segment &s, uint64_t off, uint64_t len, std::vector<FileSpan> &spans) const {
+        spans.push_back(FileSpan{s.file, off, len, nullptr, s.cold});
+        return true;
+    }
+
+    static uint64_t disk_size(const Segment &s) {
+        return (s.cold ? s.cold->file_size : s.size) + s.count * sizeof(JournalEntry);
+    }
+
+    static bool write_all(int fd, const void *p, size_t n) {
+        const char *b = (const char *)p;
+        while (n > 0) {
+            ssize_t w = write(fd, b, n);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                perror("journal write");
+                return false;
+            }
+            b += w;
+            n -= w;
+        }
+        return true;
+    }
+
+    bool start_segment(uint64_t first) {
+        std::string path = segment_path(dir, first, "log");
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        int idxfd = open(segment_path(dir, first, "idx").c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        IndexHeader h = index_header();
+        if (fd < 0 || idxfd < 0 || !write_all(idxfd, &h, sizeof(h))) {
+            perror("open journal segment");
+            if (fd >= 0) close(fd);
+            if (idxfd >= 0) close(idxfd);
+            return false;
+        }
+        segments.push_back(Segment{first, 0, {}, std::make_shared<SegmentFile>(fd, path), nullptr, idxfd});
+        return true;
+    }
+
+    // Open a sealed segment from its snapshot summary, without its index,
+    // if its files still have the sizes the summary says.
+    bool open_summarized(const SnapshotSegment &k) {
+        struct stat st;
+        if (stat(segment_path(dir, k.first_seq, "idx").c_str(), &st) < 0
+            || (uint64_t)st.st_size != (uint64_t)index_pos(k.count)) return false;
+        Segment s{k.first_seq, k.size, {}, nullptr, nullptr, -1, k.count, k.last_time_ms};
+        std::string path = segment_path(dir, k.first_seq, "log");
+        if (stat(path.c_str(), &st) == 0) {
+            int fd = (uint64_t)st.st_size == k.size ? open(path.c_str(), O_RDONLY) : -1;
+            if (fd < 0) return false;
+            s.file = std::make_shared<SegmentFile>(fd, path);
+        } else {
+            auto cold = std::make_shared<ColdSegment>();
+            if (!cold->open_file(segment_path(dir, k.first_seq, "cold")) || cold->raw_size() != k.size) return false;
+            s.cold = cold;
+        }
+        segments.push_back(std::move(s));
+        return true;
+    }
+
+    // Reopen an existing segment, reading its whole index. A warm segment
+    // is cut back to its last complete message, in case the server died in
+    // the middle of a write.
+    bool load_segment(uint64_t first) {
+        int idxfd = open(segment_path(dir, first, "idx").c_str(), O_RDWR | O_APPEND);
+        if (idxfd < 0) {
+            perror("open journal index");
+            return false;
+        }
+        Segment s{first, 0, {}, nullptr, nullptr, idxfd};
+        struct stat st;
+        fstat(idxfd, &st);
+        s.index.resize(index_entries(st.st_size));
+        if (pread(idxfd, s.index.data(), s.index.size() * sizeof(JournalEntry), index_pos(0)) < 0) {
+            perror("read journal index");
+            close(idxfd);
+            return false;
+        }
+
+        std::string path = segment_path(dir, first, "log");
+        int fd = open(path.c_str(), O_RDWR | O_APPEND);
+        if (fd < 0) {
+            auto cold = std::make_shared<ColdSegment>();
+            if (!cold->open_file(segment_path(dir, first, "cold"))) {
+                std::cerr << "Journal segment " << first << " has neither log nor cold file\n";
+                close(idxfd);
+                return false;
+            }
+            s.cold = cold;
+            s.size = cold->raw_size();
+            close(idxfd);
+            s.idxfd = -1;
+            push_loaded(std::move(s));
+            return true;
+        }
+        s.file = std::make_shared<SegmentFile>(fd, path);
+
+        fstat(fd, &st);
+        s.size = st.st_size;
+        while (!s.index.empty() && s.index.back().offset >= s.size) s.index.pop_back();
+        s.size = 0;
+        if (!s.index.empty()) {
+            char buf[512];
+            ssize_t n = pread(fd, buf, sizeof(buf), s.index.back().offset);
+            const char *nl = n > 0 ? (const char *)memchr(buf, '\n', n) : nullptr;
+            if (nl) s.size = s.index.back().offset + (nl - buf) + 1;
+            else s.index.pop_back();
+            if (!nl && !s.index.empty()) s.size = s.index.back().offset;
+        }
+        if (ftruncate(fd, s.size) < 0) perror("truncate journal segment");
+        if (ftruncate(idxfd, index_pos(s.index.size())) < 0) perror("truncate journal index");
+        push_loaded(std::move(s));
+        return true;
+    }
+
+    void push_loaded(Segment &&s) {
+        s.count = s.index.size();
+        s.last_time_ms = s.index.empty() ? 0 : s.index.back().time_ms;
+        segments.push_back(std::move(s));
+    }
+
+    std::string dir;
+    std::vector<Segment> segments;
+    std::string pending;
+    std::vector<JournalEntry> pending_idx;
+    std::deque<std::string> ring;  // newest appended lines, oldest first
+    uint64_t next = 1;
+    pid_t snapshot_pid = -1;
+    std::string restored;
+};
+
+// Full-text index over the journal, built by a background thread that tails
+// the segment files, so indexing never runs on the event loop. Every segment
+// gets its own index: posting lists of message numbers within the segment
+// (varint-encoded deltas) keyed by lower-cased word and by "@nick", plus the
+// arrival time of each message for time-range queries. Once a segment is
+// complete its index is written next to it as seg-N.six and loaded from there
+// on restart instead of being rebuilt.
+static const int SEARCH_POLL_MS = 200;
+static const size_t SEARCH_BATCH_BYTES = 1024 * 1024;  // journal bytes per lock hold
+static const size_t SEARCH_DEFAULT_LIMIT = 20;
+static const size_t SEARCH_MAX_LIMIT = 100;
+
+struct PostingList {
+    std::string bytes;
+    uint32_t last = 0;
+    uint32_t count = 0;
+
+    void add(uint32_t n) {
+        if (count && n == last) return;
+        uint32_t d = count ? n - last : n;
+        while (d >= 0x80) {
+            bytes.push_back((char)(d | 0x80));
+            d >>= 7;
+        }
+        bytes.push_back((char)d);
+        last = n;
+        count++;
+    }
+
+    void decode(std::vector<uint32_t> &out) const {
+        out.clear();
+        out.reserve(count);
+        uint32_t v = 0, d = 0;
+        int shift = 0;
+        for (unsigned char b : bytes) {
+            d |= (uint32_t)(b & 0x7f) << shift;
+            if (b & 0x80) {
+                shift += 7;
+                continue;
+            }
+            v = out.empty() ? d : v + d;
+            out.push_back(v);
+            d = 0;
+            shift = 0;
+        }
+    }
+};
+
+struct SegmentIndex {
+    uint32_t indexed = 0;            // messages of the segment processed so far
+    std::vector<uint64_t> times;     // arrival time per message
+    std::unordered_map<std::string, PostingList> terms;
+    bool sealed = false;             // complete and saved to its .six file
+};
+
+struct SearchQuery {
+    std::vector<std::string> terms;
+    std::string nick;
+    uint64_t since_ms = 0;
+    uint64_t until_ms = UINT64_MAX;
+};
+
+// Lower-cased runs of [A-Za-z0-9_], 2 to 32 characters long.
+void tokenize(const char *p, size_t n, std::vector<std::string> &out) {
+    std::string cur;
+    for (size_t i = 0; i <= n; ++i) {
+        unsigned char ch = i < n ? p[i] : ' ';
+        if (isalnum(ch) || ch == '_') {
+            cur.push_back((char)tolower(ch));
+        } else {
+            if (cur.size() >= 2 && cur.size() <= 32) out.push_back(cur);
+            cur.clear();
+        }
+    }
+}
+
+class SearchIndex {
+public:
+    ~SearchIndex() { stop(); }
+
+    void start(const std::string &journal_dir) {
+        dir = journal_dir;
+        stopping = false;
+        worker = std::thread(&SearchIndex::run, this);
+    }
+
+    void stop() {
+        stopping = true;
+        if (worker.joinable()) worker.join();
+    }
+
+    bool enabled() const { return worker.joinable(); }
+
+    // Sequence numbers of matching messages, newest first.
+    std::vector<uint64_t> query(const SearchQuery &q, size_t limit) const {
+        std::vector<std::string> keys = q.terms;
+        if (!q.nick.empty()) {
+            std::string k = "@";
+            for (char ch : q.nick) k.push_back((char)tolower((unsigned char)ch));
+            keys.push_back(k);
+        }
+        std::vector<uint64_t> hits;
+        std::vector<uint32_t> cand, next, both;
+        std::shared_lock<std::shared_mutex> lk(mu);
+        for (auto it = segs.rbegin(); it != segs.rend() && hits.size() < limit; ++it) {
+            const SegmentIndex &si = it->second;
+            uint32_t lo = std::lower_bound(si.times.begin(), si.times.end(), q.since_ms) - si.times.begin();
+            uint32_t hi = std::upper_bound(si.times.begin(), si.times.end(), q.until_ms) - si.times.begin();
+            if (lo >= hi) continue;
+
+            std::vector<const PostingList *> lists;
+            for (auto &k : keys) {
+                auto p = si.terms.find(k);
+                if (p == si.terms.end()) break;
+                lists.push_back(&p->second);
+            }
+            if (lists.size() != keys.size()) continue;
+            std::sort(lists.begin(), lists.end(),
+                      [](const PostingList *a, const PostingList *b) { return a->count < b->count; });
+
+            if (lists.empty()) {
+                cand.clear();
+                for (uint32_t i = lo; i < hi; ++i) cand.push_back(i);
+            } else {
+                lists[0]->decode(cand);
+                for (size_t i = 1; i < lists.size() && !cand.empty(); ++i) {
+                    lists[i]->decode(next);
+                    both.clear();
+                    std::set_intersection(cand.begin(), cand.end(), next.begin(), next.end(),
+                                          std::back_inserter(both));
+                    cand.swap(both);
+                }
+            }
+            for (auto r = cand.rbegin(); r != cand.rend() && hits.size() < limit; ++r) {
+                if (*r >= lo && *r < hi) hits.push_back(it->first + *r);
+            }
+        }
+        return hits;
+    }
+
+private:
+    void run() {
+        while (!stopping) {
+            if (!catch_up()) std::this_thread::sleep_for(std::chrono::milliseconds(SEARCH_POLL_MS));
+        }
+    }
+
+    // One pass over the journal; returns true if anything new was indexed.
+    bool catch_up() {
+        std::vector<uint64_t> firsts = list_segments(dir);
+        {
+            // forget segments that were deleted from the journal
+            std::unique_lock<std::shared_mutex> lk(mu);
+            for (auto it = segs.begin(); it != segs.end();) {
+                if (!std::binary_search(firsts.begin(), firsts.end(), it->first)) it = segs.erase(it);
+                else ++it;
+            }
+        }
+        bool progress = false;
+        for (size_t i = 0; i < firsts.size() && !stopping; ++i) {
+            uint64_t first = firsts[i];
+            uint32_t indexed;
+            {
+                std::shared_lock<std::shared_mutex> lk(mu);
+                auto it = segs.find(first);
+                if (it != segs.end() && it->second.sealed) continue;
+                indexed = it == segs.end() ? 0 : it->second.indexed;
+            }
+            if (indexed == 0 && load(first)) {
+                progress = true;
+                continue;
+            }
+            bool complete = false;
+            if (index_segment(first, indexed, complete)) progress = true;
+            if (complete && i + 1 < firsts.size()) save(first);
+        }
+        return progress;
+    }
+
+    // Index the messages of a segment from number "from" on, in batches.
+    // complete is set when every message listed in its index file is done.
+    bool index_segment(uint64_t first, uint32_t from, bool &complete) {
+        int idxfd = open(segment_path(dir, first, "idx").c_str(), O_RDONLY);
+        int logfd = open(segment_path(dir, first, "log").c_str(), O_RDONLY);
+        bool progress = false;
+        complete = false;
+        if (idxfd >= 0 && logfd >= 0) {
+            struct stat ist, lst;
+            fstat(idxfd, &ist);
+            fstat(logfd, &lst);
+            uint32_t total = index_entries(ist.st_size);
+            std::vector<JournalEntry> entries;
+            std::string data;
+            while (from < total && !stopping) {
+                entries.resize(std::min<uint32_t>(total - from, 4096));
+                ssize_t n = pread(idxfd, entries.data(), entries.size() * sizeof(JournalEntry),
+                                  index_pos(from));
+                if (n <= 0) break;
+                entries.resize(n / sizeof(JournalEntry));
+                uint64_t start = entries.front().offset;
+                size_t len = std::min<uint64_t>(lst.st_size - std::min<uint64_t>(start, lst.st_size),
+                                                SEARCH_BATCH_BYTES);
+                data.resize(len);
+                n = pread(logfd, &data[0], len, start);
+                if (n <= 0) break;
+                data.resize(n);
+
+                std::vector<std::pair<std::string, uint32_t>> postings;
+                std::vector<uint64_t> times;
+                std::vector<std::string> words;
+                for (auto &e : entries) {
+                    size_t off = e.offset - start;
+                    size_t nl = off < data.size() ? data.find('\n', off) : std::string::npos;
+                    if (nl == std::string::npos) break;
+                    uint32_t msg = from + times.size();
+                    // "MSG <nick> <text>"
+                    size_t sp1 = data.find(' ', off);
+                    size_t sp2 = sp1 < nl ? data.find(' ', sp1 + 1) : std::string::npos;
+                    if (sp2 != std::string::npos && sp2 < nl) {
+                        std::string nick = "@";
+                        for (size_t k = sp1 + 1; k < sp2; ++k) nick.push_back((char)tolower((unsigned char)data[k]));
+                        postings.emplace_back(nick, msg);
+                        words.clear();
+                        tokenize(data.data() + sp2 + 1, nl - sp2 - 1, words);
+                        for (auto &w : words) postings.emplace_back(w, msg);
+                    }
+                    times.push_back(e.time_ms);
+                }
+                if (times.empty()) break;
+                {
+                    std::unique_lock<std::shared_mutex> lk(mu);
+                    SegmentIndex &si = segs[first];
+                    for (auto &p : postings) si.terms[p.first].add(p.second);
+                    si.times.insert(si.times.end(), times.begin(), times.end());
+                    si.indexed += times.size();
+                }
+                from += times.size();
+                progress = true;
+            }
+            complete = from == total;
+        }
+        if (idxfd >= 0) close(idxfd);
+        if (logfd >= 0) close(logfd);
+        return progress;
+    }
+
+    static void put32(std::string &b, uint32_t v) { b.append((const char *)&v, sizeof(v)); }
+
+    void save(uint64_t first) {
+        std::string buf = "CSIX1";
+        {
+            std::shared_lock<std::shared_mutex> lk(mu);
+            const SegmentIndex &si = segs.at(first);
+            put32(buf, si.indexed);
+            buf.append((const char *)si.times.data(), si.times.size() * sizeof(uint64_t));
+            put32(buf, si.terms.size());
+            for (auto &t : si.terms) {
+                put32(buf, t.first.size());
+                buf += t.first;
+                put32(buf, t.second.count);
+                put32(buf, t.second.last);
+                put32(buf, t.second.bytes.size());
+                buf += t.second.bytes;
+            }
+        }
+        std::string path = segment_path(dir, first, "six");
+        std::string tmp = path + ".tmp";
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return;
+        bool ok = write(fd, buf.data(), buf.size()) == (ssize_t)buf.size();
+        close(fd);
+        if (ok && rename(tmp.c_str(), path.c_str()) == 0) {
+            std::unique_lock<std::shared_mutex> lk(mu);
+            segs[first].sealed = true;
+        } else {
+            unlink(tmp.c_str());
+        }
+    }
+
+    bool load(uint64_t first) {
+        int fd = open(segment_path(dir, first, "six").c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        fstat(fd, &st);
+        std::string buf(st.st_size, '\0');
+        bool ok = pread(fd, &buf[0], buf.size(), 0) == (ssize_t)buf.size();
+        close(fd);
+        size_t pos = 5;
+        auto get32 = [&](uint32_t &v) {
+            if (pos + sizeof(v) > buf.size()) return false;
+            memcpy(&v, buf.data() + pos, sizeof(v));
+            pos += sizeof(v);
+            return true;
+        };
+        SegmentIndex si;
+        uint32_t count, nterms;
+        ok = ok && buf.compare(0, 5, "CSIX1") == 0 && get32(count)
+             && pos + count * sizeof(uint64_t) <= buf.size();
+        if (ok) {
+            si.indexed = count;
+            si.times.resize(count);
+            memcpy(si.times.data(), buf.data() + pos, count * sizeof(uint64_t));
+            pos += count * sizeof(uint64_t);
+            ok = get32(nterms);
+        }
+        for (uint32_t i = 0; ok && i < nterms; ++i) {
+            uint32_t tl, bl;
+            PostingList pl;
+            ok = get32(tl) && pos + tl <= buf.size();
+            if (!ok) break;
+            std::string term = buf.substr(pos, tl);
+            pos += tl;
+            ok = get32(pl.count) && get32(pl.last) && get32(bl) && pos + bl <= buf.size();
+            if (!ok) break;
+            pl.bytes = buf.substr(pos, bl);
+            pos += bl;
+            si.terms.emplace(std::move(term), std::move(pl));
+        }
+        if (!ok) {
+            std::cerr << "Ignoring damaged search index for segment " << first << std::endl;
+            return false;
+        }
+        si.sealed = true;
+        std::unique_lock<std::shared_mutex> lk(mu);
+        segs[first] = std::move(si);
+        return true;
+    }
+
+    std::string dir;
+    mutable std::shared_mutex mu;
+    std::map<uint64_t, SegmentIndex> segs;  // keyed by first sequence number
+    std::thread worker;
+    std::atomic<bool> stopping{false};
+};
+
+// Background thread that compresses warm journal segments into cold ones.
+// Everything but the active segment and the newest warm_segments sealed ones
+// is compressed once the search index has been saved for it; the event loop
+// picks the results up with take_done() and switches the Journal over.
+static const int COMPACT_POLL_MS = 1000;
+static const size_t JOURNAL_WARM_SEGMENTS = 4;
+
+class Compactor {
+public:
+    ~Compactor() { stop(); }
+
+    void start(const std::string &journal_dir, size_t warm) {
+        dir = journal_dir;
+        warm_segments = warm;
+        stopping = false;
+        worker = std::thread(&Compactor::run, this);
+    }
+
+    void stop() {
+        stopping = true;
+        if (worker.joinable()) worker.join();
+    }
+
+    std::vector<uint64_t> take_done() {
+        std::lock_guard<std::mutex> lk(mu);
+        std::vector<uint64_t> out;
+        out.swap(done);
+        return out;
+    }
+
+private:
+    void run() {
+        while (!stopping) {
+            bool progress = false;
+            std::vector<uint64_t> firsts = list_segments(dir);
+            for (size_t i = 0; i + 1 + warm_segments < firsts.size() && !stopping; ++i) {
+                uint64_t first = firsts[i];
+                if (access(segment_path(dir, first, "log").c_str(), F_OK) != 0
+                    || access(segment_path(dir, first, "cold").c_str(), F_OK) == 0
+                    || access(segment_path(dir, first, "six").c_str(), F_OK) != 0) continue;
+                if (compress_segment(first)) {
+                    std::lock_guard<std::mutex> lk(mu);
+                    done.push_back(first);
+                    progress = true;
+                }
+            }
+            if (!progress) std::this_thread::sleep_for(std::chrono::milliseconds(COMPACT_POLL_MS));
+        }
+    }
+
+    bool compress_segment(uint64_t first) {
+        int idxfd = open(segment_path(dir, first, "idx").c_str(), O_RDONLY);
+        int logfd = open(segment_path(dir, first, "log").c_str(), O_RDONLY);
+        std::vector<JournalEntry> index;
+        struct stat st{};
+        bool ok = idxfd >= 0 && logfd >= 0 && fstat(idxfd, &st) == 0;
+        if (ok) {
+            index.resize(index_entries(st.st_size));
+            ok = pread(idxfd, index.data(), index.size() * sizeof(JournalEntry), index_pos(0)) >= 0;
+        }
+        ok = ok && fstat(logfd, &st) == 0 && st.st_size > 0;
+        const char *raw = nullptr;
+        if (ok) {
+            raw = (const char *)mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, logfd, 0);
+            ok = raw != MAP_FAILED;
+            if (ok) madvise((void *)raw, st.st_size, MADV_SEQUENTIAL);
+        }
+        if (idxfd >= 0) close(idxfd);
+        if (logfd >= 0) close(logfd);
+        if (!ok) return false;
+
+        // cut blocks at the first message boundary past COLD_BLOCK_SIZE
+        std::vector<ColdBlock> blocks;
+        uint64_t start = 0;
+        for (auto &e : index) {
+            if (e.offset - start >= COLD_BLOCK_SIZE) {
+                blocks.push_back(ColdBlock{start, e.offset - start, 0, 0});
+                start = e.offset;
+            }
+        }
+        blocks.push_back(ColdBlock{start, (uint64_t)st.st_size - start, 0, 0});
+
+        std::string body;
+        std::string comp;
+        uint64_t header = 5 + sizeof(uint32_t) + blocks.size() * sizeof(ColdBlock);
+        for (auto &b : blocks) {
+            uLongf cl = compressBound(b.raw_len);
+            comp.resize(cl);
+            if (compress2((Bytef *)&comp[0], &cl, (const Bytef *)raw + b.raw_off, b.raw_len, 6) != Z_OK) {
+                ok = false;
+                break;
+            }
+            b.comp_off = header + body.size();
+            b.comp_len = cl;
+            body.append(comp, 0, cl);
+        }
+        munmap((void *)raw, st.st_size);
+        if (!ok) return false;
+
+        std::string out = "CCLD1";
+        uint32_t n = blocks.size();
+        out.append((const char *)&n, sizeof(n));
+        out.append((const char *)blocks.data(), blocks.size() * sizeof(ColdBlock));
+        out += body;
+
+        std::string path = segment_path(dir, first, "cold");
+        std::string tmp = path + ".tmp";
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        ok = write(fd, out.data(), out.size()) == (ssize_t)out.size() && fsync(fd) == 0;
+        close(fd);
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    std::string dir;
+    size_t warm_segments = JOURNAL_WARM_SEGMENTS;
+    std::mutex mu;
+    std::vector<uint64_t> done;
+    std::thread worker;
+    std::atomic<bool> stopping{false};
+};
+
+// Delivery positions of clients in reliable mode (RELIABLE), by nick, so
+// they survive drops and reconnects. A client acks cumulatively: everything
+// up to its position has been processed. Everything after it is still in the
+// journal, which is where a reconnect resends it from, so the table holds
+// one number per nick and no copies of messages. Positions hold back journal
+// retention until their nick has not been heard from for RELIABLE_IDLE_MS.
+static const uint64_t RELIABLE_IDLE_MS = 7ULL * 24 * 3600 * 1000;
+
+class AckPositions {
+public:
+    bool find(const std::string &nick, uint64_t &seq) const {
+        auto it = positions.find(nick);
+        if (it == positions.end()) return false;
+        seq = it->second.seq;
+        return true;
+    }
+
+    void set(const std::string &nick, uint64_t seq, uint64_t now) { positions[nick] = Position{seq, now}; }
+
+    // Acks only move forward.
+    void advance(const std::string &nick, uint64_t seq, uint64_t now) {
+        Position &p = positions[nick];
+        p.seq = std::max(p.seq, seq);
+        p.seen_ms = now;
+    }
+
+    // The first sequence number some position still waits for (UINT64_MAX
+    // if none). Forgets idle nicks on the way.
+    uint64_t oldest_pending(uint64_t now) {
+        uint64_t oldest = UINT64_MAX;
+        for (auto it = positions.begin(); it != positions.end();) {
+            if (now - it->second.seen_ms > RELIABLE_IDLE_MS) {
+                it = positions.erase(it);
+                continue;
+            }
+            oldest = std::min(oldest, it->second.seq + 1);
+            ++it;
+        }
+        return oldest;
+    }
+
+    // fn(nick, seq, seen_ms) for every position.
+    template <typename Fn>
+    void for_each(Fn fn) const {
+        for (auto &p : positions) fn(p.first, p.second.seq, p.second.seen_ms);
+    }
+
+private:
+    struct Position {
+        uint64_t seq = 0;
+        uint64_t seen_ms = 0;
+    };
+    std::unordered_map<std::string, Position> positions;
+};
+
+// Current and previous SKETCH_WINDOW_MS window of both sketches.
+struct TrafficStats {
+    HeavyHitters talkers[2];
+    HyperLogLog active[2];
+    uint64_t messages[2] = {0, 0};
+    uint64_t messages_total = 0;
+    uint64_t window_start = 0;
+
+    void record(uint64_t nick_hash, const std::string &nick) {
+        talkers[0].add(nick_hash, nick);
+        active[0].add(nick_hash);
+        messages[0]++;
+        messages_total++;
+    }
+
+    // Called from housekeeping; starts a new window when the current one is over.
+    void roll(uint64_t now) {
+        if (now - window_start < SKETCH_WINDOW_MS) return;
+        std::swap(talkers[0], talkers[1]);
+        std::swap(active[0], active[1]);
+        messages[1] = messages[0];
+        talkers[0].clear();
+        active[0].clear();
+        messages[0] = 0;
+        window_start = now;
+    }
+};
+
+// Sheds optional work, one stage at a time, when the main loop falls behind.
+// Two signals are sampled: loop lag (how long one pass took, not counting
+// the select() wait) and queue delay (how long a client's pending output
+// waited before it was fully written). As in CoDel, only the minimum over
+// an interval counts, so one slow pass or one stalled reader is ignored
+// while a standing backlog is not. Intervals above target raise the level,
+// at most once per OVERLOAD_ESCALATE_MS; OVERLOAD_RECOVER_MS below target
+// lowers it.
+// Chat delivery itself is never shed.
+enum OverloadLevel {
+    LOAD_NORMAL,
+    SHED_EPHEMERAL,      // TYPING events are dropped
+    SLOW_AGGREGATES,     // reaction totals go out every REACTION_SLOW_FLUSH_MS
+    RATE_LIMIT,          // MSG limited to OVERLOAD_MSG_RATE per client
+    REFUSE_CONNECTIONS,  // new chat connections get an immediate ERROR
+};
+static const uint64_t OVERLOAD_INTERVAL_MS = 100;
+static const uint64_t OVERLOAD_LAG_TARGET_MS = 20;
+static const uint64_t OVERLOAD_DELAY_TARGET_MS = 50;
+static const uint64_t OVERLOAD_ESCALATE_MS = 500;
+static const uint64_t OVERLOAD_RECOVER_MS = 2000;
+static const int REACTION_SLOW_FLUSH_MS = 2000;
+static const uint64_t OVERLOAD_MSG_RATE = 2;   // per second
+static const uint64_t OVERLOAD_MSG_BURST = 5;
+
+class OverloadController {
+public:
+    void sample_lag(uint64_t ms) { lag_min = std::min(lag_min, ms); }
+    void sample_delay(uint64_t ms) { delay_min = std::min(delay_min, ms); }
+
+    // Called once per loop pass; returns true when the level changed.
+    bool update(uint64_t now) {
+        if (now - interval_start < OVERLOAD_INTERVAL_MS) return false;
+        // an interval without samples (idle, or every reader stalled) is not overload
+        last_lag = lag_min == UINT64_MAX ? 0 : lag_min;
+        last_delay = delay_min == UINT64_MAX ? 0 : delay_min;
+        lag_min = delay_min = UINT64_MAX;
+        interval_start = now;
+        int before = level;
+        if (last_lag > OVERLOAD_LAG_TARGET_MS || last_delay > OVERLOAD_DELAY_TARGET_MS) {
+            if (level < REFUSE_CONNECTIONS && now - raised_at >= OVERLOAD_ESCALATE_MS) {
+                level++;
+                raised_at = now;
+            }
+            good_since = now;
+        } else if (level > LOAD_NORMAL && now - good_since >= OVERLOAD_RECOVER_MS) {
+            level--;
+            good_since = now;
+        }
+        return level != before;
+    }
+
+    int level = LOAD_NORMAL;
+    uint64_t last_lag = 0;    // interval minimums, for STATS
+    uint64_t last_delay = 0;
+
+private:
+    uint64_t lag_min = UINT64_MAX;
+    uint64_t delay_min = UINT64_MAX;
+    uint64_t interval_start = 0;
+    uint64_t good_since = 0;
+    uint64_t raised_at = 0;
+};
+
+// File transfer between two users, relayed outside the chat stream. Both
+// sides open a data connection to the client port and name the transfer
+// with their token ("XFER <token>"). The server then moves the bytes
+// sender -> pipe -> receiver with splice(), so the file never enters user
+// space. Each transfer is capped at rate bytes/s (token bucket) and moves at
+// most TRANSFER_QUANTUM bytes per loop pass, so chat traffic is not starved.
+static const size_t TRANSFER_QUANTUM = 64 * 1024;
+static const size_t TRANSFER_PIPE_SIZE = 64 * 1024;
+static const uint64_t TRANSFER_TIMEOUT_MS = 60 * 1000;  // idle or unanswered
+static const uint64_t TRANSFER_DEFAULT_RATE = 1024 * 1024;
+
+struct Transfer {
+    uint64_t id;
+    uint64_t from_id, to_id;    // chat connections of sender and receiver
+    std::string from, name;
+    uint64_t size;
+    std::string send_token, recv_token;
+    bool accepted = false;
+    int src = -1, dst = -1;     // data connections, once attached
+    int pipefd[2] = {-1, -1};
+    uint64_t in_pipe = 0;
+    uint64_t moved_in = 0, moved_out = 0;
+    uint64_t allowance = 0;     // bytes that may be read before the next refill
+    uint64_t last_refill = 0;
+    uint64_t last_active = 0;
+
+    bool running() const { return src >= 0 && dst >= 0; }
+    bool throttled() const { return running() && allowance == 0 && moved_in < size; }
+
+    void close_fds() {
+        for (int *fd : {&src, &dst, &pipefd[0], &pipefd[1]}) {
+            if (*fd >= 0) close_watched(*fd);
+            *fd = -1;
+        }
+    }
+
+    // Refill the token bucket; at most one second of burst is kept.
+    void refill(uint64_t now, uint64_t rate) {
+        if (!rate) {
+            allowance = TRANSFER_QUANTUM;
+        } else if (now > last_refill) {
+            allowance = std::min(allowance + (now - last_refill) * rate / 1000, rate);
+        }
+        last_refill = now;
+    }
+
+    // Move what the sockets and the budget allow. Returns false on failure.
+    bool pump(bool readable, bool writable) {
+        if (readable && in_pipe < TRANSFER_PIPE_SIZE && moved_in < size && allowance > 0) {
+            size_t want = std::min<uint64_t>({TRANSFER_PIPE_SIZE - in_pipe, size - moved_in,
+                                              allowance, TRANSFER_QUANTUM});
+            ssize_t n = splice(src, nullptr, pipefd[1], nullptr, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == 0) return false;  // sender went away early
+            if (n < 0 && errno != EAGAIN && errno != EINTR) return false;
+            if (n > 0) {
+                in_pipe += n;
+                moved_in += n;
+                allowance -= n;
+                last_active = now_ms();
+            }
+        }
+        if (writable && in_pipe > 0) {
+            ssize_t n = splice(pipefd[0], nullptr, dst, nullptr, in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) return false;
+            if (n > 0) {
+                in_pipe -= n;
+                moved_out += n;
+                last_active = now_ms();
+            }
+        }
+        return true;
+    }
+};
+
+// Ephemeral "TYPING <nick> <0|1>" events. They are never journaled, relayed
+// or replayed. The room keeps only the newest state per sender, ordered by
+// a version counter, and every member remembers the last version it was
+// sent. A burst of keystrokes thus costs one entry per sender, however many
+// members there are. A member that is behind on chat gets nothing until it
+// has caught up, and is then sent only the newest states.
+static const uint64_t TYPING_TTL_MS = 10 * 1000;
+
+class TypingTable {
+public:
+    uint64_t version() const { return next - 1; }
+
+    void update(uint64_t sender, const std::string &nick, bool typing) {
+        auto it = index.find(sender);
+        if (it != index.end()) entries.erase(it->second);
+        entries.push_back(Entry{sender, "TYPING " + nick + (typing ? " 1\n" : " 0\n"), typing, next++, now_ms()});
+        index[sender] = std::prev(entries.end());
+    }
+
+    // The sender sent a message or left: clear a "typing" state it still has.
+    void stop(uint64_t sender, const std::string &nick) {
+        auto it = index.find(sender);
+        if (it != index.end() && it->second->typing) update(sender, nick, false);
+    }
+
+    // Lines newer than seen, except the reader's own; advances seen.
+    std::string collect(uint64_t reader, uint64_t &seen) const {
+        std::string out;
+        uint64_t now = now_ms();
+        auto it = entries.end();
+        while (it != entries.begin() && std::prev(it)->version > seen) --it;
+        for (; it != entries.end(); ++it) {
+            if (it->sender != reader && now - it->time < TYPING_TTL_MS) out += it->line;
+        }
+        seen = version();
+        return out;
+    }
+
+    // Forget states older than TYPING_TTL_MS; receivers have expired them.
+    void expire(uint64_t now) {
+        while (!entries.empty() && now - entries.front().time >= TYPING_TTL_MS) {
+            index.erase(entries.front().sender);
+            entries.pop_front();
+        }
+    }
+
+private:
+    struct Entry {
+        uint64_t sender;
+        std::string line;
+        bool typing;
+        uint64_t version;
+        uint64_t time;
+    };
+    std::list<Entry> entries;  // oldest version first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+    uint64_t next = 1;
+};
+
+// Client ids, handed out by the main loop and the acceptor thread.
+static std::atomic<uint64_t> next_client_id{1};
+
+// Shard id in the NickRegistry of clients served by the main loop. Room
+// workers and the acceptor never own a connection, so every nick of this
+// process is under it; the acceptor registers nicks on the loop's behalf.
+static const uint16_t MAIN_SHARD = 0;
+
+// The client id reserved nicks are registered under; no connection has it.
+static const uint64_t RESERVED_NICK_CLIENT = (1ULL << 48) - 1;
+static const uint64_t RESTART_NICK_GRACE_MS = 60 * 1000;
+
+// Address of the peer of a TCP socket, empty for anything else.
+std::string peer_address(int fd) {
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    char buf[INET6_ADDRSTRLEN] = "";
+    if (getpeername(fd, (struct sockaddr *)&ss, &len) < 0) return "";
+    if (ss.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((struct sockaddr_in *)&ss)->sin_addr, buf, sizeof(buf));
+    } else if (ss.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&ss)->sin6_addr, buf, sizeof(buf));
+    }
+    return buf;
+}
+
+// Nicks of all -p worker processes, kept in their shared mapping (see
+// PeerRings), so a nick is unique across the workers and a worker can tell
+// that a nick it does not know is connected to another one. Each process
+// keeps its own NickRegistry for its clients; this table only records which
+// worker holds a nick. It is small and NICK is rare, so a process-shared
+// robust mutex guards it: a worker that dies holding it does not block the
+// others. The table is open addressing with linear probing and
+// backward-shift deletion, limited to three quarters of WORKER_NICK_SLOTS.
+static const size_t WORKER_NICK_SLOTS = 1 << 17;  // power of two
+
+class WorkerNicks {
+public:
+    // Once, in the supervisor, on zeroed shared memory.
+    bool init() {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        bool ok = pthread_mutex_init(&mu, &attr) == 0;
+        pthread_mutexattr_destroy(&attr);
+        return ok;
+    }
+
+    // False if another worker holds nick, or the table is full.
+    bool claim(const std::string &nick, uint32_t worker) {
+        Lock lk(mu);
+        size_t i = find(nick);
+        if (slots[i].used) return slots[i].worker == worker;
+        if ((held + 1) * 4 > WORKER_NICK_SLOTS * 3) return false;
+        memset(slots[i].nick, 0, sizeof(slots[i].nick));
+        memcpy(slots[i].nick, nick.data(), std::min(nick.size(), sizeof(slots[i].nick)));
+        slots[i].worker = worker;
+        slots[i].used = 1;
+        held++;
+        return true;
+    }
+
+    // Releases nick if worker holds it.
+    void release(const std::string &nick, uint32_t worker) {
+        Lock lk(mu);
+        size_t i = find(nick);
+        if (slots[i].used && slots[i].worker == worker) remove(i);
+    }
+
+    // The worker holding nick, or -1.
+    int owner(const std::string &nick) {
+        Lock lk(mu);
+        size_t i = find(nick);
+        return slots[i].used ? (int)slots[i].worker : -1;
+    }
+
+    // What a worker that went away left behind, released by its replacement.
+    void release_all(uint32_t worker) {
+        Lock lk(mu);
+        for (size_t i = 0; i < WORKER_NICK_SLOTS;) {
+            if (slots[i].used && slots[i].worker == worker) {
+                remove(i);  // a later entry may have moved into i
+            } else {
+                ++i;
+            }
+        }
+    }
+
+private:
+    struct Slot {
+        char nick[NICK_KEY_BYTES];
+        uint32_t worker;
+        uint32_t used;
+    };
+
+    struct Lock {
+        explicit Lock(pthread_mutex_t &m) : mu(m) {
+            if (pthread_mutex_lock(&mu) == EOWNERDEAD) pthread_mutex_consistent(&mu);
+        }
+        ~Lock() { pthread_mutex_unlock(&mu); }
+        pthread_mutex_t &mu;
+    };
+
+    static size_t home(const char *nick, size_t len) {
+        uint64_t h = 14695981039346656037ULL;  // FNV-1a
+        for (size_t i = 0; i < len && nick[i]; ++i) h = (h ^ (unsigned char)nick[i]) * 1099511628211ULL;
+        return h & (WORKER_NICK_SLOTS - 1);
+    }
+
+    // The slot holding nick, else the free slot its probe ends at.
+    size_t find(const std::string &nick) const {
+        for (size_t i = home(nick.data(), nick.size());; i = (i + 1) & (WORKER_NICK_SLOTS - 1)) {
+            const Slot &s = slots[i];
+            if (!s.used || (strncmp(s.nick, nick.c_str(), sizeof(s.nick)) == 0 && nick.size() <= sizeof(s.nick))) {
+                return i;
+            }
+        }
+    }
+
+    // Empties slot i and moves later entries of its probe run back into the
+    // hole, so no probe ends early.
+    void remove(size_t i) {
+        for (size_t j = (i + 1) & (WORKER_NICK_SLOTS - 1); slots[j].used; j = (j + 1) & (WORKER_NICK_SLOTS - 1)) {
+            size_t h = home(slots[j].nick, sizeof(slots[j].nick));
+            // j stays unless its home is cyclically outside (i, j]
+            if (((j - h) & (WORKER_NICK_SLOTS - 1)) < ((j - i) & (WORKER_NICK_SLOTS - 1))) continue;
+            slots[i] = slots[j];
+            i = j;
+        }
+        slots[i].used = 0;
+        held--;
+    }
+
+    pthread_mutex_t mu;
+    size_t held;
+    Slot slots[WORKER_NICK_SLOTS];
+};
+
+// Nicks that were held when the last snapshot was taken. After a restart
+// they stay in the registry (as RESERVED_NICK_CLIENT) for
+// RESTART_NICK_GRACE_MS, and only a connection from the address that held
+// one can register it meanwhile. Used by the acceptor thread and the main
+// loop. Under -p, claim() and release() also hold the nick in the workers'
+// shared table.
+class NickReservations {
+public:
+    WorkerNicks *workers = nullptr;  // -p
+    uint32_t worker = 0;             // index of this process among them
+
+    void reserve(NickRegistry &nicks, const std::string &nick, const std::string &addr, uint64_t until) {
+        std::lock_guard<std::mutex> lk(mu);
+        if (nicks.insert(nick, MAIN_SHARD, RESERVED_NICK_CLIENT)) held[nick] = addr;
+        expires = until;
+    }
+
+    // Registers nick for client, taking over a reservation for its address.
+    bool claim(NickRegistry &nicks, const std::string &nick, uint64_t client, int fd) {
+        if (!claim_here(nicks, nick, client, fd)) return false;
+        if (workers && !workers->claim(nick, worker)) {
+            nicks.erase(nick, client);
+            return false;
+        }
+        return true;
+    }
+
+    // Releases nick if client holds it.
+    void release(NickRegistry &nicks, const std::string &nick, uint64_t client) {
+        NickRegistry::Handle h;
+        if (!nicks.lookup(nick, h) || h.client != client) return;
+        nicks.erase(nick, client);
+        if (workers) workers->release(nick, worker);
+    }
+
+    void expire(NickRegistry &nicks, uint64_t now) {
+        std::lock_guard<std::mutex> lk(mu);
+        if (held.empty() || now < expires) return;
+        for (auto &h : held) nicks.erase(h.first, RESERVED_NICK_CLIENT);
+        held.clear();
+    }
+
+    // (nick, address) of the reservations not claimed yet.
+    std::vector<std::pair<std::string, std::string>> all() {
+        std::lock_guard<std::mutex> lk(mu);
+        return std::vector<std::pair<std::string, std::string>>(held.begin(), held.end());
+    }
+
+private:
+    bool claim_here(NickRegistry &nicks, const std::string &nick, uint64_t client, int fd) {
+        if (nicks.insert(nick, MAIN_SHARD, client)) return true;
+        std::lock_guard<std::mutex> lk(mu);
+        auto it = held.find(nick);
+        if (it == held.end() || it->second != peer_address(fd)) return false;
+        held.erase(it);
+        nicks.erase(nick, RESERVED_NICK_CLIENT);
+        return nicks.insert(nick, MAIN_SHARD, client);
+    }
+
+    std::mutex mu;
+    std::unordered_map<std::string, std::string> held;  // nick -> address
+    uint64_t expires = 0;
+};
+
+class RoomActors;
+class PeerRings;
+
+struct Room {
+    std::string name;
+    RoomLog log;
+    RoomLog ws_log;                         // the same lines as WebSocket frames, with IDs
+    RoomLog id_log;                         // the same lines with IDs, for IDS clients
+    RoomLog seq_log;                        // "<seq> <line>", for standbys and relays
+    bool websocket = false;                 // fill ws_log (WebSocket listener enabled)
+    bool followers = false;                 // fill seq_log (-A, or relays allowed by -k)
+    Journal journal;
+    SearchIndex search;
+    Compactor compactor;
+    bool read_only = false;                 // relays only carry the upstream's lines
+    size_t max_relays = 0;                  // 0 = no limit
+    std::string relay_secret;               // RELAY must prove it knows it; empty = no relays
+    std::map<uint64_t, std::string> relays; // attached relays by client id
+    std::unique_ptr<NickRegistry> nicks{new NickRegistry};  // shared with the acceptor thread
+    NickReservations reserved_nicks;        // from the snapshot, after a restart
+    RoomActors *actors = nullptr;           // -w: rooms owned by worker threads
+    PeerRings *peers = nullptr;             // -p: lines from and to the other worker processes
+    size_t next_redirect = 0;
+    int mcast_fd = -1;                      // multicast publisher, if enabled
+    struct sockaddr_in mcast_addr{};
+    std::vector<std::pair<uint64_t, std::string>> direct;  // lines for one client id
+    std::map<uint64_t, Transfer> transfers;
+    uint64_t next_transfer = 1;
+    TypingTable typing;
+    ReadReceipts receipts;
+    AckPositions acks;                      // of RELIABLE clients, by nick
+    std::unordered_map<std::string, std::pair<uint64_t, uint64_t>> msg_buckets;  // see keep_msg_bucket
+    ReactionCounters reactions;
+    TrafficStats stats;
+    OverloadController overload;
+    size_t member_count = 0;                // clients and subscribers, as of the last loop pass
+    uint64_t transfer_rate = TRANSFER_DEFAULT_RATE;  // bytes/s per transfer, 0 = no cap
+
+    // Announce the end of a transfer to both chat connections and free it.
+    void end_transfer(std::map<uint64_t, Transfer>::iterator it, const char *how) {
+        std::string line = "ENDED " + std::to_string(it->first) + " " + how + "\n";
+        direct.emplace_back(it->second.from_id, line);
+        direct.emplace_back(it->second.to_id, line);
+        it->second.close_fds();
+        transfers.erase(it);
+    }
+};
+
+// TLS state of one connection from the TLS listener (-T). The handshake is
+// driven from the event loop. Once it completes, OpenSSL hands the record
+// layer to the kernel (kTLS) where the kernel supports it. The socket is
+// then used with plain send/recv/sendmsg/sendfile, as for any other client.
+// Otherwise OpenSSL encrypts in user space, through read() and write().
+struct TlsSession {
+    SSL *ssl;
+    bool handshaking = true;
+    bool want_write = false;   // handshake is waiting for socket space
+    bool ktls_tx = false;
+    bool ktls_rx = false;
+    std::string out;           // plaintext of an SSL_write that must be retried
+
+    explicit TlsSession(SSL *s) : ssl(s) {}
+    ~TlsSession() { SSL_free(ssl); }
+    TlsSession(const TlsSession &) = delete;
+    TlsSession &operator=(const TlsSession &) = delete;
+
+    bool user_tx() const { return !handshaking && !ktls_tx; }
+    bool user_rx() const { return !handshaking && !ktls_rx; }
+
+    // Advance the handshake. Returns false if it failed.
+    bool handshake() {
+        want_write = false;
+        ERR_clear_error();
+        int rc = SSL_do_handshake(ssl);
+        if (rc == 1) {
+            handshaking = false;
+            ktls_tx = BIO_get_ktls_send(SSL_get_wbio(ssl));
+            ktls_rx = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+            return true;
+        }
+        int err = SSL_get_error(ssl, rc);
+        if (err == SSL_ERROR_WANT_READ) return true;
+        if (err == SSL_ERROR_WANT_WRITE) {
+            want_write = true;
+            return true;
+        }
+        return false;
+    }
+
+    // recv()-like: -1 with errno EAGAIN when no whole record is available.
+    ssize_t read(char *buf, size_t len) {
+        ERR_clear_error();
+        int n = SSL_read(ssl, buf, (int)len);
+        if (n > 0) return n;
+        switch (SSL_get_error(ssl, n)) {
+        case SSL_ERROR_ZERO_RETURN: return 0;
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE: errno = EAGAIN; return -1;
+        case SSL_ERROR_SYSCALL: if (errno == 0) return 0; return -1;
+        default: errno = EPROTO; return -1;
+        }
+    }
+
+    // send()-like. OpenSSL insists that a write which hit a full socket is
+    // retried with the same bytes, so those bytes are taken over into out and
+    // reported as written; nothing else is accepted until out has drained.
+    ssize_t write(const char *buf, size_t len) {
+        if (!flush()) return -1;
+        ssize_t n = write_once(buf, len);
+        if (n < 0 && errno == EAGAIN) {
+            out.assign(buf, len);
+            return len;
+        }
+        return n;
+    }
+
+    // Finish a retried write. Returns false with errno set if out is not empty.
+    bool flush() {
+        while (!out.empty()) {
+            ssize_t n = write_once(out.data(), out.size());
+            if (n < 0) return false;
+            out.erase(0, n);
+        }
+        return true;
+    }
+
+private:
+    ssize_t write_once(const char *buf, size_t len) {
+        ERR_clear_error();
+        int n = SSL_write(ssl, buf, (int)std::min<size_t>(len, INT_MAX));
+        if (n > 0) return n;
+        switch (SSL_get_error(ssl, n)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE: errno = EAGAIN; return -1;
+        case SSL_ERROR_SYSCALL: if (errno == 0) errno = EPIPE; return -1;
+        default: errno = EPROTO; return -1;
+        }
+    }
+};
+
+// Server context for the TLS listener. kTLS is requested for every session.
+// No session tickets are sent: they would be the only post-handshake records,
+// and with kTLS receive a client would see them outside OpenSSL.
+SSL_CTX *create_tls_context(const std::string &cert, const std::string &key) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) return nullptr;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_num_tickets(ctx, 0);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert.c_str()) != 1
+        || SSL_CTX_use_PrivateKey_file(ctx, key.c_str(), SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+    return ctx;
+}
+
+class Client {
+public:
+    int fd;
+    uint64_t id;
+    string nick;
+    string inbuf;
+    string outbuf;     // direct replies to this client only
+    uint64_t cursor;   // position in the room log
+    std::deque<FileSpan> history;  // journal ranges still being sent
+    uint64_t backlog_next = 0;     // journal messages [backlog_next, backlog_end)
+    uint64_t backlog_end = 0;      // still to be queued to history
+    uint64_t resend_end = 0;       // reliable: end of the run under the last RESEND
+    bool registered;
+    bool replica_link = false;     // standby server on the replication socket
+    bool relay_link = false;       // downstream relay server
+    bool follower = false;         // standby or relay: reads seq_log
+    bool subscribing = false;      // becomes a Subscriber once its OK is out
+    bool multicast = false;        // gets broadcasts over multicast, not TCP
+    bool ids = false;              // reads id_log (sent IDS)
+    bool reliable = false;         // sent RELIABLE: acks, and is resent what it missed
+    std::shared_ptr<TlsSession> tls;  // set for clients of the TLS listener
+    bool websocket = false;        // client of the WebSocket listener
+    bool ws_open = false;          // HTTP upgrade done, traffic is framed
+    std::string ws_in;             // raw bytes not yet decoded into inbuf
+    std::string ws_msg;            // fragments of an unfinished message
+    uint64_t transfer = 0;         // data connection of this transfer id
+    bool transfer_sender = false;
+    uint64_t typing_seen = 0;      // TypingTable version already sent
+    uint64_t nick_hash = 0;        // for the traffic sketches
+    bool admin = false;            // operator connection on the admin socket
+    uint64_t pending_since = 0;    // when output started waiting, for queue delay
+    uint64_t msg_allowance = 0;    // MSG token bucket under RATE_LIMIT
+    uint64_t msg_refill = 0;
+    std::string room;              // actor room it is in; empty for the lobby
+    bool room_leaving = false;     // LEAVE sent, waiting for the owner's LEFT
+    bool room_closing = false;     // ... because the client disconnected
+
+    // chat members; not followers, subscribers or transfer connections
+    bool gets_ephemeral() const {
+        return registered && !subscribing && !transfer && !replica_link && !relay_link && !admin && room.empty();
+    }
+
+    // whether its cursor holds back trimming of the room log
+    bool reads_log() const { return !transfer && !admin && room.empty(); }
+
+    Client(int f = -1, uint64_t i = 0, uint64_t c = 0)
+        : fd(f), id(i), cursor(c), registered(false) {}
+    void clear() {
+        fd = -1; nick = ""; registered = false; inbuf.clear(); outbuf.clear(); history.clear(); tls.reset();
+        ws_in.clear(); ws_msg.clear(); backlog_next = backlog_end = resend_end = 0;
+    }
+};
+
+// Listen-only consumer (dashboard, archiver, bot) after SUBSCRIBE. These
+// live in their own compact array: their input is drained but never parsed,
+// and they are written from the room log in large batches every
+// SUBSCRIBER_FLUSH_MS instead of after every message.
+static const int SUBSCRIBER_FLUSH_MS = 20;
+static const uint64_t SUBSCRIBER_READER = UINT64_MAX;  // never a sender
+
+struct Subscriber {
+    int fd;
+    uint64_t cursor;
+};
+
+void flush_stdout() { std::fflush(stdout); }
+void flush_stderr() { std::fflush(stderr); }
+
+static bool running = true;
+static int listenfd = -1;
+static volatile sig_atomic_t promote_requested = 0;
+
+void handle_sigint(int) {
+    running = false;
+    if (listenfd >= 0) close(listenfd);
+}
+
+void handle_sigusr1(int) {
+    promote_requested = 1;
+}
+
+// Function to remove trailing newlines from a string
+void chomp(std::string &s) {
+    while (!s.empty() && (s.back() == '\n' || s.back() == '\r')) s.pop_back();
+}
+
+// "MSG <nick> <text>" as sent to clients that asked for IDS and to
+// WebSocket clients: "MSGID <id> <time_ms> <nick> <text>". Other lines are
+// unchanged.
+std::string stamp_line(uint64_t id, uint64_t time_ms, const std::string &line) {
+    if (line.compare(0, 4, "MSG ") != 0) return line;
+    return "MSGID " + std::to_string(id) + " " + std::to_string(time_ms) + " " + line.substr(4);
+}
+
+bool is_valid_nick(const std::string &s) {
+    static const std::regex re("^[A-Za-z0-9_]{1,12}$");
+    return std::regex_match(s, re);
+}
+
+bool split_hostport(const std::string &src, std::string &host, std::string &port) {
+    auto pos = src.rfind(':');
+    if (pos == std::string::npos) return false;
+    host = src.substr(0, pos);
+    port = src.substr(pos + 1);
+    return !host.empty() && !port.empty();
+}
+
+// With reuseport, several processes can bind the same address (-p).
+int create_and_bind(const std::string &host, const std::string &port, bool reuseport = false) {
+    struct addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+    if (rc != 0) {
+        std::cerr << "getaddrinfo: " << gai_strerror(rc) << std::endl;
+        flush_stderr();
+        return -1;
+    }
+
+    int lfd = -1;
+    for (auto a = res; a != nullptr; a = a->ai_next) {
+        lfd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (lfd < 0) continue;
+        int on = 1;
+        setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (reuseport) setsockopt(lfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        if (bind(lfd, a->ai_addr, a->ai_addrlen) == 0) {
+            if (listen(lfd, 16) == 0) {
+                break; // success
+            }
+        }
+        close(lfd);
+        lfd = -1;
+    }
+    freeaddrinfo(res);
+    return lfd;
+}
+
+// Listener for standby servers on a local (AF_UNIX) socket.
+int create_unix_listener(const std::string &path) {
+    struct sockaddr_un sun{};
+    if (path.size() >= sizeof(sun.sun_path)) return -1;
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    unlink(path.c_str());
+    if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 || listen(fd, 4) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void set_nonblocking(int fd) {
+    int fl = fcntl(fd, F_GETFL, 0);
+    if (fl >= 0) fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
+// With nonblocking, the connection may still be in progress: wait for the
+// fd to become writable and check SO_ERROR.
+int connect_tcp(const std::string &host, const std::string &port, bool nonblocking = false) {
+    struct addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) return -1;
+    int fd = -1;
+    for (auto a = res; a != nullptr; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0) continue;
+        if (nonblocking) set_nonblocking(fd);
+        if (connect(fd, a->ai_addr, a->ai_addrlen) == 0 || (nonblocking && errno == EINPROGRESS)) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+int connect_unix(const std::string &path) {
+    struct sockaddr_un sun{};
+    if (path.size() >= sizeof(sun.sun_path)) return -1;
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+ssize_t recv_into(Client &c) {
+    char buf[1024];
+    std::string &dst = c.websocket ? c.ws_in : c.inbuf;
+    if (c.tls && c.tls->user_rx()) {
+        // drain every decrypted record: select() cannot see OpenSSL's buffer
+        ssize_t total = 0, n;
+        while ((n = c.tls->read(buf, sizeof(buf))) > 0) {
+            dst.append(buf, n);
+            total += n;
+        }
+        return total > 0 ? total : n;
+    }
+    ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+    if (n > 0) dst.append(buf, n);
+    return n;
+}
+
+// send() for a client, through OpenSSL for user-space TLS sessions.
+ssize_t send_to(Client &c, const char *buf, size_t len) {
+    if (c.tls && c.tls->user_tx()) return c.tls->write(buf, len);
+    return send(c.fd, buf, len, MSG_NOSIGNAL);
+}
+
+void drop_client(Client &c, const char *why) {
+    std::cerr << "Dropping client " << c.nick << ": " << why << std::endl;
+    close_watched(c.fd);
+    c.fd = -1;
+}
+
+// Turn a new connection away at REFUSE_CONNECTIONS, before any state exists
+// for it. reply may be null (TLS, where nothing readable can be sent yet).
+void refuse_connection(int fd, const char *reply) {
+    if (reply) send(fd, reply, strlen(reply), MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(fd);
+}
+
+// Single-producer single-consumer ring. Neither side blocks or locks: each
+// only advances its own index, published with a release store.
+template <typename T, size_t N>
+class SpscQueue {
+    static_assert((N & (N - 1)) == 0, "N must be a power of two");
+
+public:
+    bool push(T &&v) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N) return false;
+        slots[t & (N - 1)] = std::move(v);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &v) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        v = std::move(slots[h & (N - 1)]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    T slots[N];
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+};
+
+// Registration on the plain port, off the main loop. The acceptor thread
+// accepts, greets and reads lines until NICK succeeds, then hands the
+// connection to the main loop through a SpscQueue and wakes it with an
+// eventfd. A reconnect storm costs the main loop one queue pop per client.
+// Connections that open with SUBSCRIBE, RELAY or XFER are handed over
+// unregistered, with that line still in their input. At most
+// HANDSHAKE_MAX_PENDING connections are between accept() and the main loop;
+// past that the acceptor stops accepting and the rest wait in the kernel's
+// backlog.
+static const uint64_t HANDSHAKE_TIMEOUT_MS = 30 * 1000;
+static const size_t HANDSHAKE_MAX_INPUT = 4096;
+static const size_t HANDSHAKE_MAX_PENDING = 4096;
+static const size_t HANDOFF_QUEUE_SIZE = 1024;
+static const int ACCEPT_BATCH = 64;
+
+struct Handoff {
+    int fd = -1;
+    uint64_t id = 0;
+    std::string nick;   // empty if not registered
+    std::string inbuf;  // input the acceptor did not consume
+};
+
+class Acceptor {
+public:
+    std::atomic<bool> refusing{false};  // mirrors REFUSE_CONNECTIONS
+
+    ~Acceptor() { stop(); }
+
+    bool start(int fd, NickRegistry &registry, NickReservations &reserved) {
+        wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakefd < 0) return false;
+        listenfd = fd;
+        nicks = &registry;
+        reservations = &reserved;
+        set_nonblocking(listenfd);
+        stopping = false;
+        worker = std::thread(&Acceptor::run, this);
+        return true;
+    }
+
+    void stop() {
+        stopping = true;
+        if (worker.joinable()) worker.join();
+        for (auto &p : pending) close(p.first);
+        pending.clear();
+        for (auto &h : blocked) close(h.fd);
+        blocked.clear();
+        Handoff h;
+        while (queue.pop(h)) close(h.fd);
+        if (wakefd >= 0) close(wakefd);
+        wakefd = -1;
+    }
+
+    int wake_fd() const { return wakefd; }
+
+    // Main loop side: next connection ready for it, if any.
+    bool take(Handoff &h) {
+        uint64_t n;
+        while (read(wakefd, &n, sizeof(n)) > 0) {}
+        return queue.pop(h);
+    }
+
+private:
+    struct Pending {
+        uint64_t id;  // client id, so the nick can be registered under it
+        std::string inbuf;
+        uint64_t since;
+    };
+
+    size_t in_flight() const { return pending.size() + blocked.size(); }
+
+    void run() {
+        std::vector<struct pollfd> fds;
+        while (!stopping) {
+            // pending sockets first, so fds[i] is the i-th of them
+            fds.clear();
+            for (auto &p : pending) fds.push_back(pollfd{p.first, POLLIN, 0});
+            bool accepting = in_flight() < HANDSHAKE_MAX_PENDING;
+            if (accepting) fds.push_back(pollfd{listenfd, POLLIN, 0});
+            // the tick notices stop() and retries blocked handoffs
+            if (poll(fds.data(), fds.size(), 100) < 0) {
+                if (errno == EINTR) continue;
+                perror("acceptor poll");
+                break;
+            }
+            uint64_t now = now_ms();
+            while (!blocked.empty() && queue.push(std::move(blocked.front()))) {
+                blocked.erase(blocked.begin());
+                wake();
+            }
+            if (accepting && fds.back().revents) accept_batch(now);
+            for (size_t i = 0; i < fds.size() - accepting; ++i) {
+                if (fds[i].revents) on_readable(fds[i].fd);
+            }
+            for (auto it = pending.begin(); it != pending.end();) {
+                if (now - it->second.since > HANDSHAKE_TIMEOUT_MS) {
+                    close(it->first);
+                    it = pending.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+    }
+
+    void accept_batch(uint64_t now) {
+        for (int i = 0; i < ACCEPT_BATCH && in_flight() < HANDSHAKE_MAX_PENDING; ++i) {
+            int cfd = accept(listenfd, nullptr, nullptr);
+            if (cfd < 0) return;
+            if (refusing) {
+                refuse_connection(cfd, "ERROR: Server busy, try again later\n");
+                continue;
+            }
+            set_nonblocking(cfd);
+            if (!reply(cfd, "HELLO 1.0\n")) {
+                close(cfd);
+                continue;
+            }
+            pending[cfd] = Pending{next_client_id++, std::string(), now};
+        }
+    }
+
+    void on_readable(int fd) {
+        Pending &p = pending[fd];
+        char buf[1024];
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+        if (n <= 0 || p.inbuf.size() + n > HANDSHAKE_MAX_INPUT) {
+            close(fd);
+            pending.erase(fd);
+            return;
+        }
+        p.inbuf.append(buf, n);
+        size_t pos;
+        while ((pos = p.inbuf.find('\n')) != std::string::npos) {
+            std::string line = p.inbuf.substr(0, pos);
+            chomp(line);
+            if (line == "SUBSCRIBE" || line.rfind("RELAY ", 0) == 0 || line.rfind("XFER ", 0) == 0) {
+                hand_off(fd, p.id, std::string(), std::move(p.inbuf));
+                return;
+            }
+            p.inbuf.erase(0, pos + 1);
+            bool ok;
+            if (line.rfind("NICK ", 0) != 0) {
+                ok = reply(fd, "ERROR: NICK command expected\n");
+            } else if (!is_valid_nick(line.substr(5))) {
+                ok = reply(fd, "ERROR: Invalid nickname format\n");
+            } else if (!reservations->claim(*nicks, line.substr(5), p.id, fd)) {
+                ok = reply(fd, "ERROR: Nickname already in use\n");
+            } else {
+                std::string nick = line.substr(5);
+                if (!reply(fd, "OK\n")) {
+                    reservations->release(*nicks, nick, p.id);
+                    ok = false;
+                } else {
+                    std::cout << "Client registered with nickname: " + nick + "\n" << std::flush;
+                    hand_off(fd, p.id, nick, std::move(p.inbuf));
+                    return;
+                }
+            }
+            if (!ok) {
+                close(fd);
+                pending.erase(fd);
+                return;
+            }
+        }
+    }
+
+    void hand_off(int fd, uint64_t id, std::string nick, std::string rest) {
+        pending.erase(fd);
+        Handoff h;
+        h.fd = fd;
+        h.id = id;
+        h.nick = std::move(nick);
+        h.inbuf = std::move(rest);
+        if (!blocked.empty() || !queue.push(std::move(h))) {
+            blocked.push_back(std::move(h));
+            return;
+        }
+        wake();
+    }
+
+    // replies are a few bytes on a fresh socket; a short send means it is gone
+    static bool reply(int fd, const char *line) {
+        size_t len = strlen(line);
+        return send(fd, line, len, MSG_NOSIGNAL) == (ssize_t)len;
+    }
+
+    void wake() {
+        uint64_t one = 1;
+        if (write(wakefd, &one, sizeof(one)) < 0) {}
+    }
+
+    int listenfd = -1;
+    int wakefd = -1;
+    NickRegistry *nicks = nullptr;
+    NickReservations *reservations = nullptr;
+    std::atomic<bool> stopping{false};
+    std::thread worker;
+    std::unordered_map<int, Pending> pending;  // acceptor thread only
+    std::vector<Handoff> blocked;              // queue was full
+    SpscQueue<Handoff, HANDOFF_QUEUE_SIZE> queue;
+};
+
+// Shared-nothing worker processes (-p). The supervisor forks the workers;
+// each binds its own SO_REUSEPORT listeners, so the kernel spreads new
+// connections over them, and owns its clients, heap and room log. All they
+// share is one MAP_SHARED mapping with a broadcast ring per worker: a worker
+// copies every line it broadcasts into its own ring and appends the lines in
+// the other rings to its room log, much as a relay does with its upstream's.
+// A crashed worker only takes its own clients along; the supervisor forks a
+// replacement, which reads the rings from their current heads on. The
+// mapping also holds the WorkerNicks table, so nicks are unique across the
+// workers.
+//
+// A ring is written by its worker's main loop only. Records are a 32-bit
+// length and the line, wrapping around the end of the ring. The writer moves
+// `reserved` before it writes the bytes and `head` after, so a reader that
+// has copied a record checks `reserved` to see whether the writer lapped it
+// meanwhile, as with a seqlock. A lapped reader skips to the head and
+// reports the loss, which its worker passes on to its clients.
+static const size_t PEER_RING_SIZE = 4 * 1024 * 1024;  // power of two
+static const size_t MAX_WORKER_PROCS = 64;
+static const uint64_t WORKER_RESTART_MS = 1000;        // at most one restart per worker per second
+
+struct PeerRing {
+    alignas(64) std::atomic<uint64_t> reserved{0};
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) char data[PEER_RING_SIZE];
+};
+
+class PeerRings {
+public:
+    // Called before forking: the rings and one wakeup eventfd per worker.
+    bool create(size_t n) {
+        void *p = mmap(nullptr, n * sizeof(PeerRing) + sizeof(WorkerNicks), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return false;
+        rings = static_cast<PeerRing *>(p);
+        shared_nicks = reinterpret_cast<WorkerNicks *>(rings + n);
+        if (!shared_nicks->init()) return false;
+        for (size_t i = 0; i < n; ++i) {
+            new (&rings[i]) PeerRing;
+            int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (fd < 0) return false;
+            wakefds.push_back(fd);
+        }
+        count = n;
+        return true;
+    }
+
+    // In a freshly forked worker.
+    void attach(size_t index) {
+        self = index;
+        PeerRing &own = rings[self];
+        own.reserved.store(own.head.load(std::memory_order_relaxed), std::memory_order_relaxed);  // a record the last one left unfinished
+        shared_nicks->release_all(self);
+        cursors.assign(count, 0);
+        for (size_t i = 0; i < count; ++i) cursors[i] = rings[i].head.load(std::memory_order_acquire);
+    }
+
+    bool enabled() const { return rings != nullptr; }
+    size_t index() const { return self; }
+    WorkerNicks *nicks() const { return shared_nicks; }
+    int wake_fd() const { return enabled() ? wakefds[self] : -1; }
+
+    void put(const std::string &line) {
+        PeerRing &r = rings[self];
+        uint64_t at = r.head.load(std::memory_order_relaxed);
+        uint32_t len = line.size();
+        uint64_t end = at + sizeof(len) + len;
+        r.reserved.store(end, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        copy_in(r, at, &len, sizeof(len));
+        copy_in(r, at + sizeof(len), line.data(), len);
+        r.head.store(end, std::memory_order_release);
+        wrote = true;
+    }
+
+    // Once per loop pass: wake the other workers if this one wrote anything.
+    void notify() {
+        if (!wrote) return;
+        wrote = false;
+        uint64_t one = 1;
+        for (size_t i = 0; i < count; ++i) {
+            if (i != self && write(wakefds[i], &one, sizeof(one)) < 0) {}
+        }
+    }
+
+    // Pass every line the other workers wrote since the last call to fn, and
+    // the index of a worker whose ring lapped this reader to lost.
+    template <typename Fn, typename Lost>
+    void drain(Fn fn, Lost lost) {
+        uint64_t n;
+        if (read(wakefds[self], &n, sizeof(n)) < 0) {}
+        std::string line;
+        for (size_t i = 0; i < count; ++i) {
+            if (i == self) continue;
+            PeerRing &r = rings[i];
+            uint64_t &at = cursors[i];
+            uint64_t head = r.head.load(std::memory_order_acquire);
+            while (at < head) {
+                uint32_t len = 0;
+                bool lapped = head - at > PEER_RING_SIZE;
+                if (!lapped) {
+                    copy_out(r, at, &len, sizeof(len));
+                    lapped = len > head - at - sizeof(len);
+                }
+                if (!lapped) {
+                    line.resize(len);
+                    copy_out(r, at + sizeof(len), &line[0], len);
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    lapped = r.reserved.load(std::memory_order_relaxed) - at > PEER_RING_SIZE;
+                }
+                if (lapped) {
+                    std::cerr << "Fell behind worker " << i << ", lines lost" << std::endl;
+                    at = head = r.head.load(std::memory_order_acquire);
+                    lost(i);
+                    break;
+                }
+                at += sizeof(len) + len;
+                fn(line);
+            }
+        }
+    }
+
+private:
+    static void copy_in(PeerRing &r, uint64_t at, const void *src, size_t len) {
+        size_t off = at & (PEER_RING_SIZE - 1);
+        size_t first = std::min(len, PEER_RING_SIZE - off);
+        memcpy(r.data + off, src, first);
+        memcpy(r.data, (const char *)src + first, len - first);
+    }
+
+    static void copy_out(const PeerRing &r, uint64_t at, void *dst, size_t len) {
+        size_t off = at & (PEER_RING_SIZE - 1);
+        size_t first = std::min(len, PEER_RING_SIZE - off);
+        memcpy(dst, r.data + off, first);
+        memcpy((char *)dst + first, r.data, len - first);
+    }
+
+    PeerRing *rings = nullptr;
+    WorkerNicks *shared_nicks = nullptr;
+    size_t count = 0;
+    size_t self = 0;
+    std::vector<int> wakefds;
+    std::vector<uint64_t> cursors;  // per ring, absolute byte position
+    bool wrote = false;
+};
+
+// Fork the -p workers and replace any that exits. Only returns in a worker,
+// with its index; the supervisor itself never leaves this loop. Workers get
+// SIGTERM when the supervisor goes away.
+size_t supervise_workers(PeerRings &rings, size_t n) {
+    std::vector<pid_t> pids(n, -1);
+    std::vector<uint64_t> started(n, 0);
+    for (;;) {
+        for (size_t i = 0; i < n; ++i) {
+            if (pids[i] > 0) continue;
+            uint64_t since = now_ms() - started[i];
+            if (since < WORKER_RESTART_MS) usleep((WORKER_RESTART_MS - since) * 1000);
+            started[i] = now_ms();
+            flush_stdout();
+            pid_t pid = fork();
+            if (pid == 0) {
+                prctl(PR_SET_PDEATHSIG, SIGTERM);
+                if (getppid() == 1) _exit(0);  // the supervisor is gone already
+                rings.attach(i);
+                return i;
+            }
+            if (pid < 0) {
+                perror("fork worker");
+                continue;
+            }
+            pids[i] = pid;
+        }
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            perror("wait");
+            exit(1);
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (pids[i] != pid) continue;
+            pids[i] = -1;
+            if (WIFSIGNALED(status)) {
+                std::cerr << "Worker " << i << " (pid " << pid << ") killed by signal " << WTERMSIG(status)
+                          << ", restarting" << std::endl;
+            } else {
+                std::cerr << "Worker " << i << " (pid " << pid << ") exited with status " << WEXITSTATUS(status)
+                          << ", restarting" << std::endl;
+            }
+        }
+    }
+}
+
+// Rooms as actors (-w workers). Besides the lobby, which stays on the main
+// loop with its journal, relays and the rest, clients can JOIN named rooms.
+// Each room is owned by exactly one RoomWorker thread. The main loop still
+// reads every socket and forwards a member's MSG lines to the owner's
+// mailbox; from JOIN until the owner hands the connection back (LEFT), only
+// the owner writes to it. Sequencing, the recent-lines buffer and fan-out
+// therefore run on one thread per room without locks. Workers report the
+// bytes each room fanned out every second, and the main loop moves a room
+// from the busiest worker to the idlest when their load drifts apart.
+static const size_t ROOM_HISTORY = 50;                 // lines replayed on JOIN
+static const size_t ROOM_MAX_OUTBUF = 1 << 20;         // a member further behind is dropped
+static const size_t ROOM_MAILBOX_SIZE = 1024;
+static const uint64_t ROOM_LOAD_REPORT_MS = 1000;
+static const uint64_t ROOM_REBALANCE_MS = 5000;
+static const uint64_t ROOM_REBALANCE_MIN = 64 * 1024;  // bytes/s on the busiest worker
+static const uint64_t ROOM_ID_BLOCK = 1024;
+
+// The end of the IDs each room has reserved, shared by the workers and read
+// by the state snapshot. A room reserves ROOM_ID_BLOCK IDs at a time, so the
+// lock is taken once per block, and a snapshot records an end no used ID
+// has reached. A restarted server continues each room from there: it may
+// skip the rest of a block, but never repeats an ID.
+class RoomIds {
+public:
+    // The end of the block a room at next hands out from.
+    uint64_t reserve(const std::string &room, uint64_t next) {
+        std::lock_guard<std::mutex> lk(mu);
+        uint64_t &end = ends[room];
+        if (end <= next) end = next + ROOM_ID_BLOCK;
+        return end;
+    }
+
+    // Where a room this process has no counter for starts.
+    uint64_t first(const std::string &room) {
+        std::lock_guard<std::mutex> lk(mu);
+        auto it = ends.find(room);
+        return it == ends.end() ? 1 : it->second;
+    }
+
+    std::unordered_map<std::string, uint64_t> all() {
+        std::lock_guard<std::mutex> lk(mu);
+        return ends;
+    }
+
+    void restore(const std::string &room, uint64_t end) {
+        std::lock_guard<std::mutex> lk(mu);
+        ends[room] = std::max(ends[room], end);
+    }
+
+private:
+    std::mutex mu;
+    std::unordered_map<std::string, uint64_t> ends;
+};
+
+struct ActorMember {
+    int fd;
+    std::string nick;
+    std::string out;
+    bool ids;  // gets MSGID lines
+};
+
+// The room's sequencer is next_seq, touched only by the owning worker; it
+// moves with the room, so IDs keep increasing across rebalancing. When the
+// last member leaves, the worker keeps only next_seq (see idle_seqs), so the
+// IDs of a room never repeat while the process runs; RoomIds carries them
+// across restarts.
+struct ActorRoom {
+    std::string name;
+    uint64_t next_seq = 1;
+    uint64_t id_end = 0;  // reserved up to here (RoomIds)
+    std::deque<std::pair<std::string, std::string>> recent;  // plain and stamped
+    std::map<uint64_t, ActorMember> members;  // by client id
+    uint64_t cost = 0;                         // bytes queued since the last LOAD
+};
+
+struct RoomMail {
+    enum Kind {
+        JOIN,      // main -> owner: fd and nick; text is output still owed to the client
+        LINE,      // main -> owner: MSG text from client
+        REPLY,     // main -> owner: a raw line for client
+        LEAVE,     // main -> owner: hand client back (closing: it disconnected)
+        MIGRATE,   // main -> owner: pass the room on to worker `to`
+        ADOPT,     // main -> new owner: the room's state
+        LEFT,      // owner -> main: client is back; text is its unsent output
+        DROPPED,   // owner -> main: client fell behind or its socket failed
+        MIGRATED,  // owner -> main: the room's state, for worker `to`
+        LOAD,      // owner -> main: bytes room fanned out since the last LOAD
+    };
+    Kind kind = LINE;
+    std::string room;
+    uint64_t client = 0;
+    int fd = -1;
+    std::string nick;
+    std::string text;
+    bool closing = false;
+    bool ids = false;
+    size_t to = 0;
+    uint64_t cost = 0;
+    std::unique_ptr<ActorRoom> state;
+};
+
+// One direction between the main loop and a worker. post() never blocks:
+// mail that does not fit waits in the producer's overflow until retry().
+struct Mailbox {
+    int wakefd = -1;  // consumer's eventfd
+
+    void post(RoomMail &&m) {
+        if (!overflow.empty() || !queue.push(std::move(m))) {
+            overflow.push_back(std::move(m));
+            return;
+        }
+        wake();
+    }
+
+    void retry() {
+        while (!overflow.empty() && queue.push(std::move(overflow.front()))) {
+            overflow.pop_front();
+            wake();
+        }
+    }
+
+    bool take(RoomMail &m) { return queue.pop(m); }
+
+private:
+    void wake() {
+        uint64_t one = 1;
+        if (write(wakefd, &one, sizeof(one)) < 0) {}
+    }
+
+    SpscQueue<RoomMail, ROOM_MAILBOX_SIZE> queue;
+    std::deque<RoomMail> overflow;  // producer only
+};
+
+class RoomWorker {
+public:
+    Mailbox inbox;   // from the main loop
+    Mailbox outbox;  // to the main loop
+
+    ~RoomWorker() { stop(); }
+
+    bool start(int main_wakefd, RoomIds &shared_ids) {
+        ids = &shared_ids;
+        inbox.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        outbox.wakefd = main_wakefd;
+        if (inbox.wakefd < 0) return false;
+        stopping = false;
+        worker = std::thread(&RoomWorker::run, this);
+        return true;
+    }
+
+    // Member sockets are left open; the main loop owns and closes them.
+    void stop() {
+        stopping = true;
+        if (worker.joinable()) worker.join();
+        if (inbox.wakefd >= 0) close(inbox.wakefd);
+        inbox.wakefd = -1;
+    }
+
+private:
+    void run() {
+        uint64_t last_report = now_ms();
+        std::vector<struct pollfd> fds;
+        while (!stopping) {
+            outbox.retry();
+            fds.clear();
+            fds.push_back(pollfd{inbox.wakefd, POLLIN, 0});
+            for (auto &r : rooms) {
+                for (auto &m : r.second->members) {
+                    if (!m.second.out.empty()) fds.push_back(pollfd{m.second.fd, POLLOUT, 0});
+                }
+            }
+            if (poll(fds.data(), fds.size(), 100) < 0) {
+                if (errno == EINTR) continue;
+                perror("room worker poll");
+                break;
+            }
+            uint64_t n;
+            while (read(inbox.wakefd, &n, sizeof(n)) > 0) {}
+            RoomMail m;
+            while (inbox.take(m)) handle(m);
+            for (auto it = rooms.begin(); it != rooms.end();) {
+                flush_room(*it->second);
+                if (it->second->members.empty()) {
+                    idle_seqs[it->first] = it->second->next_seq;
+                    it = rooms.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            if (now_ms() - last_report >= ROOM_LOAD_REPORT_MS) {
+                last_report = now_ms();
+                for (auto &r : rooms) {
+                    RoomMail load;
+                    load.kind = RoomMail::LOAD;
+                    load.room = r.first;
+                    load.cost = r.second->cost;
+                    outbox.post(std::move(load));
+                    r.second->cost = 0;
+                }
+            }
+        }
+    }
+
+    // A room without members, continuing the IDs it had if it was here
+    // before, or else after the ones reserved before a restart.
+    std::unique_ptr<ActorRoom> empty_room(const std::string &name) {
+        std::unique_ptr<ActorRoom> room(new ActorRoom);
+        room->name = name;
+        auto idle = idle_seqs.find(name);
+        if (idle != idle_seqs.end()) {
+            room->next_seq = idle->second;
+            idle_seqs.erase(idle);
+        } else {
+            room->next_seq = ids->first(name);
+        }
+        return room;
+    }
+
+    void handle(RoomMail &m) {
+        if (m.kind == RoomMail::ADOPT) {
+            rooms[m.room] = std::move(m.state);
+            return;
+        }
+        auto found = rooms.find(m.room);
+        if (m.kind == RoomMail::MIGRATE) {
+            // a room emptied by drops is gone already; pass on its counter
+            RoomMail moved;
+            moved.kind = RoomMail::MIGRATED;
+            moved.room = m.room;
+            moved.to = m.to;
+            moved.state = found != rooms.end() ? std::move(found->second) : empty_room(m.room);
+            if (found != rooms.end()) rooms.erase(found);
+            outbox.post(std::move(moved));
+            return;
+        }
+        if (m.kind == RoomMail::JOIN) {
+            if (found == rooms.end()) found = rooms.emplace(m.room, empty_room(m.room)).first;
+            ActorRoom &room = *found->second;
+            ActorMember &member = room.members[m.client] = ActorMember{m.fd, m.nick, std::move(m.text), m.ids};
+            member.out += "JOINED " + m.room + " " + std::to_string(room.members.size()) + "\n";
+            for (auto &line : room.recent) member.out += member.ids ? line.second : line.first;
+            return;
+        }
+        if (found == rooms.end()) return;  // the member was dropped meanwhile
+        ActorRoom &room = *found->second;
+        auto member = room.members.find(m.client);
+        switch (m.kind) {
+        case RoomMail::LINE: {
+            if (member == room.members.end()) return;
+            std::string line = "MSG " + member->second.nick + " " + m.text + "\n";
+            if (room.next_seq >= room.id_end) room.id_end = ids->reserve(room.name, room.next_seq);
+            std::string stamped = stamp_line(room.next_seq++, now_ms(), line);
+            room.recent.emplace_back(line, stamped);
+            if (room.recent.size() > ROOM_HISTORY) room.recent.pop_front();
+            for (auto &to : room.members) {
+                if (to.first == m.client && !to.second.ids) continue;
+                to.second.out += to.second.ids ? stamped : line;
+                room.cost += line.size();
+            }
+            break;
+        }
+        case RoomMail::REPLY:
+            if (member != room.members.end()) member->second.out += m.text;
+            break;
+        case RoomMail::LEAVE: {
+            if (member == room.members.end()) return;
+            RoomMail left;
+            left.kind = RoomMail::LEFT;
+            left.room = m.room;
+            left.client = m.client;
+            left.closing = m.closing;
+            left.text = std::move(member->second.out);
+            room.members.erase(member);
+            outbox.post(std::move(left));
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    void flush_room(ActorRoom &room) {
+        for (auto it = room.members.begin(); it != room.members.end();) {
+            ActorMember &m = it->second;
+            ssize_t n = m.out.empty() ? 0 : send(m.fd, m.out.data(), m.out.size(), MSG_NOSIGNAL);
+            if (n > 0) m.out.erase(0, n);
+            bool failed = n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+            if (failed || m.out.size() > ROOM_MAX_OUTBUF) {
+                RoomMail dropped;
+                dropped.kind = RoomMail::DROPPED;
+                dropped.room = room.name;
+                dropped.client = it->first;
+                outbox.post(std::move(dropped));
+                it = room.members.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    std::atomic<bool> stopping{false};
+    std::thread worker;
+    std::map<std::string, std::unique_ptr<ActorRoom>> rooms;  // worker thread only
+    std::unordered_map<std::string, uint64_t> idle_seqs;      // emptied rooms' next_seq
+    RoomIds *ids = nullptr;
+};
+
+bool is_valid_room(const std::string &s) {
+    if (s.empty() || s.size() > 32) return false;
+    for (char c : s) {
+        if (!isalnum((unsigned char)c) && c != '_' && c != '-') return false;
+    }
+    return true;
+}
+
+// Main-loop side: which worker owns each room, and the mail to and from them.
+class RoomActors {
+public:
+    RoomIds ids;  // shared with the workers
+
+    ~RoomActors() { stop(); }
+
+    bool start(size_t count) {
+        wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakefd < 0) return false;
+        for (size_t i = 0; i < count; ++i) {
+            workers.emplace_back(new RoomWorker);
+            if (!workers.back()->start(wakefd, ids)) return false;
+            loads.push_back(0);
+            rooms_on.push_back(0);
+        }
+        return true;
+    }
+
+    void stop() {
+        workers.clear();
+        if (wakefd >= 0) close(wakefd);
+        wakefd = -1;
+    }
+
+    int wake_fd() const { return wakefd; }
+    // Rooms with members; routes of emptied rooms are kept, so a room comes
+    // back to the worker that has its counter.
+    size_t room_count() const {
+        size_t n = 0;
+        for (auto &r : routes) n += r.second.members > 0;
+        return n;
+    }
+
+    // The client's connection goes to the room's owner until it is handed back.
+    void join(Client &client, const std::string &name) {
+        auto it = routes.find(name);
+        if (it == routes.end()) {
+            count_loads();
+            size_t idlest = 0;  // least load, then fewest rooms
+            for (size_t i = 1; i < workers.size(); ++i) {
+                if (std::make_pair(loads[i], rooms_on[i]) < std::make_pair(loads[idlest], rooms_on[idlest])) idlest = i;
+            }
+            it = routes.emplace(name, Route()).first;
+            it->second.owner = idlest;
+        }
+        it->second.members++;
+        RoomMail m;
+        m.kind = RoomMail::JOIN;
+        m.room = name;
+        m.client = client.id;
+        m.fd = client.fd;
+        m.nick = client.nick;
+        m.ids = client.ids;
+        m.text = std::move(client.outbuf);
+        client.outbuf.clear();
+        client.room = name;
+        post(std::move(m));
+    }
+
+    void line(Client &client, const std::string &text) { mail(client, RoomMail::LINE, text); }
+    void reply(Client &client, const std::string &line) { mail(client, RoomMail::REPLY, line); }
+
+    void leave(Client &client, bool closing) {
+        if (client.room_leaving) return;
+        client.room_leaving = true;
+        client.room_closing = closing;
+        RoomMail m;
+        m.kind = RoomMail::LEAVE;
+        m.room = client.room;
+        m.client = client.id;
+        m.closing = closing;
+        auto it = routes.find(client.room);
+        post(std::move(m));
+        if (it != routes.end() && --it->second.members == 0) it->second.cost = 0;
+    }
+
+    // Retries mail that did not fit a worker's inbox; once per loop pass.
+    void retry() {
+        for (auto &w : workers) w->inbox.retry();
+    }
+
+    // Applies mail from the workers.
+    void drain(std::vector<Client> &clients, Room &lobby);
+
+    // Moves one room from the busiest worker to the idlest if it evens them out.
+    void rebalance(uint64_t now) {
+        if (workers.size() < 2 || now - last_rebalance < ROOM_REBALANCE_MS) return;
+        last_rebalance = now;
+        count_loads();
+        size_t busy = std::max_element(loads.begin(), loads.end()) - loads.begin();
+        size_t idle = std::min_element(loads.begin(), loads.end()) - loads.begin();
+        uint64_t gap = loads[busy] - loads[idle];
+        if (loads[busy] < ROOM_REBALANCE_MIN || gap < loads[busy] / 4) return;
+        // the largest room that still leaves the busy worker at least as loaded
+        auto pick = routes.end();
+        for (auto it = routes.begin(); it != routes.end(); ++it) {
+            Route &r = it->second;
+            if (r.owner != busy || r.migrating || r.cost == 0 || r.cost > gap / 2) continue;
+            if (pick == routes.end() || r.cost > pick->second.cost) pick = it;
+        }
+        if (pick == routes.end()) return;
+        std::cout << "Moving room " << pick->first << " (" << pick->second.cost << " B/s) from worker "
+                  << busy << " to worker " << idle << std::endl;
+        RoomMail m;
+        m.kind = RoomMail::MIGRATE;
+        m.room = pick->first;
+        m.to = idle;
+        workers[busy]->inbox.post(std::move(m));
+        pick->second.migrating = true;
+    }
+
+private:
+    struct Route {
+        size_t owner = 0;
+        size_t members = 0;
+        bool migrating = false;          // between MIGRATE and MIGRATED
+        std::vector<RoomMail> held;      // mail for the room while it moves
+        uint64_t cost = 0;               // bytes/s, from the last LOAD
+    };
+
+    void count_loads() {
+        std::fill(loads.begin(), loads.end(), 0);
+        std::fill(rooms_on.begin(), rooms_on.end(), 0);
+        for (auto &r : routes) {
+            loads[r.second.owner] += r.second.cost;
+            rooms_on[r.second.owner] += r.second.members > 0;
+        }
+    }
+
+    void mail(Client &client, RoomMail::Kind kind, const std::string &text) {
+        RoomMail m;
+        m.kind = kind;
+        m.room = client.room;
+        m.client = client.id;
+        m.text = text;
+        post(std::move(m));
+    }
+
+    void post(RoomMail &&m) {
+        auto it = routes.find(m.room);
+        if (it == routes.end()) return;
+        if (it->second.migrating) {
+            it->second.held.push_back(std::move(m));
+        } else {
+            workers[it->second.owner]->inbox.post(std::move(m));
+        }
+    }
+
+    int wakefd = -1;
+    std::vector<std::unique_ptr<RoomWorker>> workers;
+    std::vector<uint64_t> loads;  // bytes/s per worker, summed from the routes
+    std::vector<size_t> rooms_on;
+    std::map<std::string, Route> routes;
+    uint64_t last_rebalance = 0;
+};
+
+// WebSocket gateway (RFC 6455). Browsers speak the line protocol through
+// text frames: a frame from the client holds one or more commands, and every
+// frame from the server holds one or more whole lines. Broadcasts are framed
+// once into the room's ws_log, so WebSocket members share pre-framed bytes
+// the way TCP members share the plain log.
+static const size_t WS_MAX_MESSAGE = 64 * 1024;
+static const size_t WS_MAX_REQUEST = 8 * 1024;
+enum { WS_CONT = 0x0, WS_TEXT = 0x1, WS_BINARY = 0x2, WS_CLOSE = 0x8, WS_PING = 0x9, WS_PONG = 0xA };
+
+std::string ws_frame(int opcode, const std::string &payload) {
+    std::string f;
+    f.reserve(payload.size() + 10);
+    f += (char)(0x80 | opcode);
+    size_t n = payload.size();
+    if (n < 126) {
+        f += (char)n;
+    } else if (n <= 0xffff) {
+        f += (char)126;
+        f += (char)(n >> 8);
+        f += (char)n;
+    } else {
+        f += (char)127;
+        for (int shift = 56; shift >= 0; shift -= 8) f += (char)(n >> shift);
+    }
+    return f + payload;
+}
+
+// XOR a client payload with its 4-byte mask, 16 bytes per step with SSE2
+// (8 without). Every step is a multiple of 4 bytes, so the mask stays
+// aligned with the data all the way to the byte-wise tail.
+void ws_unmask(char *p, size_t n, const unsigned char mask[4]) {
+    size_t i = 0;
+    uint32_t m32;
+    memcpy(&m32, mask, 4);
+#ifdef __SSE2__
+    __m128i m128 = _mm_set1_epi32((int)m32);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        _mm_storeu_si128((__m128i *)(p + i), _mm_xor_si128(v, m128));
+    }
+#endif
+    uint64_t m64 = ((uint64_t)m32 << 32) | m32;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, 8);
+        v ^= m64;
+        memcpy(p + i, &v, 8);
+    }
+    for (; i < n; ++i) p[i] ^= mask[i & 3];
+}
+
+std::string http_header(const std::string &request, const char *name) {
+    size_t len = strlen(name);
+    for (size_t pos = request.find("\r\n"); pos != std::string::npos; pos = request.find("\r\n", pos + 2)) {
+        size_t line = pos + 2;
+        if (request.size() < line + len + 1 || strncasecmp(request.c_str() + line, name, len) != 0
+            || request[line + len] != ':') continue;
+        size_t v = request.find_first_not_of(" \t", line + len + 1);
+        size_t e = request.find("\r\n", line);
+        if (v == std::string::npos || v >= e) return "";
+        return request.substr(v, e - v);
+    }
+    return "";
+}
+
+// Answer the HTTP upgrade request once it is complete. Returns false for a
+// request that is not a WebSocket handshake.
+bool ws_upgrade(Client &c) {
+    size_t end = c.ws_in.find("\r\n\r\n");
+    if (end == std::string::npos) return c.ws_in.size() <= WS_MAX_REQUEST;
+    std::string request = c.ws_in.substr(0, end + 2);
+    c.ws_in.erase(0, end + 4);
+
+    std::string key = http_header(request, "Sec-WebSocket-Key");
+    std::string upgrade = http_header(request, "Upgrade");
+    if (request.compare(0, 4, "GET ") != 0 || key.empty() || strcasecmp(upgrade.c_str(), "websocket") != 0) {
+        static const char bad[] = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+        send(c.fd, bad, sizeof(bad) - 1, MSG_NOSIGNAL);
+        return false;
+    }
+    std::string accept_src = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1((const unsigned char *)accept_src.data(), accept_src.size(), digest);
+    unsigned char accept[32];
+    EVP_EncodeBlock(accept, digest, SHA_DIGEST_LENGTH);
+
+    c.outbuf += "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                "Sec-WebSocket-Accept: " + std::string((char *)accept) + "\r\n\r\n";
+    c.ws_open = true;
+    c.outbuf += ws_frame(WS_TEXT, "HELLO 1.0\n");
+    return true;
+}
+
+// Decode the frames in ws_in: message payloads become command lines in
+// inbuf, pings are answered. Returns false (with why) to drop the client.
+bool ws_receive(Client &c, const char *&why) {
+    if (!c.ws_open && !ws_upgrade(c)) {
+        why = "bad WebSocket handshake";
+        return false;
+    }
+    if (!c.ws_open) return true;
+
+    size_t pos = 0;
+    while (c.ws_in.size() - pos >= 2) {
+        const unsigned char *h = (const unsigned char *)c.ws_in.data() + pos;
+        size_t avail = c.ws_in.size() - pos;
+        bool fin = h[0] & 0x80;
+        int opcode = h[0] & 0x0f;
+        uint64_t len = h[1] & 0x7f;
+        size_t hdr = 2;
+        if (!(h[1] & 0x80)) {
+            why = "unmasked WebSocket frame";
+            return false;
+        }
+        if (len == 126) {
+            if (avail < 4) break;
+            len = ((uint64_t)h[2] << 8) | h[3];
+            hdr = 4;
+        } else if (len == 127) {
+            if (avail < 10) break;
+            len = 0;
+            for (int i = 2; i < 10; ++i) len = (len << 8) | h[i];
+            hdr = 10;
+        }
+        if (len > WS_MAX_MESSAGE || c.ws_msg.size() + len > WS_MAX_MESSAGE) {
+            why = "WebSocket message too large";
+            return false;
+        }
+        if (avail < hdr + 4 + len) break;
+        unsigned char mask[4];
+        memcpy(mask, h + hdr, 4);
+        char *payload = &c.ws_in[pos + hdr + 4];
+        ws_unmask(payload, len, mask);
+        pos += hdr + 4 + len;
+
+        switch (opcode) {
+        case WS_TEXT:
+        case WS_BINARY:
+            c.ws_msg.assign(payload, len);
+            break;
+        case WS_CONT:
+            c.ws_msg.append(payload, len);
+            break;
+        case WS_PING:
+            c.outbuf += ws_frame(WS_PONG, std::string(payload, len));
+            continue;
+        case WS_PONG:
+            continue;
+        case WS_CLOSE: {
+            std::string reply = ws_frame(WS_CLOSE, std::string(payload, std::min<uint64_t>(len, 2)));
+            send(c.fd, reply.data(), reply.size(), MSG_NOSIGNAL);
+            why = "WebSocket closed";
+            return false;
+        }
+        default:
+            why = "bad WebSocket opcode";
+            return false;
+        }
+        if (!fin) continue;
+        c.inbuf += c.ws_msg;
+        if (c.ws_msg.empty() || c.ws_msg.back() != '\n') c.inbuf += '\n';
+        c.ws_msg.clear();
+    }
+    c.ws_in.erase(0, pos);
+    return true;
+}
+
+void send_response(Client &client, const std::string &message) {
+    if (client.ws_open) {
+        client.outbuf += ws_frame(WS_TEXT, message);
+    } else {
+        client.outbuf += message;
+    }
+}
+
+// The room log a client reads broadcasts from.
+RoomLog &log_for(Room &room, const Client &c) {
+    return c.follower ? room.seq_log : c.websocket ? room.ws_log : c.ids ? room.id_log : room.log;
+}
+
+bool has_pending(const Client &c, Room &room) {
+    const RoomLog &log = log_for(room, c);
+    if (!c.room.empty()) return false;  // written by the room's worker
+    if (c.tls && c.tls->handshaking) return c.tls->want_write;
+    if (c.transfer || c.admin) return !c.outbuf.empty();
+    if (c.tls && !c.tls->out.empty()) return true;
+    return !c.outbuf.empty() || !c.history.empty() || c.backlog_next < c.backlog_end
+        || (!c.multicast && c.cursor < log.head())
+        || (c.gets_ephemeral() && c.typing_seen < room.typing.version());
+}
+
+// Send at most one quantum of the client's pending history straight from the
+// journal segment files, so a large request cannot starve other clients; of
+// compacted segments, at most one block is inflated per call. Returns true
+// once nothing is left.
+bool flush_history(Client &c) {
+    size_t budget = HISTORY_SEND_QUANTUM;
+    bool inflated = false;
+    while (c.fd >= 0 && !c.history.empty() && budget > 0) {
+        if (c.history.front().cold) {
+            if (inflated) break;
+            if (!inflate_front(c.history)) {
+                drop_client(c, "cannot read compacted journal segment");
+                return false;
+            }
+            inflated = true;
+        }
+        FileSpan &sp = c.history.front();
+        size_t want = std::min<uint64_t>(sp.len, budget);
+        ssize_t n;
+        if (sp.data) {
+            n = send_to(c, sp.data->data() + sp.off, want);
+        } else if (c.tls && c.tls->user_tx()) {
+            // no zero-copy without kTLS: read the span and encrypt it
+            char buf[16384];
+            n = pread(sp.file->fd, buf, std::min(want, sizeof(buf)), sp.off);
+            if (n > 0) n = send_to(c, buf, n);
+        } else {
+            off_t off = sp.off;
+            n = sendfile(c.fd, sp.file->fd, &off, want);
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+            if (errno == EINTR) continue;
+            drop_client(c, strerror(errno));
+            return false;
+        }
+        if (n == 0) {
+            drop_client(c, "journal segment shorter than indexed");
+            return false;
+        }
+        sp.off += n;
+        sp.len -= n;
+        budget -= n;
+        if (sp.len == 0) c.history.pop_front();
+    }
+    return c.history.empty();
+}
+
+// Resolve the next HISTORY_MAX_LIMIT messages of a backlog into spans, so a
+// long catch-up is read from the journal as it drains instead of all at
+// once. A follower gets each chunk under "BACKLOG <first> <count>\n", which
+// gives the lines their sequence numbers, as live ones carry theirs. A
+// reliable client gets one "RESEND <first> <count>\n" per run of consecutive
+// messages (a relay's journal can have gaps) and plain lines under it.
+// Returns false if retention has deleted messages the client was promised.
+bool queue_backlog(Client &c, Room &room) {
+    if (c.backlog_next >= c.backlog_end) return true;
+    auto header = [&c](const std::string &text) {
+        auto line = std::make_shared<std::string>(text);
+        c.history.push_back(FileSpan{nullptr, 0, line->size(), line, nullptr});
+    };
+    if (!c.follower && c.backlog_next >= c.resend_end) {
+        uint64_t first;
+        uint64_t end = std::min(room.journal.run(c.backlog_next, first), c.backlog_end);
+        if (first >= c.backlog_end) {
+            if (!c.resend_end) header("RESEND " + std::to_string(c.backlog_end) + " 0\n");
+            c.backlog_next = c.backlog_end;
+            return true;
+        }
+        header("RESEND " + std::to_string(first) + " " + std::to_string(end - first) + "\n");
+        c.backlog_next = first;
+        c.resend_end = end;
+    }
+    uint64_t stop = c.follower ? c.backlog_end : c.resend_end;
+    uint32_t limit = std::min<uint64_t>(stop - c.backlog_next, HISTORY_MAX_LIMIT);
+    std::vector<FileSpan> spans;
+    uint32_t count = 0;
+    uint64_t first = room.journal.range(c.backlog_next + limit, limit, spans, count);
+    if (count == 0 || first < c.backlog_next || (!c.follower && first != c.backlog_next)) return false;
+    if (c.follower) header("BACKLOG " + std::to_string(first) + " " + std::to_string(count) + "\n");
+    c.history.insert(c.history.end(), spans.begin(), spans.end());
+    c.backlog_next = first + count;
+    return true;
+}
+
+// Write the log from cursor to head to fd, skipping lines that came from
+// reader. Returns false if the connection failed (errno is kept); stops
+// early without error when the socket is full.
+bool flush_log(int fd, uint64_t &cursor, uint64_t reader, const RoomLog &log, TlsSession *tls = nullptr) {
+    while (cursor < log.head()) {
+        struct iovec iov[LOG_MAX_IOV];
+        uint64_t iov_end[LOG_MAX_IOV];
+        uint64_t scan_end;
+        int cnt = log.gather(cursor, reader, iov, iov_end, LOG_MAX_IOV, scan_end);
+        if (cnt == 0) {
+            cursor = scan_end;
+            break;
+        }
+        ssize_t n;
+        if (tls && tls->user_tx()) {
+            std::string batch;
+            for (int i = 0; i < cnt; ++i) batch.append((const char *)iov[i].iov_base, iov[i].iov_len);
+            n = tls->write(batch.data(), batch.size());
+        } else {
+            struct msghdr mh{};
+            mh.msg_iov = iov;
+            mh.msg_iovlen = cnt;
+            n = sendmsg(fd, &mh, MSG_NOSIGNAL);
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            if (errno == EINTR) continue;
+            return false;
+        }
+        int i = 0;
+        for (; i < cnt && (size_t)n >= iov[i].iov_len; ++i) n -= iov[i].iov_len;
+        if (i == cnt) {
+            cursor = scan_end;
+        } else {
+            cursor = iov_end[i] - iov[i].iov_len + n;
+            return true;
+        }
+    }
+    return true;
+}
+
+// Journal spans cannot be sendfile()d to a WebSocket client; read about one
+// HISTORY_SEND_QUANTUM of them into a text frame per call, cut at a line end,
+// so a large reply is paced like flush_history(). Returns false if the
+// journal cannot be read.
+bool frame_history(Client &c) {
+    std::string text;
+    while (!c.history.empty() && text.size() < HISTORY_SEND_QUANTUM) {
+        if (c.history.front().cold && !inflate_front(c.history)) return false;
+        FileSpan &sp = c.history.front();
+        size_t n = std::min<uint64_t>(sp.len, HISTORY_SEND_QUANTUM - text.size());
+        size_t at = text.size();
+        if (sp.data) {
+            text.append(sp.data->data() + sp.off, n);
+        } else {
+            text.resize(at + n);
+            if (pread(sp.file->fd, &text[at], n, sp.off) != (ssize_t)n) return false;
+        }
+        sp.off += n;
+        sp.len -= n;
+        if (sp.len == 0) c.history.pop_front();
+    }
+    // the rest of a cut line starts the next frame
+    size_t end = text.rfind('\n') + 1;
+    if (end > 0 && end < text.size()) {
+        auto rest = std::make_shared<std::string>(text, end);
+        c.history.push_front(FileSpan{nullptr, 0, rest->size(), rest, nullptr});
+        text.resize(end);
+    }
+    c.outbuf += ws_frame(WS_TEXT, text);
+    return true;
+}
+
+// Returns false if the client's direct replies could not all be written.
+bool flush_outbuf(Client &c) {
+    while (c.fd >= 0 && !c.outbuf.empty()) {
+        ssize_t n = send_to(c, c.outbuf.data(), c.outbuf.size());
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+            if (errno == EINTR) continue;
+            drop_client(c, strerror(errno));
+            return false;
+        }
+        c.outbuf.erase(0, n);
+    }
+    return c.fd >= 0;
+}
+
+// Write the client's direct replies, then everything between its cursor and
+// the log head, in as few syscalls as the socket accepts. Typing states go
+// last, and only to a client that has caught up.
+void flush_client(Client &c, Room &room) {
+    const RoomLog &log = log_for(room, c);
+    if (c.tls && c.tls->handshaking) {
+        if (!c.tls->handshake()) drop_client(c, "TLS handshake failed");
+        return;
+    }
+    if (c.websocket && !c.history.empty() && c.outbuf.empty() && !frame_history(c)) {
+        drop_client(c, "journal segment shorter than indexed");
+        return;
+    }
+    if (c.tls && !c.tls->flush()) {
+        if (errno != EAGAIN) drop_client(c, strerror(errno));
+        return;
+    }
+    if (!flush_outbuf(c)) return;
+    if (c.transfer || c.admin || (c.websocket && !c.history.empty())) return;
+    if (c.history.empty() && !queue_backlog(c, room)) {
+        drop_client(c, "journal backlog was deleted");
+        return;
+    }
+    if (c.websocket && !c.history.empty()) {
+        // a RESEND chunk is framed like a HISTORY reply
+        if (!frame_history(c)) {
+            drop_client(c, "journal segment shorter than indexed");
+            return;
+        }
+        flush_outbuf(c);
+        return;
+    }
+    if (!flush_history(c)) return;
+    if (c.backlog_next < c.backlog_end) return;  // live lines wait for the backlog
+    if (c.multicast) {
+        c.cursor = log.head();
+    } else if (c.fd >= 0 && log.head() - c.cursor > LOG_MAX_LAG) {
+        drop_client(c, "too far behind room log");
+        return;
+    } else if (c.fd >= 0 && !flush_log(c.fd, c.cursor, c.id, log, c.tls.get())) {
+        drop_client(c, strerror(errno));
+        return;
+    }
+    if (c.fd >= 0 && c.cursor == log.head() && c.gets_ephemeral() && c.typing_seen < room.typing.version()) {
+        std::string lines = room.typing.collect(c.id, c.typing_seen);
+        if (!lines.empty()) {
+            send_response(c, lines);
+            flush_outbuf(c);
+        }
+    }
+}
+
+// HISTORY <before> <limit>: replies "HISTORY <first> <count>\n" followed by
+// the count journaled lines with sequence numbers first..first+count-1.
+void handle_history(Client &client, Room &room, const std::string &args) {
+    unsigned long long before = 0;
+    unsigned limit = 0;
+    if (sscanf(args.c_str(), "%llu %u", &before, &limit) != 2 || limit == 0) {
+        send_response(client, "ERROR: Usage HISTORY <before> <limit>\n");
+        return;
+    }
+    if (!room.journal.enabled()) {
+        send_response(client, "ERROR: History not available\n");
+        return;
+    }
+    std::vector<FileSpan> spans;
+    uint32_t count;
+    uint64_t first = room.journal.range(before, std::min(limit, HISTORY_MAX_LIMIT), spans, count);
+    send_response(client, "HISTORY " + std::to_string(first) + " " + std::to_string(count) + "\n");
+    client.history.insert(client.history.end(), spans.begin(), spans.end());
+}
+
+// SEARCH [nick=<nick>] [since=<unix time>] [until=<unix time>] [limit=<n>] [words...]
+// replies "SEARCH <count> <seq>...\n" followed by the count matching lines,
+// newest first.
+void handle_search(Client &client, Room &room, const std::string &args) {
+    if (!room.search.enabled()) {
+        send_response(client, "ERROR: Search not available\n");
+        return;
+    }
+    SearchQuery q;
+    size_t limit = SEARCH_DEFAULT_LIMIT;
+    size_t pos = 0;
+    while (pos < args.size()) {
+        size_t sp = args.find(' ', pos);
+        if (sp == std::string::npos) sp = args.size();
+        std::string tok = args.substr(pos, sp - pos);
+        pos = sp + 1;
+        if (tok.rfind("nick=", 0) == 0) q.nick = tok.substr(5);
+        else if (tok.rfind("since=", 0) == 0) q.since_ms = strtoull(tok.c_str() + 6, nullptr, 10) * 1000;
+        else if (tok.rfind("until=", 0) == 0) q.until_ms = strtoull(tok.c_str() + 6, nullptr, 10) * 1000 + 999;
+        else if (tok.rfind("limit=", 0) == 0) limit = std::min<size_t>(strtoul(tok.c_str() + 6, nullptr, 10), SEARCH_MAX_LIMIT);
+        else tokenize(tok.data(), tok.size(), q.terms);
+    }
+    if (q.terms.empty() && q.nick.empty() && q.since_ms == 0 && q.until_ms == UINT64_MAX) {
+        send_response(client, "ERROR: Usage SEARCH [nick=<nick>] [since=<t>] [until=<t>] [limit=<n>] [words]\n");
+        return;
+    }
+    std::vector<uint64_t> hits = room.search.query(q, limit);
+    std::string header = "SEARCH";
+    std::vector<FileSpan> spans;
+    size_t found = 0;
+    for (uint64_t seq : hits) {
+        if (!room.journal.locate(seq, spans)) continue;
+        header += " " + std::to_string(seq);
+        found++;
+    }
+    header.insert(6, " " + std::to_string(found));
+    send_response(client, header + "\n");
+    client.history.insert(client.history.end(), spans.begin(), spans.end());
+}
+
+// Room-wide state that is not a message (reaction totals): it goes to the
+// room log for members and followers, but not to the journal or multicast.
+void publish(Room &room, const std::string &line) {
+    room.log.append(line, 0);
+    room.id_log.append(line, 0);
+    if (room.websocket) room.ws_log.append(ws_frame(WS_TEXT, line), 0);
+    if (room.followers) room.seq_log.append(line, 0);
+}
+
+// Every line that reaches a room goes through here: one append to the shared
+// room log for fan-out, one to the journal and, with multicast enabled, one
+// datagram "<seq> <line>" for LAN receivers. A lost datagram is not resent;
+// receivers notice the gap in sequence numbers and fetch it with HISTORY.
+//
+// The lobby's sequencer: the journal's counter gives each message its ID
+// (so IDs survive restarts and match on standbys and relays) and the time
+// is taken once, here. Only the main loop broadcasts, so neither needs
+// synchronization, and every reader of the three logs sees one order. Lines
+// with IDs go to their sender too, so it learns where its message landed.
+// Lines from other worker processes (-p) are not passed on again.
+uint64_t broadcast(Room &room, const std::string &framed, uint64_t origin, bool from_peer = false) {
+    uint64_t time_ms = now_ms();
+    uint64_t seq = room.journal.append(framed, time_ms);
+    std::string stamped = stamp_line(seq, time_ms, framed);
+    room.log.append(framed, origin);
+    room.id_log.append(stamped, 0);
+    if (room.websocket) room.ws_log.append(ws_frame(WS_TEXT, stamped), 0);
+    if (room.followers) room.seq_log.append(std::to_string(seq) + " " + framed, 0);
+    if (room.mcast_fd >= 0) {
+        std::string dgram = std::to_string(seq) + " " + framed;
+        sendto(room.mcast_fd, dgram.data(), dgram.size(), MSG_DONTWAIT,
+               (struct sockaddr *)&room.mcast_addr, sizeof(room.mcast_addr));
+    }
+    if (room.peers && !from_peer) room.peers->put(framed);
+    return seq;
+}
+
+// Multicast publisher for group:port, sent out of the interface with address
+// ifaddr (empty: the default route).
+int create_multicast_sender(const std::string &group, const std::string &ifaddr, struct sockaddr_in &dst) {
+    std::string host, port;
+    if (!split_hostport(group, host, port)) return -1;
+    dst = sockaddr_in{};
+    dst.sin_family = AF_INET;
+    dst.sin_port = htons(atoi(port.c_str()));
+    if (inet_pton(AF_INET, host.c_str(), &dst.sin_addr) != 1 || !IN_MULTICAST(ntohl(dst.sin_addr.s_addr))) {
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) return -1;
+    unsigned char ttl = 1, loop = 1;
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    if (!ifaddr.empty()) {
+        struct in_addr ia;
+        if (inet_pton(AF_INET, ifaddr.c_str(), &ia) != 1
+            || setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &ia, sizeof(ia)) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+// Attach a standby or relay that wants the room's lines from sequence
+// <from> on (0: only new ones). It gets "REPLICA <from>\n", the journaled
+// backlog straight from the segment files, resolved HISTORY_MAX_LIMIT
+// messages at a time as it drains, and then every new line through its
+// cursor in seq_log, "<seq> <line>", batched like any other client, so
+// followers cost the fan-out path nothing extra.
+void attach_follower(Client &client, Room &room, uint64_t from) {
+    if (!room.followers) {
+        send_response(client, "ERROR: Not accepting followers\n");
+        return;
+    }
+    uint64_t next = room.journal.next_seq();
+    if (from == 0) from = next;
+    if (from < next && (!room.journal.enabled() || from < room.journal.oldest_seq())) {
+        send_response(client, "ERROR: Journal does not reach back to " + std::to_string(from) + "\n");
+        return;
+    } else if (from > next) {
+        send_response(client, "ERROR: Journal does not reach " + std::to_string(from) + " yet\n");
+        return;
+    }
+    client.registered = true;
+    client.follower = true;
+    client.cursor = room.seq_log.head();
+    send_response(client, "REPLICA " + std::to_string(from) + "\n");
+    client.backlog_next = from;
+    client.backlog_end = next;
+}
+
+// REPLICATE <from>: a standby on the replication socket.
+void handle_replicate(Client &client, Room &room, const std::string &line) {
+    unsigned long long from;
+    if (sscanf(line.c_str(), "REPLICATE %llu", &from) != 1 || from == 0) {
+        send_response(client, "ERROR: Usage REPLICATE <from>\n");
+        return;
+    }
+    if (!room.journal.enabled()) {
+        send_response(client, "ERROR: Primary has no journal\n");
+        return;
+    }
+    attach_follower(client, room, from);
+    if (client.registered) std::cout << "Standby attached at sequence " << from << std::endl;
+}
+
+// Proof that a relay knows the shared secret: the hex HMAC-SHA256 of
+// "<from> <host:port>" keyed with it.
+std::string relay_proof(const std::string &secret, uint64_t from, const std::string &addr) {
+    std::string msg = std::to_string(from) + " " + addr;
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    HMAC(EVP_sha256(), secret.data(), (int)secret.size(), (const unsigned char *)msg.data(), msg.size(), mac, &len);
+    static const char hex[] = "0123456789abcdef";
+    std::string out;
+    for (unsigned int i = 0; i < len; ++i) {
+        out += hex[mac[i] >> 4];
+        out += hex[mac[i] & 15];
+    }
+    return out;
+}
+
+// RELAY <from> <host:port> <proof>: another cserverd re-broadcasting this
+// room to its own clients, authenticated with the relay secret (-k). Each
+// server takes at most max_relays of them; further ones are sent to an
+// existing child with "REDIRECT <host:port>", so relays arrange themselves
+// into a tree with that branching factor.
+void handle_relay(Client &client, Room &room, const std::string &line) {
+    unsigned long long from;
+    char addr[256], proof[129];
+    int n = sscanf(line.c_str(), "RELAY %llu %255s %128s", &from, addr, proof);
+    if (n < 2) {
+        send_response(client, "ERROR: Usage RELAY <from> <host:port> <proof>\n");
+        return;
+    }
+    if (room.relay_secret.empty()) {
+        send_response(client, "ERROR: Not accepting relays\n");
+        return;
+    }
+    std::string want = relay_proof(room.relay_secret, from, addr);
+    if (n != 3 || strlen(proof) != want.size() || CRYPTO_memcmp(proof, want.data(), want.size()) != 0) {
+        std::cerr << "Refusing relay " << addr << ": bad proof" << std::endl;
+        send_response(client, "ERROR: Relay not authorized\n");
+        return;
+    }
+    if (room.max_relays && room.relays.size() >= room.max_relays) {
+        auto it = room.relays.begin();
+        std::advance(it, room.next_redirect++ % room.relays.size());
+        send_response(client, "REDIRECT " + it->second + "\n");
+        return;
+    }
+    attach_follower(client, room, from);
+    if (!client.registered) return;
+    client.relay_link = true;
+    client.nick = std::string("<relay ") + addr + ">";
+    room.relays[client.id] = addr;
+    std::cout << "Relay " << addr << " attached at sequence " << room.journal.next_seq() << std::endl;
+}
+
+// READ [seq]: the member has read everything up to seq (default: the
+// newest message). No reply.
+void handle_read(Client &client, Room &room, const std::string &line) {
+    uint64_t last = room.journal.next_seq() - 1;
+    uint64_t seq = line.size() > 5 ? strtoull(line.c_str() + 5, nullptr, 10) : last;
+    room.receipts.advance(room.receipts.member(client.nick), std::min(seq, last));
+}
+
+// RELIABLE [last]: switch to IDs (as IDS) and at-least-once delivery. Every
+// journaled message after last (default: the nick's acked position; a new
+// nick starts at the newest message) is resent as "RESEND <first> <count>\n"
+// and the lines, in the same way as HISTORY; live lines follow. A <first>
+// past last+1 means retention already deleted the ones in between. The
+// lines are queued in chunks as they drain (queue_backlog).
+void handle_reliable(Client &client, Room &room, const std::string &line) {
+    if (room.peers) {
+        send_response(client, "ERROR: Reliable delivery is not available with worker processes (-p)\n");
+        return;
+    }
+    if (!room.journal.enabled()) {
+        send_response(client, "ERROR: Reliable delivery needs the journal\n");
+        return;
+    }
+    if (client.multicast || client.reliable) {
+        send_response(client, "ERROR: Already in " + std::string(client.reliable ? "reliable" : "multicast") + " mode\n");
+        return;
+    }
+    uint64_t next = room.journal.next_seq();
+    uint64_t last = next - 1;
+    if (line.size() > 9) {
+        last = std::min<uint64_t>(strtoull(line.c_str() + 9, nullptr, 10), next - 1);
+    } else {
+        room.acks.find(client.nick, last);
+    }
+    room.acks.set(client.nick, last, now_ms());
+    client.reliable = true;
+    // caught up (see process_client_data), so both logs are at the same line
+    if (!client.websocket && !client.ids) {
+        client.ids = true;
+        client.cursor = room.id_log.head();
+    }
+    if (last + 1 >= next) {
+        send_response(client, "RESEND " + std::to_string(next) + " 0\n");
+        return;
+    }
+    room.journal.flush();  // the files must hold every line the spans cover
+    client.backlog_next = last + 1;
+    client.backlog_end = next;
+    client.resend_end = 0;
+}
+
+// Token bucket for MSG while the server is at RATE_LIMIT or above, kept in
+// thousandths of a message.
+bool take_msg_token(Client &c) {
+    uint64_t now = now_ms();
+    c.msg_allowance = std::min(c.msg_allowance + (now - c.msg_refill) * OVERLOAD_MSG_RATE, OVERLOAD_MSG_BURST * 1000);
+    c.msg_refill = now;
+    if (c.msg_allowance < 1000) return false;
+    c.msg_allowance -= 1000;
+    return true;
+}
+
+bool msg_bucket_full(uint64_t allowance, uint64_t refill, uint64_t now) {
+    return now < refill || allowance + (now - refill) * OVERLOAD_MSG_RATE >= OVERLOAD_MSG_BURST * 1000;
+}
+
+// A nick's MSG bucket outlives its connection (and, in the snapshot, a
+// restart) until it has refilled, so reconnecting does not reset the limit.
+void keep_msg_bucket(Room &room, const Client &c) {
+    if (c.msg_refill && !msg_bucket_full(c.msg_allowance, c.msg_refill, now_ms())) {
+        room.msg_buckets[c.nick] = std::make_pair(c.msg_allowance, c.msg_refill);
+    }
+}
+
+void restore_msg_bucket(Room &room, Client &c) {
+    auto it = room.msg_buckets.find(c.nick);
+    if (it == room.msg_buckets.end()) return;
+    c.msg_allowance = it->second.first;
+    c.msg_refill = it->second.second;
+    room.msg_buckets.erase(it);
+}
+
+// A member of an actor room: MSG goes to the room's owner and PART hands
+// the connection back to the lobby. Nothing else is available in a room.
+void handle_room_line(Client &client, Room &room, const std::string &line) {
+    if (line.rfind("MSG ", 0) == 0) {
+        std::string message = line.substr(4);
+        if (message.size() > 255) {
+            room.actors->reply(client, "ERROR: Message too long\n");
+        } else if (room.overload.level >= RATE_LIMIT && !take_msg_token(client)) {
+            room.actors->reply(client, "ERROR: Server busy, slow down\n");
+        } else {
+            room.actors->line(client, message);
+            room.stats.record(client.nick_hash, client.nick);
+        }
+    } else if (line == "PART") {
+        room.actors->leave(client, false);
+    } else {
+        room.actors->reply(client, "ERROR: Only MSG and PART inside a room\n");
+    }
+}
+
+// Operator commands on the admin socket (-a). Multi-line replies end with
+// "END".
+//   STATS       metrics as "<name> <value>" lines
+//   TOP [n]     heavy-hitter senders of the current and the last window
+//   ACTIVE      distinct senders in the current and the last window
+void handle_admin(Client &client, Room &room, const std::string &line) {
+    const TrafficStats &st = room.stats;
+    std::string out;
+    if (line == "STATS") {
+        out += "members " + std::to_string(room.member_count) + "\n";
+        out += "nicks " + std::to_string(room.nicks->size()) + "\n";
+        out += "relays " + std::to_string(room.relays.size()) + "\n";
+        out += "messages_total " + std::to_string(st.messages_total) + "\n";
+        out += "messages_window " + std::to_string(st.messages[0]) + "\n";
+        out += "messages_last_window " + std::to_string(st.messages[1]) + "\n";
+        out += "active_window " + std::to_string(st.active[0].estimate()) + "\n";
+        out += "active_last_window " + std::to_string(st.active[1].estimate()) + "\n";
+        out += "journal_next_seq " + std::to_string(room.journal.next_seq()) + "\n";
+        out += "log_bytes " + std::to_string(room.log.head() - room.log.tail()) + "\n";
+        out += "transfers " + std::to_string(room.transfers.size()) + "\n";
+        out += "rooms " + std::to_string(room.actors ? room.actors->room_count() : 0) + "\n";
+        out += "overload_level " + std::to_string(room.overload.level) + "\n";
+        out += "loop_lag_ms " + std::to_string(room.overload.last_lag) + "\n";
+        out += "queue_delay_ms " + std::to_string(room.overload.last_delay) + "\n";
+    } else if (line == "TOP" || line.rfind("TOP ", 0) == 0) {
+        size_t n = line.size() > 4 ? std::min<size_t>(strtoul(line.c_str() + 4, nullptr, 10), SKETCH_TOP) : 10;
+        for (int w = 0; w < 2; ++w) {
+            for (auto &t : st.talkers[w].largest(n)) {
+                out += std::string(w ? "last " : "window ") + t.first + " " + std::to_string(t.second) + "\n";
+            }
+        }
+    } else if (line == "ACTIVE") {
+        out += "window " + std::to_string(st.active[0].estimate()) + "\n";
+        out += "last " + std::to_string(st.active[1].estimate()) + "\n";
+    } else {
+        send_response(client, "ERROR: Admin commands are STATS, TOP [n], ACTIVE\n");
+        return;
+    }
+    send_response(client, out + "END\n");
+}
+
+bool is_valid_reaction(const std::string &s) {
+    static const std::regex pattern("^[A-Za-z0-9_+-]{1,16}$");
+    return std::regex_match(s, pattern);
+}
+
+// REACT <seq> <kind> / UNREACT <seq> <kind>: count, don't broadcast; the
+// totals go out with the next reaction flush. No reply on success. Members
+// are keyed by nick, as for read receipts.
+void handle_react(Client &client, Room &room, const std::string &line) {
+    bool undo = line[0] == 'U';
+    unsigned long long seq;
+    char kind[32];
+    if (sscanf(line.c_str() + (undo ? 8 : 6), "%llu %31s", &seq, kind) != 2 || !is_valid_reaction(kind)) {
+        send_response(client, "ERROR: Usage REACT <seq> <kind>\n");
+    } else if (room.read_only) {
+        send_response(client, "ERROR: Read-only relay\n");
+    } else if (seq == 0 || seq >= room.journal.next_seq()) {
+        send_response(client, "ERROR: No message " + std::to_string(seq) + "\n");
+    } else if (seq < room.reactions.oldest()) {
+        send_response(client, "ERROR: Reactions closed for message " + std::to_string(seq) + "\n");
+    } else if (!room.reactions.add(seq, room.receipts.member(client.nick), kind, undo)) {
+        send_response(client, "ERROR: Too many reaction kinds\n");
+    }
+}
+
+std::string random_token() {
+    unsigned char raw[16];
+    if (RAND_bytes(raw, sizeof(raw)) != 1) throw std::runtime_error("RAND_bytes failed");
+    static const char hex[] = "0123456789abcdef";
+    std::string token;
+    for (unsigned char b : raw) {
+        token += hex[b >> 4];
+        token += hex[b & 15];
+    }
+    return token;
 }
 
-int create_and_bind(const std::string &host, const std::string &port) {
-    struct addrinfo hints{}, *res = nullptr;
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
+bool is_valid_filename(const std::string &s) {
+    static const std::regex pattern("^[A-Za-z0-9_-][A-Za-z0-9._-]{0,63}$");
+    return std::regex_match(s, pattern);
+}
 
-    int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
-    if (rc != 0) {
-        std::cerr << "getaddrinfo: " << gai_strerror(rc) << std::endl;
-        flush_stderr();
-        return -1;
+// SEND <nick> <size> <name>: offer a file. The sender gets "OFFERED <id>
+// <nick>", the receiver "OFFER <id> <from> <size> <name>".
+void handle_send(Client &client, Room &room, const std::string &args) {
+    char nick[64], name[128];
+    unsigned long long size;
+    if (sscanf(args.c_str(), "%63s %llu %127s", nick, &size, name) != 3 || !is_valid_filename(name)) {
+        send_response(client, "ERROR: Send usage SEND <nick> <size> <name>\n");
+        return;
     }
-
-    int lfd = -1;
-    for (auto a = res; a != nullptr; a = a->ai_next) {
-        lfd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
-        if (lfd < 0) continue;
-        int on = 1;
-        setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
-        if (bind(lfd, a->ai_addr, a->ai_addrlen) == 0) {
-            if (listen(lfd, 16) == 0) {
-                break; // success
-            }
+    NickRegistry::Handle to;
+    if (!room.nicks->lookup(nick, to) || to.client == client.id || to.client == RESERVED_NICK_CLIENT) {
+        // both ends of a transfer connect to the process that offered it
+        int owner = room.peers ? room.peers->nicks()->owner(nick) : -1;
+        if (owner >= 0 && (size_t)owner != room.peers->index()) {
+            send_response(client, std::string("ERROR: ") + nick + " is connected to another worker process (-p)\n");
+        } else {
+            send_response(client, std::string("ERROR: Send to unknown nick ") + nick + "\n");
         }
-        close(lfd);
-        lfd = -1;
+        return;
     }
-    freeaddrinfo(res);
-    return lfd;
+    Transfer t;
+    t.id = room.next_transfer++;
+    t.from_id = client.id;
+    t.to_id = to.client;
+    t.from = client.nick;
+    t.name = name;
+    t.size = size;
+    t.send_token = random_token();
+    t.recv_token = random_token();
+    t.last_active = now_ms();
+    room.transfers.emplace(t.id, t);
+    std::string id = std::to_string(t.id);
+    send_response(client, "OFFERED " + id + " " + nick + "\n");
+    room.direct.emplace_back(t.to_id, "OFFER " + id + " " + t.from + " " + std::to_string(size) + " " + name + "\n");
 }
 
-ssize_t recv_into(Client &c) {
-    char buf[1024];
-    ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
-    if (n > 0) c.inbuf.append(buf, n);
-    return n;
+// ACCEPT <id> / REJECT <id>, from the receiver of an offer. On accept both
+// sides get "XFER <id> <token>" for their data connection.
+void handle_answer(Client &client, Room &room, const std::string &args, bool accept) {
+    unsigned long long id;
+    auto it = sscanf(args.c_str(), "%llu", &id) == 1 ? room.transfers.find(id) : room.transfers.end();
+    if (it == room.transfers.end() || it->second.to_id != client.id || it->second.accepted) {
+        send_response(client, "ERROR: No such offer\n");
+        return;
+    }
+    Transfer &t = it->second;
+    if (!accept) {
+        room.end_transfer(it, "rejected");
+        return;
+    }
+    t.accepted = true;
+    t.last_active = now_ms();
+    room.direct.emplace_back(t.from_id, "XFER " + std::to_string(t.id) + " " + t.send_token + "\n");
+    send_response(client, "XFER " + std::to_string(t.id) + " " + t.recv_token + "\n");
 }
 
-void send_response(int clientFd, const std::string &message) {
-    ssize_t n = send(clientFd, message.c_str(), message.size(), 0);
-    if (n < 0) {
-        perror("send failed");
-        close(clientFd);
+// XFER <token>: first line of a data connection. After "XFER OK" is out the
+// socket is handed to the transfer (see the cleanup pass in main).
+void handle_xfer(Client &client, Room &room, const std::string &token) {
+    if (client.tls || client.websocket) {
+        send_response(client, "ERROR: Transfers use the plain client port\n");
+        return;
     }
+    for (auto &entry : room.transfers) {
+        Transfer &t = entry.second;
+        if (!t.accepted || token.empty()) continue;
+        if (token != t.send_token && token != t.recv_token) continue;
+        client.transfer_sender = token == t.send_token;
+        (client.transfer_sender ? t.send_token : t.recv_token).clear();  // one connection per token
+        client.transfer = t.id;
+        client.registered = true;
+        client.nick = "<transfer>";
+        send_response(client, "XFER OK\n");
+        return;
+    }
+    send_response(client, "ERROR: Unknown transfer token\n");
+}
+
+// Hand a data connection to its transfer; the pipe is set up once both
+// sides are there.
+void attach_transfer(Client &client, Room &room) {
+    auto it = room.transfers.find(client.transfer);
+    if (it == room.transfers.end()) {
+        close_watched(client.fd);
+        client.fd = -1;
+        return;
+    }
+    Transfer &t = it->second;
+    (client.transfer_sender ? t.src : t.dst) = client.fd;
+    client.fd = -1;
+    if (!t.running()) return;
+    if (pipe2(t.pipefd, O_NONBLOCK) < 0) {
+        room.end_transfer(it, "failed");
+        return;
+    }
+    fcntl(t.pipefd[1], F_SETPIPE_SZ, (int)TRANSFER_PIPE_SIZE);
+    t.last_refill = t.last_active = now_ms();
+    std::cout << "Transfer " << t.id << " of " << t.size << " bytes from " << t.from << " started" << std::endl;
 }
 
-void process_client_data(Client &client, std::vector<Client> &clients) {
+void process_client_data(Client &client, Room &room) {
     size_t pos;
-    while ((pos = client.inbuf.find('\n')) != std::string::npos) {
+    if (client.subscribing || client.transfer) {
+        client.inbuf.clear();
+        return;
+    }
+    // input is left unparsed while a history reply is in flight, so later
+    // replies cannot overtake it
+    while (!client.room_leaving && client.history.empty() && (pos = client.inbuf.find('\n')) != std::string::npos) {
+        // a HISTORY reply must not overtake broadcasts still queued for the
+        // client, or it could not tell which live lines the page covers; a
+        // JOIN hands the socket to a room worker, which only takes outbuf
+        // along, so the lobby lines before it must be written first
+        if (client.registered && !client.multicast && client.cursor < log_for(room, client).head()
+            && (client.inbuf.compare(0, 8, "HISTORY ") == 0 || client.inbuf.compare(0, 3, "IDS") == 0
+                || client.inbuf.compare(0, 8, "RELIABLE") == 0 || client.inbuf.compare(0, 5, "MCAST") == 0
+                || client.inbuf.compare(0, 5, "JOIN ") == 0)) break;
         std::string line = client.inbuf.substr(0, pos);
         client.inbuf.erase(0, pos + 1);
         chomp(line);
 
-        if (!client.registered) {
+        if (!client.room.empty()) {
+            handle_room_line(client, room, line);
+        } else if (client.admin) {
+            handle_admin(client, room, line);
+        } else if (client.replica_link) {
+            if (!client.registered) handle_replicate(client, room, line);
+        } else if (!client.registered) {
             if (line.rfind("NICK ", 0) == 0) {
                 std::string nick = line.substr(5);
-                if (is_valid_nick(nick)) {
+                if (!is_valid_nick(nick)) {
+                    send_response(client, "ERROR: Invalid nickname format\n");
+                } else if (!room.reserved_nicks.claim(*room.nicks, nick, client.id, client.fd)) {
+                    send_response(client, "ERROR: Nickname already in use\n");
+                } else {
                     client.nick = nick;
+                    client.nick_hash = hash_nick(nick);
                     client.registered = true;
-                    send_response(client.fd, "OK\n");
+                    restore_msg_bucket(room, client);
+                    send_response(client, "OK\n");
                     std::cout << "Client registered with nickname: " << nick << std::endl;
-                } else {
-                    send_response(client.fd, "ERROR: Invalid nickname format\n");
                 }
+            } else if (line == "SUBSCRIBE" && !client.websocket) {
+                client.registered = true;
+                client.subscribing = true;
+                client.nick = "<subscriber>";
+                client.cursor = room.log.head();
+                client.inbuf.clear();
+                send_response(client, "OK\n");
+                return;
+            } else if (line.rfind("RELAY ", 0) == 0 && !client.websocket) {
+                handle_relay(client, room, line);
+            } else if (line.rfind("XFER ", 0) == 0) {
+                handle_xfer(client, room, line.substr(5));
+                return;
             } else {
-                send_response(client.fd, "ERROR: NICK command expected\n");
+                send_response(client, "ERROR: NICK command expected\n");
             }
         } else {
             if (line.rfind("MSG ", 0) == 0) {
                 std::string message = line.substr(4);
                 chomp(message);
-                if (message.size() > 255) {
-                    send_response(client.fd, "ERROR: Message too long\n");
+                if (room.read_only) {
+                    send_response(client, "ERROR: Read-only relay\n");
+                } else if (message.size() > 255) {
+                    send_response(client, "ERROR: Message too long\n");
+                } else if (room.overload.level >= RATE_LIMIT && !take_msg_token(client)) {
+                    send_response(client, "ERROR: Server busy, slow down\n");
                 } else {
-                    std::string full_message = "MSG " + client.nick + " " + message + "\n";
-                    for (auto &dst : clients) {
-                        if (dst.fd >= 0 && dst.fd != client.fd) {
-                            send_response(dst.fd, full_message);
-                        }
+                    uint64_t seq = broadcast(room, "MSG " + client.nick + " " + message + "\n", client.id);
+                    room.stats.record(client.nick_hash, client.nick);
+                    room.typing.stop(client.id, client.nick);
+                    room.receipts.advance(room.receipts.member(client.nick), seq);  // own lines are read
+                    // it gets its own line back through the group; tell it which one that is
+                    if (client.multicast) send_response(client, "SENT " + std::to_string(seq) + "\n");
+                }
+            } else if (line == "IDS") {
+                // each worker process numbers the lines it sees on its own
+                if (room.peers) {
+                    send_response(client, "ERROR: IDs are not available with worker processes (-p)\n");
+                } else {
+                    // caught up (see above), so both logs are at the same line
+                    if (!client.websocket && !client.ids) {
+                        client.ids = true;
+                        client.cursor = room.id_log.head();
                     }
+                    send_response(client, "OK\n");
+                }
+            } else if (line == "RELIABLE" || line.rfind("RELIABLE ", 0) == 0) {
+                handle_reliable(client, room, line);
+            } else if (line.rfind("ACK ", 0) == 0) {
+                if (!client.reliable) {
+                    send_response(client, "ERROR: Not in reliable mode\n");
+                } else {
+                    uint64_t seq = std::min<uint64_t>(strtoull(line.c_str() + 4, nullptr, 10), room.journal.next_seq() - 1);
+                    room.acks.advance(client.nick, seq, now_ms());
+                }
+            } else if (line.rfind("JOIN ", 0) == 0) {
+                std::string name = line.substr(5);
+                if (!room.actors) {
+                    send_response(client, "ERROR: Rooms are not enabled\n");
+                } else if (!is_valid_room(name)) {
+                    send_response(client, "ERROR: Invalid room name\n");
+                } else if (client.tls || client.websocket || client.multicast) {
+                    send_response(client, "ERROR: Rooms need a plain TCP connection\n");
+                } else if (client.reliable) {
+                    send_response(client, "ERROR: Rooms have no reliable delivery\n");
+                } else {
+                    room.typing.stop(client.id, client.nick);
+                    room.actors->join(client, name);
+                }
+            } else if (line.rfind("HISTORY ", 0) == 0) {
+                handle_history(client, room, line.substr(8));
+            } else if (line.rfind("SEARCH ", 0) == 0) {
+                handle_search(client, room, line.substr(7));
+            } else if (line == "TYPING 1" || line == "TYPING 0") {
+                if (!room.read_only && room.overload.level < SHED_EPHEMERAL) {
+                    room.typing.update(client.id, client.nick, line == "TYPING 1");
+                }
+            } else if (line == "READ" || line.rfind("READ ", 0) == 0) {
+                handle_read(client, room, line);
+            } else if (line.rfind("READERS ", 0) == 0) {
+                unsigned long long seq = strtoull(line.c_str() + 8, nullptr, 10);
+                send_response(client, "READERS " + std::to_string(seq) + " "
+                              + std::to_string(room.receipts.readers(seq)) + "\n");
+            } else if (line == "UNREAD") {
+                uint64_t last = room.journal.next_seq() - 1;
+                uint64_t pos = room.receipts.position(room.receipts.member(client.nick));
+                send_response(client, "UNREAD " + std::to_string(last > pos ? last - pos : 0) + " "
+                              + std::to_string(pos) + "\n");
+            } else if (line.rfind("REACT ", 0) == 0 || line.rfind("UNREACT ", 0) == 0) {
+                handle_react(client, room, line);
+            } else if (line.rfind("REACTIONS ", 0) == 0) {
+                send_response(client, room.reactions.snapshot(strtoull(line.c_str() + 10, nullptr, 10)));
+            } else if (line.rfind("SEND ", 0) == 0) {
+                handle_send(client, room, line.substr(5));
+            } else if (line.rfind("ACCEPT ", 0) == 0) {
+                handle_answer(client, room, line.substr(7), true);
+            } else if (line.rfind("REJECT ", 0) == 0) {
+                handle_answer(client, room, line.substr(7), false);
+            } else if (line == "MCAST" && !client.websocket) {
+                // the client listens to the multicast group and repairs
+                // gaps with HISTORY, so TCP copies of broadcasts stop here;
+                // held until caught up (see above), so none are skipped
+                if (room.mcast_fd < 0) {
+                    send_response(client, "ERROR: Multicast not enabled\n");
+                } else {
+                    client.multicast = true;
+                    send_response(client, "MCAST ON " + std::to_string(room.journal.next_seq()) + "\n");
                 }
             } else {
-                send_response(client.fd, "ERROR: Unsupported command\n");
+                send_response(client, "ERROR: Unsupported command\n");
             }
         }
     }
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <bindaddr:port>\n";
-        flush_stderr();
-        return 1;
+// Connection to an upstream server whose lines this one applies exactly as
+// the upstream did. A standby follows its primary's journal over the local
+// replication socket (REPLICATE), keeping journal, history ring and search
+// index current until promotion. A relay follows a room over TCP (RELAY)
+// and re-broadcasts it to its own clients in the upstream's order.
+class UpstreamLink {
+public:
+    int fd = -1;
+    bool connecting = false;  // TCP connect in progress: wait for writable
+    std::string redirect;     // set when the upstream sent us to one of its relays
+    bool lacks_backlog = false;  // the upstream could not serve our next sequence
+
+    bool connect_local(const std::string &path, uint64_t from) {
+        fd = connect_unix(path);
+        return start("REPLICATE " + std::to_string(from) + "\n");
     }
 
-    std::string host, port;
-    if (!split_hostport(argv[1], host, port)) {
-        std::cerr << "Bad bind address\n";
-        flush_stderr();
-        return 1;
+    // Starts a non-blocking connect; the RELAY request is sent once the
+    // loop sees the fd writable and calls on_connected().
+    bool connect_relay(const std::string &addr, uint64_t from, const std::string &advertise,
+                       const std::string &secret) {
+        std::string host, port;
+        redirect.clear();
+        if (lacks_backlog) from = 0;
+        fd = split_hostport(addr, host, port) ? connect_tcp(host, port, true) : -1;
+        if (fd < 0) return false;
+        request = "RELAY " + std::to_string(from) + " " + advertise + " " + relay_proof(secret, from, advertise) + "\n";
+        connecting = true;
+        return true;
     }
 
-    int listenfd = create_and_bind(host, port);
-    if (listenfd < 0) {
-        std::cerr << "Failed to bind\n";
-        flush_stderr();
-        return 1;
+    bool on_connected() {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        connecting = false;
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+            errno = err;
+            return false;
+        }
+        return start(request);
     }
 
-    std::cout << "[x] Listening on " << host << ":" << port << "\n";
-    flush_stdout();
+    // Lines arrive numbered by the upstream: the backlog as "BACKLOG <first>
+    // <count>" and that many lines, live ones as "<seq> <line>", REACTIONS
+    // lines unnumbered. Each is applied under its upstream number, so a
+    // journaled relay or standby numbers exactly as the upstream does and can
+    // resume from its own next sequence at any server of the tree; lines it
+    // already has are skipped. Returns false once the upstream is gone or
+    // has redirected us.
+    bool on_readable(Room &room) {
+        char tmp[64 * 1024];
+        ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return true;
+        if (n <= 0) return false;
+        buf.append(tmp, n);
+        size_t start = 0, nl;
+        while ((nl = buf.find('\n', start)) != std::string::npos) {
+            unsigned long long first, count;
+            if (!attached) {
+                std::string line = buf.substr(start, nl - start);
+                if (line.rfind("REDIRECT ", 0) == 0) {
+                    redirect = line.substr(9);
+                    return false;
+                }
+                if (sscanf(line.c_str(), "REPLICA %llu", &first) == 1) {
+                    attached = true;
+                    lacks_backlog = false;
+                    room.journal.follow_seq(first);
+                } else if (line.rfind("HELLO", 0) != 0) {
+                    std::cerr << "Upstream refused us: " << line << std::endl;
+                    lacks_backlog = line.rfind("ERROR: Journal does not reach back", 0) == 0;
+                    return false;
+                }
+            } else if (backlog_left) {
+                apply(room, backlog_seq++, buf.substr(start, nl + 1 - start));
+                backlog_left--;
+            } else if (sscanf(buf.c_str() + start, "BACKLOG %llu %llu", &first, &count) == 2) {
+                backlog_seq = first;
+                backlog_left = count;
+            } else if (buf.compare(start, 10, "REACTIONS ") == 0) {
+                std::string line = buf.substr(start, nl + 1 - start);
+                room.reactions.apply_snapshot(line);
+                publish(room, line);
+            } else {
+                char *end;
+                uint64_t seq = strtoull(buf.c_str() + start, &end, 10);
+                if (end == buf.c_str() + start || *end != ' ') {
+                    std::cerr << "Unnumbered line from upstream" << std::endl;
+                    return false;
+                }
+                apply(room, seq, buf.substr(end + 1 - buf.c_str(), nl - (end - buf.c_str())));
+            }
+            start = nl + 1;
+        }
+        buf.erase(0, start);
+        return true;
+    }
+
+    void close_link() {
+        if (fd >= 0) close_watched(fd);
+        fd = -1;
+        connecting = false;
+        buf.clear();
+        attached = false;
+        backlog_left = 0;
+    }
+
+private:
+    bool start(const std::string &req) {
+        redirect.clear();
+        if (fd < 0) return false;
+        if (send(fd, req.data(), req.size(), MSG_NOSIGNAL) != (ssize_t)req.size()) {
+            close_link();
+            return false;
+        }
+        set_nonblocking(fd);
+        return true;
+    }
+
+    static void apply(Room &room, uint64_t seq, const std::string &line) {
+        uint64_t next = room.journal.next_seq();
+        if (seq < next && room.journal.enabled()) return;
+        if (seq > next) {
+            if (room.journal.enabled()) std::cerr << "Upstream skipped sequences " << next << " to " << seq - 1 << std::endl;
+            room.journal.skip_to(seq);
+        }
+        room.journal.follow_seq(seq);
+        broadcast(room, line, 0);
+    }
+
+    std::string buf;
+    std::string request;
+    bool attached = false;
+    uint64_t backlog_seq = 0;
+    uint64_t backlog_left = 0;
+};
+
+void RoomActors::drain(std::vector<Client> &clients, Room &lobby) {
+    uint64_t n;
+    while (read(wakefd, &n, sizeof(n)) > 0) {}
+    for (size_t w = 0; w < workers.size(); ++w) {
+        RoomMail m;
+        while (workers[w]->outbox.take(m)) {
+            auto route = routes.find(m.room);
+            if (m.kind == RoomMail::LOAD) {
+                if (route != routes.end() && route->second.owner == w && !route->second.migrating
+                    && route->second.members > 0) {
+                    route->second.cost = m.cost * 1000 / ROOM_LOAD_REPORT_MS;
+                }
+                continue;
+            }
+            if (m.kind == RoomMail::MIGRATED) {
+                Route &r = route->second;  // kept while migrating
+                RoomMail adopt;
+                adopt.kind = RoomMail::ADOPT;
+                adopt.room = m.room;
+                adopt.state = std::move(m.state);
+                workers[m.to]->inbox.post(std::move(adopt));
+                for (RoomMail &held : r.held) workers[m.to]->inbox.post(std::move(held));
+                r.held.clear();
+                r.owner = m.to;
+                r.migrating = false;
+                continue;
+            }
+            auto c = std::find_if(clients.begin(), clients.end(),
+                                  [&](const Client &x) { return x.fd >= 0 && x.id == m.client; });
+            if (c == clients.end()) continue;
+            if (m.kind == RoomMail::DROPPED) {
+                if (!c->room_leaving && route != routes.end() && --route->second.members == 0) {
+                    route->second.cost = 0;
+                }
+                c->room.clear();
+                drop_client(*c, "too far behind in its room");
+            } else if (m.closing) {  // LEFT after a disconnect
+                c->room.clear();
+                std::cout << "Client " << c->nick << " has disconnected." << std::endl;
+                close_watched(c->fd);
+                c->fd = -1;
+            } else {  // LEFT after PART: back in the lobby
+                c->outbuf = m.text + "PARTED " + m.room + "\n";
+                c->room.clear();
+                c->room_leaving = false;
+                c->cursor = log_for(lobby, *c).head();
+                c->typing_seen = lobby.typing.version();
+                process_client_data(*c, lobby);  // lines sent after PART
+            }
+        }
+    }
+}
+
+// Everything the main loop works on. main() fills it in from the options
+// and closes what is left once the loop returns.
+struct ServerState {
+    explicit ServerState(PeerRings &rings) : peers(rings) {}
+
+    // options the loop still needs, for promotion, relay reconnects and
+    // housekeeping
+    std::string host, port, tls_host, tls_port, ws_addr, ws_host, ws_port;
+    std::string follow_path, upstream_addr, relay_secret, advertise;
+    SSL_CTX *tls_ctx = nullptr;
+    uint64_t retain_age_ms = 0, retain_bytes = 0, snapshot_ms = 0;
 
+    int listenfd = -1, tls_listenfd = -1, ws_listenfd = -1, repl_listenfd = -1, admin_listenfd = -1;
+    Room lobby;
+    RoomActors actors;
+    PeerRings &peers;
+    UpstreamLink primary;
+    Acceptor acceptor;
     std::vector<Client> clients;
-    fd_set readfds;
+    std::vector<Subscriber> subscribers;
+    uint64_t last_subscriber_flush = 0;
+    uint64_t last_reaction_flush = 0;
+    uint64_t last_housekeeping = 0;
+    uint64_t last_snapshot = 0;
+
+    // a relay without a journal only carries lines from now on
+    uint64_t relay_from() const { return lobby.journal.enabled() ? lobby.journal.next_seq() : 0; }
+};
+
+// Server state outside the journal, for the snapshot: one line per item,
+//   room <name> <end of its reserved IDs>
+//   ack <nick> <seq> <seen_ms>          (RELIABLE positions)
+//   nick <nick> <address>               (held nicks, reserved after a restart)
+//   rate <nick> <allowance> <refill_ms> (MSG buckets not refilled yet)
+std::string save_state(ServerState &s) {
+    std::ostringstream out;
+    for (auto &r : s.actors.ids.all()) out << "room " << r.first << " " << r.second << "\n";
+    s.lobby.acks.for_each([&](const std::string &nick, uint64_t seq, uint64_t seen_ms) {
+        out << "ack " << nick << " " << seq << " " << seen_ms << "\n";
+    });
+    for (auto &n : s.lobby.reserved_nicks.all()) out << "nick " << n.first << " " << n.second << "\n";
+    uint64_t now = now_ms();
+    for (const Client &c : s.clients) {
+        if (c.fd < 0 || !c.registered || !is_valid_nick(c.nick)) continue;
+        std::string addr = peer_address(c.fd);
+        if (!addr.empty()) out << "nick " << c.nick << " " << addr << "\n";
+        if (c.msg_refill && !msg_bucket_full(c.msg_allowance, c.msg_refill, now)) {
+            out << "rate " << c.nick << " " << c.msg_allowance << " " << c.msg_refill << "\n";
+        }
+    }
+    for (auto &b : s.lobby.msg_buckets) out << "rate " << b.first << " " << b.second.first << " " << b.second.second << "\n";
+    return out.str();
+}
+
+void restore_state(ServerState &s, const std::string &state) {
+    std::istringstream in(state);
+    std::string line, kind, key;
+    uint64_t until = now_ms() + RESTART_NICK_GRACE_MS;
+    size_t items = 0;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        uint64_t a = 0, b = 0;
+        std::string addr;
+        if (!(fields >> kind >> key)) continue;
+        if (kind == "room" && fields >> a) {
+            s.actors.ids.restore(key, a);
+        } else if (kind == "ack" && fields >> a >> b) {
+            s.lobby.acks.set(key, a, b);
+        } else if (kind == "nick" && fields >> addr) {
+            s.lobby.reserved_nicks.reserve(*s.lobby.nicks, key, addr, until);
+        } else if (kind == "rate" && fields >> a >> b) {
+            s.lobby.msg_buckets[key] = std::make_pair(a, b);
+        } else {
+            continue;
+        }
+        items++;
+    }
+    if (items) std::cout << "[x] Restored " << items << " items of state from the snapshot\n";
+}
+
+// The main loop, once per event backend; main() picks one at startup.
+template <class Poller>
+void serve_loop(ServerState &s, Poller &poller) {
+    Room &lobby = s.lobby;
+    std::vector<Client> &clients = s.clients;
+    std::vector<Subscriber> &subscribers = s.subscribers;
+
+    // A connection the backend cannot wait for (select past FD_SETSIZE) is
+    // closed before it gets any state.
+    auto refuse_unwatchable = [&poller](int fd) {
+        if (poller.can_watch(fd)) return false;
+        std::cerr << "Refusing connection: descriptor " << fd << " is past what " << poller.name()
+                  << " can watch (use -e epoll)" << std::endl;
+        close(fd);
+        return true;
+    };
     while (running) {
-        FD_ZERO(&readfds);
-        FD_SET(listenfd, &readfds);
-        int maxfd = listenfd;
-        for (auto &client : clients) {
-            if (client.fd >= 0) {
-                FD_SET(client.fd, &readfds);
-                if (client.fd > maxfd) maxfd = client.fd;
+        lobby.journal.flush();
+        if (now_ms() - s.last_housekeeping >= 1000) {
+            s.last_housekeeping = now_ms();
+            for (uint64_t first : lobby.compactor.take_done()) lobby.journal.adopt_cold(first);
+            lobby.journal.enforce_retention(s.retain_age_ms, s.retain_bytes, lobby.acks.oldest_pending(s.last_housekeeping));
+            lobby.journal.reap_snapshot();
+            lobby.typing.expire(s.last_housekeeping);
+            lobby.stats.roll(s.last_housekeeping);
+            lobby.reserved_nicks.expire(*lobby.nicks, s.last_housekeeping);
+            for (auto it = lobby.msg_buckets.begin(); it != lobby.msg_buckets.end();) {
+                if (msg_bucket_full(it->second.first, it->second.second, s.last_housekeeping)) {
+                    it = lobby.msg_buckets.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            s.actors.rebalance(s.last_housekeeping);
+            for (auto it = lobby.transfers.begin(); it != lobby.transfers.end();) {
+                auto cur = it++;
+                if (s.last_housekeeping - cur->second.last_active > TRANSFER_TIMEOUT_MS) {
+                    lobby.end_transfer(cur, "expired");
+                }
+            }
+            if (!s.follow_path.empty() && s.listenfd < 0 && s.primary.fd < 0) {
+                // promoted: keep trying until the primary's port is free
+                s.listenfd = create_and_bind(s.host, s.port);
+                if (s.listenfd >= 0 && s.acceptor.start(s.listenfd, *lobby.nicks, lobby.reserved_nicks)) {
+                    std::cout << "[x] Promoted at sequence " << lobby.journal.next_seq()
+                              << ", listening on " << s.host << ":" << s.port << std::endl;
+                }
             }
+            if (!s.follow_path.empty() && s.tls_ctx && s.tls_listenfd < 0 && s.primary.fd < 0) {
+                s.tls_listenfd = create_and_bind(s.tls_host, s.tls_port);
+            }
+            if (!s.follow_path.empty() && !s.ws_addr.empty() && s.ws_listenfd < 0 && s.primary.fd < 0) {
+                s.ws_listenfd = create_and_bind(s.ws_host, s.ws_port);
+            }
+            if (!s.upstream_addr.empty() && s.primary.fd < 0
+                && s.primary.connect_relay(s.upstream_addr, s.relay_from(), s.advertise, s.relay_secret)) {
+                std::cout << "Reconnecting to upstream " << s.upstream_addr << std::endl;
+            }
+            if (lobby.journal.enabled() && s.snapshot_ms && s.last_housekeeping - s.last_snapshot >= s.snapshot_ms
+                && lobby.journal.start_snapshot(save_state(s))) {
+                s.last_snapshot = s.last_housekeeping;
+            }
+        }
+        if (promote_requested && s.primary.fd >= 0 && !s.follow_path.empty()) {
+            std::cout << "Promotion requested, detaching from primary" << std::endl;
+            s.primary.close_link();
+            s.last_housekeeping = 0;
+        }
+        promote_requested = 0;
+
+        for (int fd : closed_fds) poller.forget(fd);
+        closed_fds.clear();
+        poller.begin();
+        for (int fd : {s.acceptor.wake_fd(), s.tls_listenfd, s.ws_listenfd, s.repl_listenfd, s.admin_listenfd,
+                       s.actors.wake_fd(), s.peers.wake_fd()}) {
+            poller.want(fd, true, false);
+        }
+        poller.want(s.primary.fd, !s.primary.connecting, s.primary.connecting);
+        for (auto &client : clients) {
+            if (client.fd >= 0) poller.want(client.fd, !client.room_closing, has_pending(client, lobby));
+        }
+        bool subscribers_behind = false;
+        for (auto &sub : subscribers) {
+            poller.want(sub.fd, true, false);
+            subscribers_behind |= sub.cursor < lobby.log.head();
+        }
+
+        bool transfers_throttled = false;
+        for (auto &entry : lobby.transfers) {
+            Transfer &t = entry.second;
+            if (!t.running()) continue;
+            t.refill(now_ms(), lobby.transfer_rate);
+            poller.want(t.src, t.moved_in < t.size && t.in_pipe < TRANSFER_PIPE_SIZE && t.allowance > 0, false);
+            poller.want(t.dst, false, t.in_pipe > 0);
+            transfers_throttled |= t.throttled();
         }
 
-        int rc = select(maxfd + 1, &readfds, nullptr, nullptr, nullptr);
-        if (rc < 0) {
+        int tick_ms = 1000;
+        if (lobby.reactions.has_dirty()) tick_ms = REACTION_FLUSH_MS;
+        if (subscribers_behind || transfers_throttled) tick_ms = SUBSCRIBER_FLUSH_MS;
+        if (poller.wait(tick_ms) < 0) {
             if (errno == EINTR) continue;
-            perror("select");
+            perror(poller.name());
             break;
         }
+        uint64_t pass_start = now_ms();
+        bool refusing = lobby.overload.level >= REFUSE_CONNECTIONS;
+        s.acceptor.refusing = refusing;
+
+        if (s.primary.connecting && poller.writable(s.primary.fd) && !s.primary.on_connected()) {
+            std::cout << "Failed to connect to upstream: " << strerror(errno) << std::endl;
+            s.primary.close_link();
+        }
+        if (s.primary.fd >= 0 && poller.readable(s.primary.fd) && !s.primary.on_readable(lobby)) {
+            s.primary.close_link();
+            if (!s.follow_path.empty() && s.primary.connect_local(s.follow_path, lobby.journal.next_seq())) {
+                // the primary is still there and dropped us, e.g. for lagging
+                std::cout << "Primary closed the link, resuming at sequence " << lobby.journal.next_seq()
+                          << std::endl;
+            } else if (!s.follow_path.empty()) {
+                std::cout << "Lost primary, promoting" << std::endl;
+                s.last_housekeeping = 0;
+            } else if (!s.primary.redirect.empty()) {
+                std::string to = s.primary.redirect;
+                std::cout << "Redirected to relay " << to << std::endl;
+                if (!s.primary.connect_relay(to, s.relay_from(), s.advertise, s.relay_secret)) s.primary.close_link();
+            } else {
+                std::cout << "Lost upstream " << s.upstream_addr << ", reconnecting" << std::endl;
+            }
+        }
+
+        if (s.admin_listenfd >= 0 && poller.readable(s.admin_listenfd)) {
+            int cfd = accept(s.admin_listenfd, nullptr, nullptr);
+            if (cfd >= 0 && !refuse_unwatchable(cfd)) {
+                set_nonblocking(cfd);
+                clients.emplace_back(cfd, next_client_id++, lobby.log.head());
+                clients.back().admin = true;
+                clients.back().registered = true;
+                clients.back().nick = "<admin>";
+            }
+        }
 
-        // new connection
-        if (FD_ISSET(listenfd, &readfds)) {
-            struct sockaddr_storage sa;
-            socklen_t sl = sizeof(sa);
-            int cfd = accept(listenfd, (struct sockaddr*)&sa, &sl);
-            if (cfd >= 0) {
-                clients.emplace_back(cfd);
-                const char *g = "HELLO 1.0\n";
-                send(cfd, g, strlen(g), 0);
+        if (s.repl_listenfd >= 0 && poller.readable(s.repl_listenfd)) {
+            int cfd = accept(s.repl_listenfd, nullptr, nullptr);
+            if (cfd >= 0 && !refuse_unwatchable(cfd)) {
+                set_nonblocking(cfd);
+                clients.emplace_back(cfd, next_client_id++, lobby.log.head());
+                clients.back().replica_link = true;
+                clients.back().nick = "<standby>";
+            }
+        }
+
+        // connections greeted (and usually registered) by the acceptor thread
+        Handoff h;
+        while (s.acceptor.wake_fd() >= 0 && poller.readable(s.acceptor.wake_fd()) && s.acceptor.take(h)) {
+            if (refuse_unwatchable(h.fd)) {
+                if (!h.nick.empty()) lobby.reserved_nicks.release(*lobby.nicks, h.nick, h.id);
+                continue;
+            }
+            clients.emplace_back(h.fd, h.id, lobby.log.head());
+            Client &client = clients.back();
+            client.inbuf = std::move(h.inbuf);
+            if (!h.nick.empty()) {
+                client.nick = h.nick;
+                client.nick_hash = hash_nick(h.nick);
+                client.registered = true;
+                restore_msg_bucket(lobby, client);
+            }
+            if (client.inbuf.find('\n') != std::string::npos) process_client_data(client, lobby);
+        }
+        if (s.tls_listenfd >= 0 && poller.readable(s.tls_listenfd)) {
+            int cfd = accept(s.tls_listenfd, nullptr, nullptr);
+            if (cfd >= 0 && refusing) {
+                refuse_connection(cfd, nullptr);
+                cfd = -1;
+            } else if (cfd >= 0 && refuse_unwatchable(cfd)) {
+                cfd = -1;
+            }
+            SSL *ssl = cfd >= 0 ? SSL_new(s.tls_ctx) : nullptr;
+            if (ssl) {
+                set_nonblocking(cfd);
+                SSL_set_fd(ssl, cfd);
+                SSL_set_accept_state(ssl);
+                clients.emplace_back(cfd, next_client_id++, lobby.log.head());
+                clients.back().tls = std::make_shared<TlsSession>(ssl);
+                // held back by has_pending() until the handshake is done
+                send_response(clients.back(), "HELLO 1.0\n");
+            } else if (cfd >= 0) {
+                close(cfd);
+            }
+        }
+        if (s.ws_listenfd >= 0 && poller.readable(s.ws_listenfd)) {
+            int cfd = accept(s.ws_listenfd, nullptr, nullptr);
+            if (cfd >= 0 && refusing) {
+                refuse_connection(cfd, "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n"
+                                       "Connection: close\r\n\r\n");
+            } else if (cfd >= 0 && !refuse_unwatchable(cfd)) {
+                set_nonblocking(cfd);
+                clients.emplace_back(cfd, next_client_id++, lobby.ws_log.head());
+                clients.back().websocket = true;  // HELLO follows the upgrade
             }
         }
 
         // iterate clients
-        std::vector<int> to_remove;
         for (size_t i = 0; i < clients.size(); ++i) {
             Client &client = clients[i];
             if (client.fd < 0) continue;
-            if (!FD_ISSET(client.fd, &readfds)) continue;
+            if (!poller.readable(client.fd)) continue;
+            if (client.tls && client.tls->handshaking) {
+                if (!client.tls->handshake()) {
+                    drop_client(client, "TLS handshake failed");
+                } else if (!client.tls->handshaking) {
+                    std::cout << "TLS session on fd " << client.fd << " using "
+                              << (client.tls->ktls_tx && client.tls->ktls_rx ? "kernel TLS"
+                                  : client.tls->ktls_tx ? "kernel TLS for sends" : "user-space TLS")
+                              << std::endl;
+                }
+                continue;
+            }
             ssize_t n = recv_into(client);
+            if (n <= 0 && !client.room.empty()) {
+                // the room's worker may still be writing; it closes via LEFT
+                if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                    lobby.actors->leave(client, true);
+                }
+                continue;
+            }
             if (n == 0) {
                 std::cout << "Client " << client.nick << " has disconnected." << std::endl;
-                close(client.fd);
+                close_watched(client.fd);
                 client.fd = -1;
-                to_remove.push_back(i);
                 continue;
             } else if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
                 std::cerr << "Error reading from client " << client.nick << ". Closing connection." << std::endl;
-                close(client.fd);
+                close_watched(client.fd);
                 client.fd = -1;
-                to_remove.push_back(i);
                 continue;
             } else {
-                process_client_data(client, clients);
+                const char *why;
+                if (client.websocket && !ws_receive(client, why)) {
+                    drop_client(client, why);
+                    continue;
+                }
+                process_client_data(client, lobby);
             }
         }
 
-        // cleanup closed clients (remove entries with fd == -1)
-        if (!to_remove.empty()) {
-            std::sort(to_remove.begin(), to_remove.end(), std::greater<int>());
-            for (int idx : to_remove) {
-                if (idx >= 0 && idx < (int)clients.size()) {
-                    if (clients[idx].fd >= 0) close(clients[idx].fd);
-                    clients.erase(clients.begin() + idx);
+        for (auto it = lobby.transfers.begin(); it != lobby.transfers.end();) {
+            auto cur = it++;
+            Transfer &t = cur->second;
+            if (!t.running()) continue;
+            if (!t.pump(poller.readable(t.src), poller.writable(t.dst))) {
+                std::cerr << "Transfer " << t.id << " failed after " << t.moved_out << " bytes" << std::endl;
+                lobby.end_transfer(cur, "failed");
+            } else if (t.moved_out == t.size) {
+                std::cout << "Transfer " << t.id << " done" << std::endl;
+                lobby.end_transfer(cur, "done");
+            }
+        }
+
+        int reaction_flush_ms = lobby.overload.level >= SLOW_AGGREGATES ? REACTION_SLOW_FLUSH_MS : REACTION_FLUSH_MS;
+        uint64_t next_seq = lobby.journal.next_seq();
+        lobby.reactions.expire(next_seq > REACTION_WINDOW ? next_seq - REACTION_WINDOW : 0);
+        if (lobby.reactions.has_dirty() && now_ms() - s.last_reaction_flush >= (uint64_t)reaction_flush_ms) {
+            s.last_reaction_flush = now_ms();
+            for (const std::string &line : lobby.reactions.take_dirty()) publish(lobby, line);
+        }
+
+        // replies addressed to another client (transfer offers and results)
+        for (auto &d : lobby.direct) {
+            for (auto &client : clients) {
+                if (client.fd < 0 || client.id != d.first) continue;
+                if (!client.room.empty()) {
+                    lobby.actors->reply(client, d.second);
+                } else {
+                    send_response(client, d.second);
+                }
+            }
+        }
+        lobby.direct.clear();
+
+        // mail from the room workers, and mail that did not fit their inboxes
+        if (s.actors.wake_fd() >= 0 && poller.readable(s.actors.wake_fd())) s.actors.drain(clients, lobby);
+        s.actors.retry();
+
+        // lines broadcast by the other worker processes
+        if (s.peers.wake_fd() >= 0 && poller.readable(s.peers.wake_fd())) {
+            s.peers.drain([&](const std::string &line) { broadcast(lobby, line, 0, true); },
+                        [&](size_t) { publish(lobby, "LOST\n"); });
+        }
+
+        // subscriber input is only drained, to notice when they go away
+        for (auto &sub : subscribers) {
+            if (!poller.readable(sub.fd)) continue;
+            char scratch[512];
+            ssize_t n = recv(sub.fd, scratch, sizeof(scratch), 0);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                close_watched(sub.fd);
+                sub.fd = -1;
+            }
+        }
+
+        // flush replies and new log entries, then release what all cursors passed
+        lobby.journal.flush();
+        uint64_t min_cursor = lobby.log.head();
+        uint64_t ws_min_cursor = lobby.ws_log.head();
+        uint64_t id_min_cursor = lobby.id_log.head();
+        uint64_t seq_min_cursor = lobby.seq_log.head();
+        if (now_ms() - s.last_subscriber_flush >= (uint64_t)SUBSCRIBER_FLUSH_MS) {
+            s.last_subscriber_flush = now_ms();
+            for (auto &sub : subscribers) {
+                if (sub.fd < 0) continue;
+                if (lobby.log.head() - sub.cursor > LOG_MAX_LAG
+                    || !flush_log(sub.fd, sub.cursor, SUBSCRIBER_READER, lobby.log)) {
+                    std::cerr << "Dropping subscriber on fd " << sub.fd << std::endl;
+                    close_watched(sub.fd);
+                    sub.fd = -1;
+                }
+            }
+        }
+        for (auto &sub : subscribers) {
+            if (sub.fd >= 0) min_cursor = std::min(min_cursor, sub.cursor);
+        }
+        for (auto &client : clients) {
+            if (client.fd >= 0 && has_pending(client, lobby)) {
+                // bulk history is paced on purpose; only the wait after it counts
+                if (!client.pending_since || !client.history.empty()) client.pending_since = pass_start;
+                flush_client(client, lobby);
+                if (client.fd >= 0 && !has_pending(client, lobby)) {
+                    lobby.overload.sample_delay(now_ms() - client.pending_since);
+                    client.pending_since = 0;
+                }
+                // resume input held back by process_client_data()
+                if (client.fd >= 0 && client.history.empty() && client.inbuf.find('\n') != std::string::npos) {
+                    process_client_data(client, lobby);
                 }
             }
+            if (client.fd < 0 || !client.reads_log()) continue;
+            if (client.follower) {
+                seq_min_cursor = std::min(seq_min_cursor, client.cursor);
+            } else if (client.websocket) {
+                ws_min_cursor = std::min(ws_min_cursor, client.cursor);
+            } else if (client.ids) {
+                id_min_cursor = std::min(id_min_cursor, client.cursor);
+            } else {
+                min_cursor = std::min(min_cursor, client.cursor);
+            }
+        }
+        lobby.log.trim(min_cursor);
+        lobby.ws_log.trim(ws_min_cursor);
+        lobby.id_log.trim(id_min_cursor);
+        lobby.seq_log.trim(seq_min_cursor);
+
+        // cleanup closed clients (remove entries with fd == -1)
+        for (auto &client : clients) {
+            if (client.fd < 0 && client.relay_link) lobby.relays.erase(client.id);
+            if (client.fd < 0 && client.registered) {
+                keep_msg_bucket(lobby, client);
+                lobby.reserved_nicks.release(*lobby.nicks, client.nick, client.id);
+                lobby.typing.stop(client.id, client.nick);
+            }
+            if (client.fd >= 0 && client.transfer && client.outbuf.empty()) attach_transfer(client, lobby);
+            // a subscriber is written with raw sendmsg(), so a TLS one needs kTLS
+            if (client.fd >= 0 && client.subscribing && client.outbuf.empty()
+                && (!client.tls || (client.tls->ktls_tx && client.tls->out.empty()))) {
+                subscribers.push_back(Subscriber{client.fd, client.cursor});
+                client.fd = -1;
+            }
+        }
+        subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(),
+                                         [](const Subscriber &s) { return s.fd < 0; }),
+                          subscribers.end());
+        clients.erase(std::remove_if(clients.begin(), clients.end(),
+                                     [](const Client &c) { return c.fd < 0; }),
+                      clients.end());
+        lobby.member_count = clients.size() + subscribers.size();
+        s.peers.notify();
+
+        lobby.overload.sample_lag(now_ms() - pass_start);
+        if (lobby.overload.update(now_ms())) {
+            std::cout << "Overload level " << lobby.overload.level << " (loop lag "
+                      << lobby.overload.last_lag << " ms, queue delay " << lobby.overload.last_delay
+                      << " ms)" << std::endl;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    std::string journal_dir;
+    uint64_t retain_age_ms = 0, retain_bytes = 0;
+    size_t warm_segments = JOURNAL_WARM_SEGMENTS;
+    uint64_t snapshot_ms = 60 * 1000;
+    std::string repl_listen_path, follow_path, upstream_addr;
+    size_t max_relays = 8;
+    std::string mcast_group, mcast_if;
+    std::string tls_addr, tls_cert, tls_key, ws_addr, admin_path, secret_path;
+    uint64_t transfer_rate = TRANSFER_DEFAULT_RATE;
+    size_t room_workers = 0, worker_procs = 0;
+    bool use_epoll = true;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:R:S:W:P:A:F:U:B:k:M:I:T:C:K:G:X:a:w:p:e:")) != -1) {
+        switch (opt) {
+        case 'j': journal_dir = optarg; break;
+        case 'R': retain_age_ms = strtoull(optarg, nullptr, 10) * 24 * 3600 * 1000; break;
+        case 'S': retain_bytes = strtoull(optarg, nullptr, 10) * 1024 * 1024; break;
+        case 'W': warm_segments = strtoul(optarg, nullptr, 10); break;
+        case 'P': snapshot_ms = strtoull(optarg, nullptr, 10) * 1000; break;
+        case 'A': repl_listen_path = optarg; break;
+        case 'F': follow_path = optarg; break;
+        case 'U': upstream_addr = optarg; break;
+        case 'B': max_relays = strtoul(optarg, nullptr, 10); break;
+        case 'M': mcast_group = optarg; break;
+        case 'I': mcast_if = optarg; break;
+        case 'T': tls_addr = optarg; break;
+        case 'C': tls_cert = optarg; break;
+        case 'K': tls_key = optarg; break;
+        case 'G': ws_addr = optarg; break;
+        case 'X': transfer_rate = strtoull(optarg, nullptr, 10) * 1024; break;
+        case 'a': admin_path = optarg; break;
+        case 'k': secret_path = optarg; break;
+        case 'w': room_workers = strtoul(optarg, nullptr, 10); break;
+        case 'p': worker_procs = strtoul(optarg, nullptr, 10); break;
+        case 'e':
+            use_epoll = strcmp(optarg, EpollPoller::name()) == 0;
+            if (!use_epoll && strcmp(optarg, SelectPoller::name()) != 0) optind = argc + 1;
+            break;
+        default: optind = argc + 1; break;
+        }
+    }
+    if (optind != argc - 1) {
+        std::cerr << "Usage: " << argv[0] << " [-j journal_dir] [-R retain_days] [-S retain_MiB]"
+                  << " [-W warm_segments] [-P snapshot_secs] [-A repl_socket] [-F primary_repl_socket]"
+                  << " [-U upstream_host:port] [-B max_relays] [-k relay_secret_file] [-M group:port [-I ifaddr]]"
+                  << " [-T tls_bindaddr:port -C cert.pem -K key.pem] [-G ws_bindaddr:port]"
+                  << " [-X transfer_KiB_per_sec] [-a admin_socket] [-w room_workers] [-p worker_procs]"
+                  << " [-e select|epoll] <bindaddr:port>\n";
+        flush_stderr();
+        return 1;
+    }
+    if (!follow_path.empty() && journal_dir.empty()) {
+        std::cerr << "Standby mode (-F) needs a journal (-j)\n";
+        flush_stderr();
+        return 1;
+    }
+    if (!follow_path.empty() && !upstream_addr.empty()) {
+        std::cerr << "A server is either a standby (-F) or a relay (-U)\n";
+        flush_stderr();
+        return 1;
+    }
+    std::string relay_secret;
+    if (!secret_path.empty()) {
+        int fd = open(secret_path.c_str(), O_RDONLY);
+        char buf[256];
+        ssize_t n = fd >= 0 ? read(fd, buf, sizeof(buf)) : -1;
+        if (fd >= 0) close(fd);
+        if (n > 0) relay_secret.assign(buf, n);
+        chomp(relay_secret);
+    }
+    if ((!secret_path.empty() || !upstream_addr.empty()) && relay_secret.empty()) {
+        std::cerr << "A relay (-U) needs the relay secret (-k), which must not be empty\n";
+        flush_stderr();
+        return 1;
+    }
+    if (worker_procs > MAX_WORKER_PROCS) {
+        std::cerr << "At most " << MAX_WORKER_PROCS << " worker processes (-p)\n";
+        flush_stderr();
+        return 1;
+    }
+    // the journal, followers, multicast, the admin socket and rooms all
+    // assume one process owns the lobby
+    if (worker_procs && (!journal_dir.empty() || !follow_path.empty() || !repl_listen_path.empty()
+                         || !upstream_addr.empty() || !secret_path.empty() || !mcast_group.empty()
+                         || !admin_path.empty() || room_workers)) {
+        std::cerr << "Worker processes (-p) cannot be combined with -j, -F, -A, -U, -k, -M, -a or -w\n";
+        flush_stderr();
+        return 1;
+    }
+    signal(SIGUSR1, handle_sigusr1);
+
+    std::string host, port;
+    if (!split_hostport(argv[optind], host, port)) {
+        std::cerr << "Bad bind address\n";
+        flush_stderr();
+        return 1;
+    }
+    std::string tls_host, tls_port;
+    SSL_CTX *tls_ctx = nullptr;
+    if (!tls_addr.empty()) {
+        if (!split_hostport(tls_addr, tls_host, tls_port) || tls_cert.empty() || tls_key.empty()) {
+            std::cerr << "TLS (-T) needs tls_bindaddr:port, a certificate (-C) and a key (-K)\n";
+            flush_stderr();
+            return 1;
+        }
+        tls_ctx = create_tls_context(tls_cert, tls_key);
+        if (!tls_ctx) {
+            std::cerr << "Failed to load TLS certificate " << tls_cert << "\n";
+            flush_stderr();
+            return 1;
+        }
+    }
+
+    // a standby only binds the client port once it is promoted
+    std::string ws_host, ws_port;
+    if (!ws_addr.empty() && !split_hostport(ws_addr, ws_host, ws_port)) {
+        std::cerr << "Bad WebSocket bind address\n";
+        flush_stderr();
+        return 1;
+    }
+
+    PeerRings peers;
+    if (worker_procs) {
+        if (!peers.create(worker_procs)) {
+            std::cerr << "Failed to map the worker rings\n";
+            flush_stderr();
+            return 1;
         }
+        std::cout << "[x] " << worker_procs << " worker processes\n";
+        supervise_workers(peers, worker_procs);
     }
 
+    ServerState s(peers);
+    s.host = host;
+    s.port = port;
+    s.tls_host = tls_host;
+    s.tls_port = tls_port;
+    s.ws_addr = ws_addr;
+    s.ws_host = ws_host;
+    s.ws_port = ws_port;
+    s.follow_path = follow_path;
+    s.upstream_addr = upstream_addr;
+    s.relay_secret = relay_secret;
+    s.advertise = host + ":" + port;
+    s.tls_ctx = tls_ctx;
+    s.retain_age_ms = retain_age_ms;
+    s.retain_bytes = retain_bytes;
+    s.snapshot_ms = snapshot_ms;
+
+    if (follow_path.empty()) {
+        bool reuseport = peers.enabled();
+        s.listenfd = create_and_bind(host, port, reuseport);
+        if (tls_ctx) s.tls_listenfd = create_and_bind(tls_host, tls_port, reuseport);
+        if (!ws_addr.empty()) s.ws_listenfd = create_and_bind(ws_host, ws_port, reuseport);
+        if (s.listenfd < 0 || (tls_ctx && s.tls_listenfd < 0) || (!ws_addr.empty() && s.ws_listenfd < 0)) {
+            std::cerr << "Failed to bind\n";
+            flush_stderr();
+            return 1;
+        }
+    }
+
+    Room &lobby = s.lobby;
+    lobby.name = "lobby";
+    lobby.max_relays = max_relays;
+    lobby.relay_secret = relay_secret;
+    lobby.followers = !repl_listen_path.empty() || !relay_secret.empty();
+    lobby.read_only = !upstream_addr.empty();
+    lobby.websocket = !ws_addr.empty();
+    lobby.transfer_rate = transfer_rate;
+    if (peers.enabled()) {
+        lobby.peers = &peers;
+        lobby.reserved_nicks.workers = peers.nicks();
+        lobby.reserved_nicks.worker = peers.index();
+    }
+    RoomActors &actors = s.actors;
+    if (room_workers) {
+        if (!actors.start(room_workers)) {
+            std::cerr << "Failed to start room workers\n";
+            flush_stderr();
+            return 1;
+        }
+        lobby.actors = &actors;
+        std::cout << "[x] " << room_workers << " room workers" << std::endl;
+    }
+    if (!mcast_group.empty()) {
+        lobby.mcast_fd = create_multicast_sender(mcast_group, mcast_if, lobby.mcast_addr);
+        if (lobby.mcast_fd < 0) {
+            std::cerr << "Bad multicast group " << mcast_group << "\n";
+            flush_stderr();
+            return 1;
+        }
+        std::cout << "[x] Publishing to multicast group " << mcast_group << "\n";
+    }
+    if (!journal_dir.empty()) {
+        uint64_t t0 = now_ms();
+        if (!lobby.journal.open_dir(journal_dir)) {
+            std::cerr << "Failed to open journal " << journal_dir << "\n";
+            flush_stderr();
+            return 1;
+        }
+        lobby.search.start(journal_dir);
+        lobby.compactor.start(journal_dir, warm_segments);
+        std::cout << "[x] Journal " << journal_dir << " at sequence " << lobby.journal.next_seq()
+                  << ", loaded in " << now_ms() - t0 << " ms\n";
+        restore_state(s, lobby.journal.restored_state());
+    }
+
+    if (!repl_listen_path.empty()) {
+        s.repl_listenfd = create_unix_listener(repl_listen_path);
+        if (s.repl_listenfd < 0) {
+            std::cerr << "Failed to listen on " << repl_listen_path << "\n";
+            flush_stderr();
+            return 1;
+        }
+        std::cout << "[x] Accepting standbys on " << repl_listen_path << "\n";
+    }
+
+    if (!admin_path.empty()) {
+        s.admin_listenfd = create_unix_listener(admin_path);
+        if (s.admin_listenfd < 0) {
+            std::cerr << "Failed to listen on " << admin_path << "\n";
+            flush_stderr();
+            return 1;
+        }
+        std::cout << "[x] Admin interface on " << admin_path << "\n";
+    }
+
+    UpstreamLink &primary = s.primary;
+    if (!upstream_addr.empty()) {
+        if (!primary.connect_relay(upstream_addr, s.relay_from(), s.advertise, relay_secret)) {
+            std::cerr << "Failed to connect to upstream " << upstream_addr << "\n";
+            flush_stderr();
+            return 1;
+        }
+        std::cout << "[x] Relaying " << upstream_addr << ", listening on " << host << ":" << port << "\n";
+    } else if (!follow_path.empty()) {
+        if (!primary.connect_local(follow_path, lobby.journal.next_seq())) {
+            std::cerr << "Failed to connect to primary at " << follow_path << "\n";
+            flush_stderr();
+            return 1;
+        }
+        std::cout << "[x] Standby of " << follow_path << " from sequence " << lobby.journal.next_seq() << "\n";
+    } else if (peers.enabled()) {
+        std::cout << "[x] Worker " << peers.index() << " (pid " << getpid() << ") listening on "
+                  << host << ":" << port << "\n";
+    } else {
+        std::cout << "[x] Listening on " << host << ":" << port << "\n";
+    }
+    if (s.tls_listenfd >= 0) std::cout << "[x] Listening for TLS on " << tls_host << ":" << tls_port << "\n";
+    if (s.ws_listenfd >= 0) std::cout << "[x] Listening for WebSocket on " << ws_host << ":" << ws_port << "\n";
+    flush_stdout();
+
+    Acceptor &acceptor = s.acceptor;
+    if (s.listenfd >= 0 && !acceptor.start(s.listenfd, *lobby.nicks, lobby.reserved_nicks)) {
+        std::cerr << "Failed to start the acceptor thread\n";
+        flush_stderr();
+        return 1;
+    }
+
+    s.last_housekeeping = now_ms();
+    s.last_snapshot = s.last_housekeeping;
+    // the loop is compiled once per event backend; the choice is made once, here
+    if (use_epoll) {
+        EpollPoller poller;
+        if (!poller.ok()) {
+            perror("epoll_create1");
+            return 1;
+        }
+        serve_loop(s, poller);
+    } else {
+        SelectPoller poller;
+        serve_loop(s, poller);
+    }
+
+
     // cleanup all
-    for (auto &client : clients) {
+    acceptor.stop();
+    actors.stop();  // workers never close member sockets
+    for (auto &client : s.clients) {
         if (client.fd >= 0) close(client.fd);
     }
-    if (listenfd >= 0) close(listenfd);
+    for (auto &sub : s.subscribers) close(sub.fd);
+    for (auto &entry : lobby.transfers) entry.second.close_fds();
+    if (s.listenfd >= 0) close(s.listenfd);
+    if (s.tls_listenfd >= 0) close(s.tls_listenfd);
+    if (s.ws_listenfd >= 0) close(s.ws_listenfd);
+    if (s.repl_listenfd >= 0) close(s.repl_listenfd);
+    if (s.admin_listenfd >= 0) close(s.admin_listenfd);
+    s.clients.clear();
+    if (tls_ctx) SSL_CTX_free(tls_ctx);
     std::cout << "Server shutting down\n";
     flush_stdout();
     return 0;
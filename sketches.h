@@ -0,0 +1,149 @@
+// Fixed-memory traffic sketches for operations, fed from the MSG path with
+// the sender's nick hash (computed once, at NICK).
+//
+// Heavy hitters: a Count-Min sketch (SKETCH_DEPTH rows of SKETCH_WIDTH
+// counters, indexes derived from one 64-bit hash) estimates each sender's
+// count. SKETCH_TOP candidates keep the largest estimates, SpaceSaving style:
+// a sender that is not a candidate replaces the smallest one once its
+// estimate exceeds it. Candidates are found through a small open-addressing
+// index, so a MSG costs the sketch increments and one probe; the candidates
+// are only scanned when a non-candidate's estimate passes min_count.
+#ifndef SKETCHES_H
+#define SKETCHES_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+static const size_t SKETCH_DEPTH = 4;
+static const size_t SKETCH_WIDTH = 2048;
+static const size_t SKETCH_TOP = 32;
+static const size_t SKETCH_INDEX = 64;  // power of two, over twice SKETCH_TOP
+static const uint64_t SKETCH_WINDOW_MS = 60 * 1000;
+
+inline uint64_t hash_nick(const std::string &nick) {
+    uint64_t h = 1469598103934665603ULL;  // FNV-1a, then a final mix
+    for (unsigned char c : nick) h = (h ^ c) * 1099511628211ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    return h ^ (h >> 33);
+}
+
+class HeavyHitters {
+public:
+    HeavyHitters() { clear(); }
+
+    void add(uint64_t h, const std::string &nick) {
+        uint32_t est = UINT32_MAX;
+        uint64_t h2 = (h >> 32) | 1;
+        for (size_t row = 0; row < SKETCH_DEPTH; ++row) {
+            uint32_t &c = counts[row][(h + row * h2) & (SKETCH_WIDTH - 1)];
+            est = std::min(est, ++c);
+        }
+        int i = find(h);
+        if (i >= 0) {
+            top[i].count = est;
+            return;
+        }
+        if (ntop < SKETCH_TOP) {
+            top[ntop] = Candidate{h, est, nick};
+            index_add(h, (int)ntop++);
+            return;
+        }
+        if (est <= min_count) return;
+        // candidates only grow, so min_count may be stale-low: check the
+        // actual smallest before replacing it
+        size_t lo = smallest();
+        min_count = top[lo].count;
+        if (est <= min_count) return;
+        top[lo] = Candidate{h, est, nick};
+        memset(index, -1, sizeof(index));
+        for (size_t k = 0; k < ntop; ++k) index_add(top[k].hash, (int)k);
+        min_count = top[smallest()].count;
+    }
+
+    std::vector<std::pair<std::string, uint32_t>> largest(size_t n) const {
+        std::vector<std::pair<std::string, uint32_t>> out;
+        for (size_t i = 0; i < ntop; ++i) out.emplace_back(top[i].nick, top[i].count);
+        std::sort(out.begin(), out.end(), [](const auto &a, const auto &b) { return a.second > b.second; });
+        if (out.size() > n) out.resize(n);
+        return out;
+    }
+
+    void clear() {
+        memset(counts, 0, sizeof(counts));
+        memset(index, -1, sizeof(index));
+        ntop = 0;
+        min_count = 0;
+    }
+
+private:
+    struct Candidate {
+        uint64_t hash;
+        uint32_t count;
+        std::string nick;
+    };
+
+    int find(uint64_t h) const {
+        for (size_t i = h & (SKETCH_INDEX - 1);; i = (i + 1) & (SKETCH_INDEX - 1)) {
+            if (index[i] < 0 || top[index[i]].hash == h) return index[i];
+        }
+    }
+
+    void index_add(uint64_t h, int k) {
+        size_t i = h & (SKETCH_INDEX - 1);
+        while (index[i] >= 0) i = (i + 1) & (SKETCH_INDEX - 1);
+        index[i] = (int8_t)k;
+    }
+
+    size_t smallest() const {
+        size_t lo = 0;
+        for (size_t i = 1; i < ntop; ++i) {
+            if (top[i].count < top[lo].count) lo = i;
+        }
+        return lo;
+    }
+
+    uint32_t counts[SKETCH_DEPTH][SKETCH_WIDTH];
+    Candidate top[SKETCH_TOP];
+    int8_t index[SKETCH_INDEX];  // candidate by hash, -1 = empty
+    size_t ntop = 0;
+    uint32_t min_count = 0;  // at most the smallest candidate count once the list is full
+};
+
+// Distinct senders: HyperLogLog with 2^HLL_BITS one-byte registers (about
+// 1.6% standard error), with linear counting for small cardinalities.
+static const int HLL_BITS = 12;
+
+class HyperLogLog {
+public:
+    void add(uint64_t h) {
+        uint8_t rank = (uint8_t)__builtin_clzll((h << HLL_BITS) | (1ULL << (HLL_BITS - 1))) + 1;
+        uint8_t &r = regs[h >> (64 - HLL_BITS)];
+        if (rank > r) r = rank;
+    }
+
+    uint64_t estimate() const {
+        const double m = 1 << HLL_BITS;
+        double sum = 0;
+        size_t zeros = 0;
+        for (uint8_t r : regs) {
+            sum += std::ldexp(1.0, -r);
+            zeros += r == 0;
+        }
+        double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+        if (e <= 2.5 * m && zeros) e = m * std::log(m / zeros);
+        return (uint64_t)(e + 0.5);
+    }
+
+    void clear() { memset(regs, 0, sizeof(regs)); }
+
+private:
+    uint8_t regs[1 << HLL_BITS] = {};
+};
+
+#endif
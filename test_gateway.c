@@ -0,0 +1,48 @@
+// Gateway test for WebSocket clients: runs ./cserverd with a journal and a
+// WebSocket listener and checks that a RELIABLE client gets its RESEND
+// backlog and the live lines after it as whole text frames.
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "check.h"
+#include "test_net.h"
+
+int main() {
+    signal(SIGPIPE, SIG_IGN);
+    char dir[] = "/tmp/test_gateway.XXXXXX";
+    CHECK(mkdtemp(dir));
+    int port = 20000 + getpid() % 20000;
+    int ws_port = port + 1;
+
+    atexit(stop_server);
+    start_server({"-j", dir, "-G", "127.0.0.1:" + std::to_string(ws_port), "127.0.0.1:" + std::to_string(port)});
+    Conn c = connect_to(port);
+    login(c, "c");
+    send_line(c, "IDS");
+    expect(c, "OK");
+    for (uint64_t i = 1; i <= 3; ++i) {
+        send_line(c, "MSG line " + std::to_string(i));
+        CHECK(next_id(c) == i);
+    }
+
+    Conn w = connect_ws(ws_port);
+    login(w, "w");
+    send_line(w, "RELIABLE 0");
+    CHECK(expect(w, "RESEND ") == "RESEND 1 3");
+    for (int i = 1; i <= 3; ++i) {
+        std::string line = expect(w, "");
+        CHECK(line.find("line " + std::to_string(i)) != std::string::npos);
+    }
+    send_line(c, "MSG live");
+    CHECK(next_id(w) == 4);
+    send_line(w, "ACK 4");
+    send_line(w, "RELIABLE");
+    CHECK(expect(w, "ERROR") == "ERROR: Already in reliable mode");
+    stop_server();
+
+    std::string rm = std::string("rm -rf ") + dir;
+    CHECK(system(rm.c_str()) == 0);
+    printf("test_gateway: ok\n");
+    return 0;
+}
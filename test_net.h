@@ -0,0 +1,158 @@
+// Helpers for the tests that run ./cserverd and talk to it over TCP or
+// WebSocket: start and stop the server, connect, send a line, wait for one.
+#ifndef TEST_NET_H
+#define TEST_NET_H
+
+#include <arpa/inet.h>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "check.h"
+
+static pid_t server = -1;
+
+// also when a CHECK fails (atexit)
+static void stop_server() {
+    if (server <= 0) return;
+    kill(server, SIGKILL);
+    waitpid(server, nullptr, 0);
+    server = -1;
+}
+
+// Runs ./cserverd with args, its stdout to /dev/null.
+static void start_server(const std::vector<std::string> &args) {
+    server = fork();
+    if (server == 0) {
+        std::vector<char *> argv{(char *)"cserverd"};
+        for (const std::string &a : args) argv.push_back((char *)a.c_str());
+        argv.push_back(nullptr);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        execv("./cserverd", argv.data());
+        _exit(127);
+    }
+}
+
+struct Conn {
+    int fd = -1;
+    bool ws = false;
+    std::string raw;  // WebSocket bytes not decoded yet
+    std::string in;   // received text not consumed yet
+};
+
+static Conn connect_to(int port) {
+    Conn c;
+    struct sockaddr_in sa{};
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int tries = 0; tries < 50; ++tries) {
+        c.fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(c.fd, (struct sockaddr *)&sa, sizeof(sa)) == 0) return c;
+        close(c.fd);
+        usleep(100 * 1000);
+    }
+    CHECK(!"server did not come up");
+    return c;
+}
+
+static void send_raw(Conn &c, const std::string &out) {
+    CHECK(send(c.fd, out.data(), out.size(), MSG_NOSIGNAL) == (ssize_t)out.size());
+}
+
+// A WebSocket line goes as one masked text frame; the mask is zero.
+static void send_line(Conn &c, const std::string &line) {
+    std::string out = line + "\n";
+    if (c.ws) {
+        CHECK(out.size() < 126);
+        out = std::string("\x81") + (char)(0x80 | out.size()) + std::string(4, '\0') + out;
+    }
+    send_raw(c, out);
+}
+
+// Moves the payloads of complete frames in raw to in. Every frame from the
+// server must be a whole text frame, so unframed bytes fail the test.
+static void decode_frames(Conn &c) {
+    for (;;) {
+        if (c.raw.size() < 2) return;
+        CHECK((unsigned char)c.raw[0] == 0x81);
+        uint64_t len = (unsigned char)c.raw[1];
+        size_t head = 2;
+        CHECK(len < 127);
+        if (len == 126) {
+            if (c.raw.size() < 4) return;
+            len = (unsigned char)c.raw[2] << 8 | (unsigned char)c.raw[3];
+            head = 4;
+        }
+        if (c.raw.size() < head + len) return;
+        c.in.append(c.raw, head, len);
+        c.raw.erase(0, head + len);
+    }
+}
+
+// The next line that starts with prefix; lines before it are skipped.
+static std::string expect(Conn &c, const std::string &prefix) {
+    for (;;) {
+        size_t nl;
+        while ((nl = c.in.find('\n')) != std::string::npos) {
+            std::string line = c.in.substr(0, nl);
+            c.in.erase(0, nl + 1);
+            if (line.compare(0, prefix.size(), prefix) == 0) return line;
+        }
+        struct pollfd p{c.fd, POLLIN, 0};
+        CHECK(poll(&p, 1, 5000) == 1);
+        char buf[4096];
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        CHECK(n > 0);
+        if (c.ws) {
+            c.raw.append(buf, n);
+            decode_frames(c);
+        } else {
+            c.in.append(buf, n);
+        }
+    }
+}
+
+// Connects to the WebSocket listener and completes the upgrade.
+static Conn connect_ws(int port) {
+    Conn c = connect_to(port);
+    send_raw(c, "GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n");
+    std::string reply;
+    size_t end;
+    while ((end = reply.find("\r\n\r\n")) == std::string::npos) {
+        struct pollfd p{c.fd, POLLIN, 0};
+        CHECK(poll(&p, 1, 5000) == 1);
+        char buf[4096];
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        CHECK(n > 0);
+        reply.append(buf, n);
+    }
+    CHECK(reply.compare(0, 12, "HTTP/1.1 101") == 0);
+    c.ws = true;
+    c.raw = reply.substr(end + 4);
+    decode_frames(c);
+    return c;
+}
+
+static void login(Conn &c, const std::string &nick) {
+    expect(c, "HELLO");
+    send_line(c, "NICK " + nick);
+    CHECK(expect(c, "") == "OK");
+}
+
+// ID of the next MSGID line.
+static uint64_t next_id(Conn &c) {
+    return strtoull(expect(c, "MSGID ").c_str() + 6, nullptr, 10);
+}
+
+#endif
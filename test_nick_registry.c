@@ -0,0 +1,107 @@
+// Unit tests for nick_registry.h: ownership, tombstone reuse, stripe growth,
+// and lock-free lookups while writers rehash and grow the stripes.
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "nick_registry.h"
+
+static void test_ownership() {
+    NickRegistry r;
+    NickRegistry::Handle h;
+    CHECK(!r.lookup("alice", h));
+    CHECK(r.insert("alice", 2, 10));
+    CHECK(!r.insert("alice", 3, 11));
+    CHECK(r.lookup("alice", h) && h.shard == 2 && h.client == 10);
+    r.erase("alice", 11);  // not the holder
+    CHECK(r.lookup("alice", h) && h.client == 10);
+    r.erase("alice", 10);
+    CHECK(!r.lookup("alice", h));
+    CHECK(r.insert("alice", 3, 11));
+    CHECK(r.lookup("alice", h) && h.shard == 3 && h.client == 11);
+    CHECK(r.size() == 1);
+    CHECK(!r.insert("", 0, 1));
+    CHECK(!r.insert(std::string(NICK_KEY_BYTES + 1, 'x'), 0, 1));
+}
+
+// Register/release churn reuses tombstones and rehashes: the stripes never
+// grow, and each rehash reuses the table the previous one retired.
+static void test_tombstones() {
+    NickRegistry r;
+    size_t cap = r.capacity();
+    const size_t held = cap / 4;
+    for (size_t i = 0; i < held; ++i) CHECK(r.insert("n" + std::to_string(i), 0, i + 1));
+    for (size_t i = held; i < held * 20; ++i) {
+        CHECK(r.insert("n" + std::to_string(i), 0, i + 1));
+        r.erase("n" + std::to_string(i - held), i - held + 1);
+    }
+    CHECK(r.size() == held);
+    CHECK(r.capacity() == cap);
+    CHECK(r.allocated() <= cap * 2);
+    NickRegistry::Handle h;
+    for (size_t i = 0; i < held * 20; ++i) CHECK(r.lookup("n" + std::to_string(i), h) == (i >= held * 19));
+}
+
+// More nicks than the initial stripes hold: every insert succeeds.
+static void test_growth() {
+    NickRegistry r;
+    size_t cap = r.capacity();
+    const size_t n = cap * 2;
+    for (size_t i = 0; i < n; ++i) CHECK(r.insert("g" + std::to_string(i), (uint16_t)(i % 7), i + 1));
+    CHECK(r.size() == n);
+    CHECK(r.capacity() * 3 / 4 >= n);
+    NickRegistry::Handle h;
+    for (size_t i = 0; i < n; ++i) {
+        CHECK(r.lookup("g" + std::to_string(i), h));
+        CHECK(h.shard == i % 7 && h.client == i + 1);
+    }
+    CHECK(!r.lookup("absent", h));
+}
+
+// Readers look up nicks that stay registered while a writer churns other
+// nicks through the same stripes, rehashing and growing them.
+static void test_reads_during_rehash() {
+    NickRegistry r;
+    const size_t stable = 2000;
+    for (size_t i = 0; i < stable; ++i) CHECK(r.insert("s" + std::to_string(i), 1, i + 1));
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> wrong{0}, reads{0};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 3; ++t) {
+        readers.emplace_back([&, t] {
+            NickRegistry::Handle h;
+            for (size_t i = t; !stop.load(std::memory_order_relaxed); i = (i + 7) % stable) {
+                if (!r.lookup("s" + std::to_string(i), h) || h.client != i + 1 || h.shard != 1) wrong++;
+                reads++;
+            }
+        });
+    }
+    size_t cap = r.capacity();
+    uint64_t next = stable + 1;
+    for (int round = 0; round < 4; ++round) {
+        std::vector<uint64_t> ids;
+        for (size_t i = 0; i < cap; ++i, ++next) {  // grows the stripes
+            CHECK(r.insert("w" + std::to_string(next), 2, next));
+            ids.push_back(next);
+        }
+        for (uint64_t id : ids) r.erase("w" + std::to_string(id), id);  // rehashes them
+    }
+    stop = true;
+    for (std::thread &t : readers) t.join();
+    CHECK(r.capacity() > cap);
+    CHECK(r.size() == stable);
+    CHECK(reads > 0);
+    CHECK(wrong == 0);
+}
+
+int main() {
+    test_ownership();
+    test_tombstones();
+    test_growth();
+    test_reads_during_rehash();
+    printf("test_nick_registry: ok\n");
+    return 0;
+}
@@ -0,0 +1,91 @@
+// Unit tests for reactions.h: one count per member and kind, hash growth,
+// and expiry through tombstones that later inserts reuse.
+#include <cstdio>
+#include <string>
+
+#include "check.h"
+#include "reactions.h"
+
+static void test_counts_per_member() {
+    ReactionCounters r;
+    CHECK(r.add(7, 1, "up", false));
+    CHECK(r.add(7, 1, "up", false));  // again: no change
+    CHECK(r.add(7, 2, "up", false));
+    CHECK(r.add(7, 2, "down", false));
+    CHECK(r.snapshot(7) == "REACTIONS 7 up=2 down=1\n");
+    CHECK(r.add(7, 3, "up", true));   // never reacted: no change
+    CHECK(r.add(7, 1, "up", true));
+    CHECK(r.add(7, 1, "up", true));
+    CHECK(r.snapshot(7) == "REACTIONS 7 up=1 down=1\n");
+    CHECK(r.take_dirty().size() == 1);
+    CHECK(!r.has_dirty());
+
+    for (size_t k = 2; k < REACTION_MAX_KINDS; ++k) CHECK(r.add(7, 1, "k" + std::to_string(k), false));
+    CHECK(!r.add(7, 1, "onetoomany", false));
+    CHECK(r.snapshot(8) == "REACTIONS 8\n");
+}
+
+// Totals survive the table doubling.
+static void test_growth() {
+    ReactionCounters r;
+    size_t start = r.capacity();
+    const uint64_t n = start * 4;
+    for (uint64_t seq = 1; seq <= n; ++seq) CHECK(r.add(seq, (uint32_t)seq % 5, "up", false));
+    CHECK(r.size() == n);
+    CHECK(r.capacity() >= n * 4 / 3);
+    CHECK(r.tombstones() == 0);
+    for (uint64_t seq = 1; seq <= n; ++seq) CHECK(r.snapshot(seq) == "REACTIONS " + std::to_string(seq) + " up=1\n");
+    CHECK(r.take_dirty().size() == n);
+}
+
+// Expired messages leave tombstones; new messages take their slots instead
+// of growing the table, and an expired message takes no more reactions.
+static void test_expiry_and_tombstones() {
+    ReactionCounters r;
+    const uint64_t n = 300;  // under half the initial capacity
+    for (uint64_t seq = 1; seq <= n; ++seq) CHECK(r.add(seq, 1, "up", false));
+    size_t cap = r.capacity();
+    CHECK(r.has_dirty());
+
+    r.expire(REACTION_WINDOW / 16 - 1);  // not far enough along yet
+    CHECK(r.oldest() == 0);
+    uint64_t oldest = n / 2 + 1;
+    r.expire(oldest + REACTION_WINDOW / 16);
+    r.expire(0);
+    CHECK(r.oldest() == oldest + REACTION_WINDOW / 16);
+    CHECK(r.size() == 0);
+    CHECK(r.tombstones() == n);
+    CHECK(r.take_dirty().empty());  // expired before the flush
+    CHECK(r.snapshot(1) == "REACTIONS 1\n");
+
+    // a few more rounds of the same number of messages: the table neither
+    // grows nor fills up with tombstones
+    uint64_t next = r.oldest();
+    for (int round = 0; round < 20; ++round) {
+        uint64_t first = next;
+        for (uint64_t i = 0; i < n; ++i, ++next) CHECK(r.add(next, 1, "up", false));
+        if (round == 0) CHECK(r.tombstones() < n);  // some were reused (no rehash at this load)
+        for (uint64_t seq = first; seq < next; ++seq) CHECK(r.add(seq, 2, "up", false));
+        CHECK(r.snapshot(first) == "REACTIONS " + std::to_string(first) + " up=2\n");
+        CHECK(r.size() == n);
+        CHECK(r.capacity() == cap);
+        r.expire(next + REACTION_WINDOW / 16);
+        CHECK(r.size() == 0);
+        next = r.oldest();
+    }
+    CHECK(r.tombstones() <= cap * 3 / 4);
+
+    // below the window: ignored, and the member set was forgotten too
+    CHECK(r.add(1, 1, "up", false));
+    CHECK(r.snapshot(1) == "REACTIONS 1\n");
+    CHECK(r.add(next, 1, "up", false));
+    CHECK(r.snapshot(next) == "REACTIONS " + std::to_string(next) + " up=1\n");
+}
+
+int main() {
+    test_counts_per_member();
+    test_growth();
+    test_expiry_and_tombstones();
+    printf("test_reactions: ok\n");
+    return 0;
+}
@@ -0,0 +1,137 @@
+// Unit tests for read_receipts.h: the array/bitset switch of RoaringBitmap
+// and ReadReceipts::readers() against a plain count.
+#include <cstdio>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "check.h"
+#include "read_receipts.h"
+
+static std::vector<uint32_t> members(const RoaringBitmap &b) {
+    std::vector<uint32_t> out;
+    b.for_each([&](uint32_t m) { out.push_back(m); });
+    return out;
+}
+
+// A container turns into a bitset past ROARING_ARRAY_MAX values and only
+// back into an array at half that, so add/remove around one size does not
+// convert every time.
+static void test_container_hysteresis() {
+    RoaringBitmap b;
+    std::set<uint32_t> want;
+    for (uint32_t v = 0; v < ROARING_ARRAY_MAX; ++v) {
+        CHECK(b.add(v * 3));
+        want.insert(v * 3);
+    }
+    CHECK(b.bitsets() == 0);
+    CHECK(!b.add(3));
+    CHECK(b.add(ROARING_ARRAY_MAX * 3));
+    want.insert(ROARING_ARRAY_MAX * 3);
+    CHECK(b.bitsets() == 1);
+
+    // down to just above half: still a bitset
+    for (uint32_t v = 0; b.cardinality() > ROARING_ARRAY_MAX / 2 + 1; ++v) {
+        CHECK(b.remove(v * 3));
+        want.erase(v * 3);
+    }
+    CHECK(b.bitsets() == 1);
+    CHECK(!b.remove(1));
+    uint32_t first = *want.begin();
+    CHECK(b.remove(first));
+    want.erase(first);
+    CHECK(b.bitsets() == 0);
+    CHECK(b.cardinality() == ROARING_ARRAY_MAX / 2);
+    CHECK(members(b) == std::vector<uint32_t>(want.begin(), want.end()));
+
+    // and back up to the limit as an array
+    for (uint32_t v = 0; b.cardinality() < ROARING_ARRAY_MAX; ++v) {
+        if (b.add(v * 3 + 1)) want.insert(v * 3 + 1);
+    }
+    CHECK(b.bitsets() == 0);
+    CHECK(members(b) == std::vector<uint32_t>(want.begin(), want.end()));
+}
+
+// Containers are independent; an emptied one goes away.
+static void test_containers() {
+    RoaringBitmap b;
+    CHECK(b.add(5));
+    CHECK(b.add(70000));
+    CHECK(b.add(0xffffffffu));
+    CHECK((members(b) == std::vector<uint32_t>{5, 70000, 0xffffffffu}));
+    CHECK(!b.remove(70001));
+    CHECK(b.remove(70000));
+    CHECK(b.cardinality() == 2);
+    CHECK(b.remove(5));
+    CHECK(b.remove(0xffffffffu));
+    CHECK(b.empty());
+    CHECK(members(b).empty());
+}
+
+static uint64_t count_readers(const std::vector<uint64_t> &pos, uint64_t seq) {
+    uint64_t n = 0;
+    for (uint64_t p : pos) n += p >= seq;
+    return n;
+}
+
+// Positions spread over many windows, queried on and around window edges.
+static void test_readers_across_windows() {
+    ReadReceipts r;
+    std::mt19937_64 rng(1);
+    const size_t nicks = 3000;
+    const uint64_t newest = RECEIPT_WINDOW * 10 + 17;
+    std::vector<uint64_t> pos(nicks, 0);
+    for (int round = 0; round < 20000; ++round) {
+        size_t i = rng() % nicks;
+        uint32_t m = r.member("nick" + std::to_string(i));
+        uint64_t seq = 1 + rng() % newest;
+        r.advance(m, seq);
+        pos[i] = std::max(pos[i], seq);  // positions never move back
+        CHECK(r.position(m) == pos[i]);
+    }
+    for (uint64_t w = 0; w <= newest / RECEIPT_WINDOW; ++w) {
+        for (uint64_t seq : {w * RECEIPT_WINDOW, w * RECEIPT_WINDOW + 1, (w + 1) * RECEIPT_WINDOW - 1}) {
+            if (seq == 0 || seq > newest) continue;
+            CHECK(r.readers(seq) == count_readers(pos, seq));
+        }
+    }
+    for (int i = 0; i < 1000; ++i) {
+        uint64_t seq = 1 + rng() % newest;
+        CHECK(r.readers(seq) == count_readers(pos, seq));
+    }
+    CHECK(r.readers(newest + 1) == 0);
+
+    // the same nick keeps its member index
+    CHECK(r.member("nick0") == r.member("nick0"));
+}
+
+// Moves inside one window update its counts; an emptied window starts
+// again from zero counts.
+static void test_readers_within_window() {
+    ReadReceipts r;
+    uint32_t a = r.member("a"), b = r.member("b");
+    r.advance(a, 10);
+    r.advance(b, 20);
+    CHECK(r.readers(10) == 2);
+    CHECK(r.readers(11) == 1);
+    r.advance(a, 30);
+    CHECK(r.readers(11) == 2);
+    CHECK(r.readers(21) == 1);
+    CHECK(r.readers(31) == 0);
+    r.advance(a, RECEIPT_WINDOW + 5);
+    r.advance(b, RECEIPT_WINDOW + 5);
+    CHECK(r.readers(1) == 2);
+    CHECK(r.readers(RECEIPT_WINDOW) == 2);
+    r.advance(a, RECEIPT_WINDOW * 2);
+    CHECK(r.readers(RECEIPT_WINDOW + 6) == 1);
+    CHECK(r.readers(RECEIPT_WINDOW * 2) == 1);
+}
+
+int main() {
+    test_container_hysteresis();
+    test_containers();
+    test_readers_across_windows();
+    test_readers_within_window();
+    printf("test_read_receipts: ok\n");
+    return 0;
+}
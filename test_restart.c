@@ -0,0 +1,76 @@
+// Restart test for the state snapshot: runs ./cserverd with a journal, a
+// room worker and a snapshot every second, kills it, starts it again on the
+// same journal and checks that room IDs go on increasing, a RELIABLE nick
+// resumes after its last ACK, and a held nick is kept for its address.
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "check.h"
+#include "test_net.h"
+
+static int port;
+static char dir[] = "/tmp/test_restart.XXXXXX";
+
+static void start() {
+    start_server({"-j", dir, "-w", "1", "-P", "1", "127.0.0.1:" + std::to_string(port)});
+}
+
+static Conn login(const std::string &nick) {
+    Conn c = connect_to(port);
+    login(c, nick);
+    return c;
+}
+
+int main() {
+    signal(SIGPIPE, SIG_IGN);
+    CHECK(mkdtemp(dir));
+    port = 20000 + getpid() % 20000;
+
+    atexit(stop_server);
+    start();
+    Conn a = login("a");
+    send_line(a, "IDS");
+    expect(a, "OK");
+    send_line(a, "JOIN r");
+    expect(a, "JOINED r");
+    send_line(a, "MSG one");
+    CHECK(next_id(a) == 1);
+    send_line(a, "MSG two");
+    CHECK(next_id(a) == 2);
+
+    Conn c = login("c");
+    send_line(c, "IDS");
+    expect(c, "OK");
+    for (uint64_t i = 1; i <= 3; ++i) {
+        send_line(c, "MSG lobby");
+        CHECK(next_id(c) == i);
+    }
+    Conn b = login("b");
+    send_line(b, "RELIABLE 0");
+    CHECK(expect(b, "RESEND ") == "RESEND 1 3");
+    send_line(b, "ACK 2");
+    usleep(2500 * 1000);  // a snapshot after the ACK
+    stop_server();
+    close(a.fd);
+    close(b.fd);
+    close(c.fd);
+
+    start();
+    a = login("a");  // reserved for 127.0.0.1
+    send_line(a, "IDS");
+    expect(a, "OK");
+    send_line(a, "JOIN r");
+    expect(a, "JOINED r");
+    send_line(a, "MSG three");
+    CHECK(next_id(a) > 2);
+    b = login("b");
+    send_line(b, "RELIABLE");
+    CHECK(expect(b, "RESEND ") == "RESEND 3 1");
+    stop_server();
+
+    std::string rm = std::string("rm -rf ") + dir;
+    CHECK(system(rm.c_str()) == 0);
+    printf("test_restart: ok\n");
+    return 0;
+}
@@ -0,0 +1,104 @@
+// Unit tests for sketches.h: HyperLogLog error bounds and the heavy-hitter
+// candidates of HeavyHitters.
+#include <cmath>
+#include <cstdio>
+#include <set>
+#include <string>
+
+#include "check.h"
+#include "sketches.h"
+
+// Standard error is 1.04 / sqrt(4096), about 1.6%; allow four of them on
+// each size, and an average error of less than two over all of them.
+static void test_hll_error() {
+    double total = 0;
+    int sizes = 0;
+    for (uint64_t n : {10, 100, 1000, 5000, 20000, 100000, 1000000}) {
+        HyperLogLog hll;
+        for (uint64_t i = 0; i < n; ++i) {
+            uint64_t h = hash_nick("nick" + std::to_string(i));
+            hll.add(h);
+            if (i % 3 == 0) hll.add(h);  // repeats do not count
+        }
+        double err = std::fabs((double)hll.estimate() - n) / n;
+        CHECK(err < 4 * 0.016);
+        total += err;
+        sizes++;
+    }
+    CHECK(total / sizes < 2 * 0.016);
+
+    HyperLogLog hll;
+    CHECK(hll.estimate() == 0);
+    hll.add(hash_nick("a"));
+    CHECK(hll.estimate() == 1);
+    hll.clear();
+    CHECK(hll.estimate() == 0);
+}
+
+static std::set<std::string> nicks_of(const HeavyHitters &hh, size_t n) {
+    std::set<std::string> out;
+    for (auto &p : hh.largest(n)) out.insert(p.first);
+    return out;
+}
+
+// Once the candidate list is full, a newcomer only replaces a candidate
+// whose count it passes.
+static void test_full_list() {
+    HeavyHitters hh;
+    std::set<std::string> first;
+    for (size_t i = 0; i < SKETCH_TOP; ++i) {
+        std::string nick = "talker" + std::to_string(i);
+        first.insert(nick);
+        for (int k = 0; k < 10; ++k) hh.add(hash_nick(nick), nick);
+    }
+    for (int k = 0; k < 5; ++k) hh.add(hash_nick("newcomer"), "newcomer");
+    CHECK(nicks_of(hh, SKETCH_TOP) == first);
+
+    for (int k = 0; k < 6; ++k) hh.add(hash_nick("newcomer"), "newcomer");
+    std::set<std::string> now = nicks_of(hh, SKETCH_TOP);
+    CHECK(now.count("newcomer"));
+    CHECK(now.size() == SKETCH_TOP);
+
+    // the candidate it replaced can come back the same way
+    std::string out;
+    for (const std::string &nick : first) {
+        if (!now.count(nick)) out = nick;
+    }
+    CHECK(!out.empty());
+    for (int k = 0; k < 2; ++k) hh.add(hash_nick(out), out);
+    CHECK(nicks_of(hh, SKETCH_TOP).count(out));
+}
+
+// A few loud senders among many quiet ones end up on top, with counts that
+// are never below the true ones.
+static void test_heavy_hitters() {
+    HeavyHitters hh;
+    for (int round = 0; round < 200; ++round) {
+        for (int i = 0; i < 5; ++i) {
+            std::string nick = "loud" + std::to_string(i);
+            for (int k = 0; k <= i; ++k) hh.add(hash_nick(nick), nick);
+        }
+        for (int i = 0; i < 50; ++i) {
+            std::string nick = "quiet" + std::to_string(round * 50 + i);
+            hh.add(hash_nick(nick), nick);
+        }
+    }
+    auto top = hh.largest(5);
+    CHECK(top.size() == 5);
+    for (int i = 0; i < 5; ++i) {
+        CHECK(top[i].first == "loud" + std::to_string(4 - i));
+        uint32_t truth = 200 * (5 - i);
+        CHECK(top[i].second >= truth && top[i].second < truth + 50);
+    }
+    CHECK(hh.largest(100).size() == SKETCH_TOP);
+    hh.clear();
+    CHECK(hh.largest(5).empty());
+}
+
+int main() {
+    test_hll_error();
+    test_full_list();
+    test_heavy_hitters();
+    printf("test_sketches: ok\n");
+    return 0;
+}